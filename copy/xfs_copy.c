@@ -10,6 +10,9 @@
 #include <pthread.h>
 #include <signal.h>
 #include <stdarg.h>
+#if defined(HAVE_FALLOCATE)
+#include <linux/falloc.h>
+#endif
 #include "xfs_copy.h"
 #include "libxlog.h"
 #include "libfrog/platform.h"
@@ -17,6 +20,10 @@
 #define	rounddown(x, y)	(((x)/(y))*(y))
 #define uuid_equal(s,d) (platform_uuid_compare((s),(d)) == 0)
 
+#ifndef FALLOC_FL_PUNCH_HOLE
+#define FALLOC_FL_PUNCH_HOLE	0x02
+#endif
+
 extern int	platform_check_ismounted(char *, char *, struct stat *, int);
 
 static char 		*logfile_name;
@@ -25,6 +32,8 @@ static char		LOGFILE_NAME[] = "/var/tmp/xfs_copy.log.XXXXXX";
 
 static char		*source_name;
 static int		source_fd;
+static dev_t		source_dev;		/* fs holding a source file */
+static xfs_off_t	source_size;		/* length of a source file */
 
 static unsigned int	source_blocksize;	/* source filesystem blocksize */
 static unsigned int	source_sectorsize;	/* source disk sectorsize */
@@ -183,6 +192,75 @@ check_errors(void)
 	}
 }
 
+static bool
+buf_is_zero(
+	const char	*p,
+	size_t		len)
+{
+	return p[0] == 0 && memcmp(p, p + 1, len - 1) == 0;
+}
+
+/*
+ * Punch out a zeroed range of a regular file target in case it holds stale
+ * data.  If the target filesystem can't do that, stop trying and write the
+ * zeroes instead.
+ */
+static bool
+punch_hole(
+	target_control	*t,
+	xfs_off_t	pos,
+	size_t		len)
+{
+#if defined(HAVE_FALLOCATE)
+	if (fallocate(t->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+			pos, len) == 0)
+		return true;
+#endif
+	t->sparse = 0;
+	return false;
+}
+
+/*
+ * Regular file targets only get the parts of the buffer that aren't zeroed,
+ * so free space and empty log blocks stay holes in the image.  The buffer is
+ * split into runs of whole target blocks that are either all zeroes or not.
+ */
+static int
+do_sparse_write(
+	thread_args	*args,
+	wbuf		*buf)
+{
+	target_control	*t = &target[args->id];
+	size_t		unit = roundup(t->hole_size, buf->min_io_size);
+	size_t		off, end, len;
+	bool		zero;
+
+	for (off = 0; off < buf->length; off = end)  {
+		len = min(unit, buf->length - off);
+		zero = buf_is_zero(buf->data + off, len);
+		for (end = off + len; end < buf->length; end += len)  {
+			len = min(unit, buf->length - end);
+			if (buf_is_zero(buf->data + end, len) != zero)
+				break;
+		}
+
+		if (zero && t->sparse &&
+		    punch_hole(t, buf->position + off, end - off))
+			continue;
+
+		if (pwrite(t->fd, buf->data + off, end - off,
+				buf->position + off) != end - off)  {
+			t->error = errno;
+			t->position = buf->position + off;
+			return 2;
+		}
+	}
+
+	/* pwrite doesn't move the file offset, make do_write seek again */
+	t->position = -1;
+	return 0;
+}
+
 /*
  * don't have to worry about alignment and mins because those
  * are taken care of when the buffer's read in
@@ -198,6 +276,11 @@ do_write(
 	if (!buf)
 		buf = &w_buf;
 
+	if (target[args->id].cloned)
+		return 0;
+	if (target[args->id].sparse)
+		return do_sparse_write(args, buf);
+
 	if (target[args->id].position != buf->position)  {
 		if (lseek(args->fd, buf->position, SEEK_SET) < 0)  {
 			error = target[args->id].err_type = 1;
@@ -379,6 +462,59 @@ wbuf_init(wbuf *buf, int data_size, int data_align, int min_io_size, int id)
 	return buf;
 }
 
+/*
+ * Clone a range of the source into the targets that share its reflink capable
+ * filesystem instead of reading and writing it.  Clones cover whole target
+ * blocks, so skip ranges where that would reach back below @floor into the
+ * AG header; targets that can't clone at all copy from then on.  Returns true
+ * if no target needs the range copied.
+ */
+static bool
+clone_range(
+	xfs_off_t		pos,
+	xfs_off_t		len,
+	xfs_off_t		floor)
+{
+	struct xfs_clone_args	args;
+	xfs_off_t		start, end;
+	bool			copy = false;
+	int			i;
+
+	for (i = 0; i < num_targets; i++)  {
+		target[i].cloned = 0;
+		if (target[i].state == INACTIVE)
+			continue;
+		start = rounddown(pos, (xfs_off_t)target[i].hole_size);
+		if (!target[i].clone || start < floor)  {
+			copy = true;
+			continue;
+		}
+		end = roundup(pos + len, (xfs_off_t)target[i].hole_size);
+		end = min(end, source_size);
+
+		args.src_fd = source_fd;
+		args.src_offset = start;
+		args.src_length = end - start;
+		args.dest_offset = start;
+		if (ioctl(target[i].fd, XFS_IOC_CLONE_RANGE, &args) < 0)  {
+			target[i].clone = 0;
+			copy = true;
+			continue;
+		}
+		target[i].cloned = 1;
+	}
+	return !copy;
+}
+
+static void
+clone_done(void)
+{
+	int			i;
+
+	for (i = 0; i < num_targets; i++)
+		target[i].cloned = 0;
+}
+
 static void
 read_wbuf(int fd, wbuf *buf, xfs_mount_t *mp)
 {
@@ -652,6 +788,10 @@ main(int argc, char **argv)
 		target[i].state = INACTIVE;
 		target[i].error = 0;
 		target[i].err_type = 0;
+		target[i].sparse = 0;
+		target[i].clone = 0;
+		target[i].cloned = 0;
+		target[i].hole_size = 0;
 	}
 
 	/* open up source -- is it a file? */
@@ -670,8 +810,11 @@ main(int argc, char **argv)
 		die_perror();
 	}
 
-	if (S_ISREG(statbuf.st_mode))
+	if (S_ISREG(statbuf.st_mode))  {
 		source_is_file = 1;
+		source_dev = statbuf.st_dev;
+		source_size = statbuf.st_size;
+	}
 
 	if (source_is_file && platform_test_xfs_fd(source_fd))  {
 		if (fcntl(source_fd, F_SETFL, open_flags | O_DIRECT) < 0)  {
@@ -872,6 +1015,21 @@ main(int argc, char **argv)
 					progname);
 				die_perror();
 			}
+
+			/*
+			 * Image files only get allocated where there is
+			 * something to write, and share data extents with a
+			 * source file on the same filesystem if it can.
+			 */
+			if (fstat(target[i].fd, &statbuf) < 0)  {
+				do_log(_("%s:  couldn't stat target \"%s\"\n"),
+					progname, target[i].name);
+				die_perror();
+			}
+			target[i].sparse = 1;
+			target[i].hole_size = max(statbuf.st_blksize, BBSIZE);
+			if (source_is_file && statbuf.st_dev == source_dev)
+				target[i].clone = 1;
 			if (platform_test_xfs_fd(target[i].fd))  {
 				if (xfsctl(target[i].name, target[i].fd,
 						XFS_IOC_DIOINFO, &d) < 0)  {
@@ -1108,6 +1266,15 @@ main(int argc, char **argv)
 					w_buf.position = (xfs_off_t)
 						begin << BBSHIFT;
 
+					if (clone_range(w_buf.position, size,
+							(xfs_off_t)ag_begin <<
+								BBSHIFT))  {
+						numblocks += sizeb;
+						howfar = bump_bar(
+							howfar, numblocks);
+						size = 0;
+					}
+
 					while (size > 0)  {
 						/*
 						 * let lower layer do alignment
@@ -1131,6 +1298,7 @@ main(int argc, char **argv)
 						howfar = bump_bar(
 							howfar, numblocks);
 					}
+					clone_done();
 				}
 
 				/* round next starting point down */
@@ -1179,6 +1347,13 @@ main(int argc, char **argv)
 
 				w_buf.position = (xfs_off_t) begin << BBSHIFT;
 
+				if (clone_range(w_buf.position, size,
+						(xfs_off_t)ag_begin << BBSHIFT))  {
+					numblocks += sizeb;
+					howfar = bump_bar(howfar, numblocks);
+					size = 0;
+				}
+
 				while (size > 0)  {
 					/*
 					 * let lower layer do alignment
@@ -1201,6 +1376,7 @@ main(int argc, char **argv)
 
 					howfar = bump_bar(howfar, numblocks);
 				}
+				clone_done();
 			}
 		}
 	}
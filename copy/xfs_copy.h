@@ -74,4 +74,8 @@ typedef struct {
 	int		state;
 	int		error;
 	int		err_type;
+	int		sparse;		/* regular file, zeroes become holes */
+	int		clone;		/* shares a reflink fs with the source */
+	int		cloned;		/* current range was cloned, not copied */
+	size_t		hole_size;	/* block size of the target file */
 } target_control;
@@ -64,6 +64,8 @@ typedef unsigned int (*cache_node_hash_t)(cache_key_t, unsigned int,
 					  unsigned int);
 typedef int (*cache_node_compare_t)(struct cache_node *, cache_key_t);
 typedef unsigned int (*cache_bulk_relse_t)(struct cache *, struct list_head *);
+typedef unsigned long long (*cache_bulk_flush_t)(struct cache *,
+					struct cache_node **, unsigned int);
 
 struct cache_operations {
 	cache_node_hash_t	hash;
@@ -72,6 +74,7 @@ struct cache_operations {
 	cache_node_relse_t	relse;
 	cache_node_compare_t	compare;
 	cache_bulk_relse_t	bulkrelse;	/* optional */
+	cache_bulk_flush_t	bulkflush;	/* optional */
 };
 
 struct cache_hash {
@@ -107,6 +110,7 @@ struct cache {
 	cache_node_relse_t	relse;		/* memory free function */
 	cache_node_compare_t	compare;	/* comparison routine */
 	cache_bulk_relse_t	bulkrelse;	/* bulk release routine */
+	cache_bulk_flush_t	bulkflush;	/* bulk flush routine */
 	unsigned int		c_hashsize;	/* hash bucket count */
 	unsigned int		c_hashshift;	/* hash key shift */
 	struct cache_hash	*c_hash;	/* hash table buckets */
@@ -114,6 +118,9 @@ struct cache {
 	unsigned long long	c_misses;	/* cache misses */
 	unsigned long long	c_hits;		/* cache hits */
 	unsigned int 		c_max;		/* max nodes ever used */
+	unsigned long long	c_flushes;	/* bulk flushes */
+	unsigned long long	c_flush_bytes;	/* bytes written by them */
+	unsigned long long	c_flush_usecs;	/* time spent in them */
 };
 
 struct cache *cache_init(int, unsigned int, struct cache_operations *);
@@ -124,6 +131,7 @@ void cache_flush(struct cache *);
 
 int cache_node_get(struct cache *, cache_key_t, struct cache_node **);
 void cache_node_put(struct cache *, struct cache_node *);
+void cache_node_hold(struct cache *, struct cache_node *);
 void cache_node_set_priority(struct cache *, struct cache_node *, int);
 int cache_node_get_priority(struct cache_node *);
 int cache_node_purge(struct cache *, cache_key_t, struct cache_node *);
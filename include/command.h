@@ -6,6 +6,8 @@
 #ifndef __COMMAND_H__
 #define __COMMAND_H__
 
+#include <stddef.h>
+#include <stdint.h>
 #include <sys/time.h>
 
 /*
@@ -57,5 +59,7 @@ extern int		command(const cmdinfo_t *ci, int argc, char **argv);
 extern void		report_io_times(const char *verb, struct timeval *t2,
 					long long offset, long long count,
 					long long total, int ops, int compact);
+extern void		report_latency(const char *what, uint64_t *samples,
+					size_t nr, int compact);
 
 #endif	/* __COMMAND_H__ */
@@ -22,10 +22,15 @@ extern int  handle_to_fshandle (void *__hanp, size_t __hlen, void **__fshanp,
 extern void free_handle (void *__hanp, size_t __hlen);
 extern int  open_by_fshandle (void *__fshanp, size_t __fshlen, int __rw);
 extern int  open_by_handle (void *__hanp, size_t __hlen, int __rw);
+extern int  open_by_handle_batch (void **__hanps, size_t *__hlens, int __nr,
+				  int __rw, int *__fds);
 extern int  readlink_by_handle (void *__hanp, size_t __hlen, void *__buf,
 				size_t __bs);
 extern int  attr_multi_by_handle (void *__hanp, size_t __hlen, void *__buf,
 				  int __rtrvcnt, int __flags);
+extern int  attr_multi_by_handle_batch (void **__hanps, size_t *__hlens,
+					void **__bufs, int *__rtrvcnts,
+					int __nr, int __flags, int *__results);
 extern int  attr_list_by_handle (void *__hanp, size_t __hlen, void *__buf,
 				 size_t __bufsize, int __flags,
 				 struct attrlist_cursor *__cursor);
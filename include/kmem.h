@@ -11,12 +11,40 @@
 #define KM_LARGE	0x0010u
 #define KM_NOLOCKDEP	0x0020u
 
+struct kmem_magazine;
+struct kmem_slab;
+
+/*
+ * Objects are carved out of large slabs and handed out through small
+ * per-thread magazines, which are refilled from and drained into a shared
+ * depot under the cache lock.  Set LIBXFS_KMEM_MALLOC in the environment to
+ * allocate every object with malloc instead, e.g. for memory debuggers.
+ */
 struct kmem_cache {
 	int		cache_unitsize;	/* Size in bytes of cache unit */
-	int		allocated;	/* debug: How many allocated? */
+	long long	allocated;	/* debug: net allocs of exited threads */
 	unsigned int	align;
 	const char	*cache_name;	/* tag name */
 	void		(*ctor)(void *);
+
+	pthread_mutex_t	lock;		/* protects everything below */
+	pthread_key_t	mag_key;	/* this thread's magazine */
+	bool		use_malloc;	/* bypass the slabs */
+	unsigned int	objsize;	/* unit size rounded up for alignment */
+	unsigned int	slab_objs;	/* objects per slab */
+	struct kmem_slab *slabs;	/* all slabs */
+	char		*slab_next;	/* uncarved part of the newest slab */
+	unsigned int	slab_left;	/* objects left there */
+	void		**depot;	/* free objects not in a magazine */
+	unsigned int	depot_count;
+	unsigned int	depot_size;
+	struct kmem_magazine *mags;	/* magazines of live threads */
+	struct kmem_cache *next;	/* all caches, for kmem_report */
+
+	/* statistics */
+	unsigned long long nr_slabs;
+	unsigned long long refills;	/* magazine refills from the depot */
+	unsigned long long drains;	/* magazine drains to the depot */
 };
 
 typedef unsigned int __bitwise gfp_t;
@@ -40,14 +68,9 @@ kmem_cache_init(unsigned int size, const char *name)
 
 extern void	*kmem_cache_alloc(struct kmem_cache *, gfp_t);
 extern void	*kmem_cache_zalloc(struct kmem_cache *, gfp_t);
+extern void	kmem_cache_free(struct kmem_cache *, void *);
 extern int	kmem_cache_destroy(struct kmem_cache *);
-
-static inline void
-kmem_cache_free(struct kmem_cache *cache, void *ptr)
-{
-	cache->allocated--;
-	free(ptr);
-}
+extern void	kmem_report(FILE *);
 
 extern void	*kmem_alloc(size_t, int);
 extern void	*kvmalloc(size_t, gfp_t);
@@ -100,6 +100,9 @@ typedef struct xfs_inode {
 	unsigned int		i_cformat;	/* format of cow fork */
 
 	xfs_fsize_t		i_size;		/* in-memory size */
+
+	struct xfs_dinode	*i_dcopy;	/* icache: disk inode read in */
+	bool			i_logged;	/* icache: unflushed trans */
 	struct inode		i_vnode;
 } xfs_inode_t;
 
@@ -253,8 +256,15 @@ extern int	libxfs_iflush_int (struct xfs_inode *, struct xfs_buf *);
 extern struct timespec64 current_time(struct inode *inode);
 
 /* Inode Cache Interfaces */
+extern struct cache	*libxfs_icache;
+extern struct cache_operations	libxfs_icache_operations;
+extern int	libxfs_ihash_size;
+
 extern int	libxfs_iget(struct xfs_mount *, struct xfs_trans *, xfs_ino_t,
 				uint, struct xfs_inode **);
+extern int	libxfs_iget_batch(struct xfs_mount *, xfs_ino_t *,
+				unsigned int, struct xfs_inode **);
 extern void	libxfs_irele(struct xfs_inode *ip);
+extern void	libxfs_icache_purge(void);
 
 #endif /* __XFS_INODE_H__ */
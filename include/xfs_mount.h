@@ -83,6 +83,8 @@ typedef struct xfs_mount {
 	uint64_t		m_features;	/* active filesystem features */
 	unsigned long		m_opstate;	/* dynamic state flags */
 	bool			m_finobt_nores; /* no per-AG finobt resv. */
+	unsigned int		m_trans_batch;	/* commit batch nesting */
+	bool			m_trans_batch_sb; /* sb dirtied in batch */
 	uint			m_qflags;	/* quota status flags */
 	uint			m_attroffset;	/* inode attribute offset */
 	struct xfs_trans_resv	m_resv;		/* precomputed res values */
@@ -258,6 +260,7 @@ __XFS_UNSUPP_OPSTATE(shutdown)
 #define LIBXFS_MOUNT_REPORT_CORRUPTION	(1U << 1)
 
 #define LIBXFS_BHASHSIZE(sbp) 		(1<<10)
+#define LIBXFS_IHASHSIZE(sbp) 		(1<<9)
 
 void libxfs_compute_all_maxlevels(struct xfs_mount *mp);
 struct xfs_mount *libxfs_mount(struct xfs_mount *mp, struct xfs_sb *sb,
@@ -11,6 +11,7 @@
 #include "libfrog/fsgeom.h"
 #include "libfrog/bulkstat.h"
 #include "libfrog/paths.h"
+#include "libfrog/workqueue.h"
 #include "io.h"
 #include "input.h"
 
@@ -60,6 +61,310 @@ dump_bulkstat(
 	printf("\tbs_extents64 = %"PRIu64"\n", bstat->bs_extents64);
 };
 
+/*
+ * Benchmark mode for bulkstat and inumbers
+ *
+ * Walk every AG (or just one) in parallel, one AG per work item, and time
+ * each ioctl.  Records can be streamed to a file in the raw struct
+ * xfs_bulkstat or struct xfs_inumbers format instead of being printed.
+ */
+struct iscan_ag {
+	uint64_t		*samples;	/* ioctl latency, in ns */
+	size_t			nr_samples;
+	size_t			size;
+	unsigned long long	inodes;
+	unsigned long long	records;
+	int			error;
+};
+
+struct iscan {
+	struct xfs_fd		*xfd;
+	struct iscan_ag		*ags;
+	uint32_t		batch_size;
+	bool			inumbers;
+	int			outfd;
+	pthread_mutex_t		outlock;
+};
+
+static inline uint64_t
+iscan_now(void)
+{
+	struct timespec		ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int
+iscan_add_sample(
+	struct iscan_ag		*ag,
+	uint64_t		nsec)
+{
+	uint64_t		*p;
+
+	if (ag->nr_samples == ag->size) {
+		size_t		new_size = max(64, ag->size * 2);
+
+		p = realloc(ag->samples, new_size * sizeof(uint64_t));
+		if (!p)
+			return errno;
+		ag->samples = p;
+		ag->size = new_size;
+	}
+	ag->samples[ag->nr_samples++] = nsec;
+	return 0;
+}
+
+static int
+iscan_output(
+	struct iscan		*is,
+	const void		*buf,
+	size_t			len)
+{
+	ssize_t			ret;
+	int			error = 0;
+
+	pthread_mutex_lock(&is->outlock);
+	while (len > 0) {
+		ret = write(is->outfd, buf, len);
+		if (ret < 0) {
+			error = errno;
+			break;
+		}
+		buf += ret;
+		len -= ret;
+	}
+	pthread_mutex_unlock(&is->outlock);
+	return error;
+}
+
+static int
+iscan_bulkstat_ag(
+	struct iscan		*is,
+	uint32_t		agno,
+	struct iscan_ag		*ag)
+{
+	struct xfs_bulkstat_req	*breq;
+	uint64_t		start;
+	int			ret;
+
+	ret = -xfrog_bulkstat_alloc_req(is->batch_size, 0, &breq);
+	if (ret)
+		return ret;
+	xfrog_bulkstat_set_ag(breq, agno);
+
+	for (;;) {
+		start = iscan_now();
+		ret = -xfrog_bulkstat(is->xfd, breq);
+		if (ret)
+			break;
+		ret = iscan_add_sample(ag, iscan_now() - start);
+		if (ret || breq->hdr.ocount == 0)
+			break;
+
+		ag->records += breq->hdr.ocount;
+		ag->inodes += breq->hdr.ocount;
+		if (is->outfd >= 0) {
+			ret = iscan_output(is, breq->bulkstat,
+				breq->hdr.ocount * sizeof(struct xfs_bulkstat));
+			if (ret)
+				break;
+		}
+	}
+
+	free(breq);
+	return ret;
+}
+
+static int
+iscan_inumbers_ag(
+	struct iscan		*is,
+	uint32_t		agno,
+	struct iscan_ag		*ag)
+{
+	struct xfs_inumbers_req	*ireq;
+	uint64_t		start;
+	unsigned int		i;
+	int			ret;
+
+	ret = -xfrog_inumbers_alloc_req(is->batch_size, 0, &ireq);
+	if (ret)
+		return ret;
+	xfrog_inumbers_set_ag(ireq, agno);
+
+	for (;;) {
+		start = iscan_now();
+		ret = -xfrog_inumbers(is->xfd, ireq);
+		if (ret)
+			break;
+		ret = iscan_add_sample(ag, iscan_now() - start);
+		if (ret || ireq->hdr.ocount == 0)
+			break;
+
+		ag->records += ireq->hdr.ocount;
+		for (i = 0; i < ireq->hdr.ocount; i++)
+			ag->inodes += ireq->inumbers[i].xi_alloccount;
+		if (is->outfd >= 0) {
+			ret = iscan_output(is, ireq->inumbers,
+				ireq->hdr.ocount * sizeof(struct xfs_inumbers));
+			if (ret)
+				break;
+		}
+	}
+
+	free(ireq);
+	return ret;
+}
+
+static void
+iscan_ag(
+	struct workqueue	*wq,
+	uint32_t		agno,
+	void			*arg)
+{
+	struct iscan		*is = wq->wq_ctx;
+	struct iscan_ag		*ag = arg;
+
+	if (is->inumbers)
+		ag->error = iscan_inumbers_ag(is, agno, ag);
+	else
+		ag->error = iscan_bulkstat_ag(is, agno, ag);
+}
+
+static int
+iscan_bench(
+	struct xfs_fd		*xfd,
+	bool			inumbers,
+	uint32_t		batch_size,
+	unsigned int		nr_threads,
+	bool			has_agno,
+	uint32_t		agno,
+	const char		*outfile)
+{
+	struct iscan		is = {
+		.xfd		= xfd,
+		.batch_size	= batch_size,
+		.inumbers	= inumbers,
+		.outfd		= -1,
+	};
+	const char		*what = inumbers ? "inumbers" : "bulkstat";
+	struct workqueue	wq;
+	struct timeval		t1, t2;
+	unsigned long long	inodes = 0;
+	unsigned long long	records = 0;
+	uint64_t		*samples = NULL;
+	size_t			nr_samples = 0;
+	uint32_t		agcount = xfd->fsgeom.agcount;
+	uint32_t		first_ag = 0, last_ag = agcount - 1;
+	uint32_t		i;
+	char			ts[64];
+	int			ret, ret2;
+
+	if (has_agno) {
+		if (agno >= agcount) {
+			fprintf(stderr, _("AG %u does not exist.\n"), agno);
+			return 1;
+		}
+		first_ag = last_ag = agno;
+	}
+
+	is.ags = calloc(agcount, sizeof(struct iscan_ag));
+	if (!is.ags) {
+		perror(what);
+		return 1;
+	}
+
+	if (outfile) {
+		is.outfd = open(outfile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (is.outfd < 0) {
+			perror(outfile);
+			ret = 1;
+			goto out_ags;
+		}
+	}
+
+	ret = -pthread_mutex_init(&is.outlock, NULL);
+	if (ret) {
+		xfrog_perror(ret, what);
+		goto out_close;
+	}
+
+	ret = -workqueue_create(&wq, &is, nr_threads);
+	if (ret) {
+		xfrog_perror(ret, "creating workqueue");
+		goto out_mutex;
+	}
+
+	gettimeofday(&t1, NULL);
+	for (i = first_ag; i <= last_ag; i++) {
+		ret = -workqueue_add(&wq, iscan_ag, i, &is.ags[i]);
+		if (ret) {
+			xfrog_perror(ret, "queueing AG scan");
+			break;
+		}
+	}
+	ret2 = -workqueue_terminate(&wq);
+	if (ret2) {
+		xfrog_perror(ret2, "finishing AG scans");
+		if (!ret)
+			ret = ret2;
+	}
+	workqueue_destroy(&wq);
+	gettimeofday(&t2, NULL);
+	t2 = tsub(t2, t1);
+
+	for (i = first_ag; i <= last_ag; i++) {
+		struct iscan_ag	*ag = &is.ags[i];
+		uint64_t	*p;
+
+		if (ag->error) {
+			fprintf(stderr, _("%s of AG %u failed: %s\n"), what, i,
+					strerror(ag->error));
+			ret = ag->error;
+		}
+		inodes += ag->inodes;
+		records += ag->records;
+
+		p = realloc(samples,
+			(nr_samples + ag->nr_samples) * sizeof(uint64_t));
+		if (!p) {
+			perror(what);
+			ret = errno;
+			continue;
+		}
+		samples = p;
+		memcpy(samples + nr_samples, ag->samples,
+				ag->nr_samples * sizeof(uint64_t));
+		nr_samples += ag->nr_samples;
+	}
+
+	timestr(&t2, ts, sizeof(ts), 0);
+	if (inumbers)
+		printf(_("%s: %llu inodes in %llu inode groups, %zu calls of up to %u records\n"),
+			what, inodes, records, nr_samples, batch_size);
+	else
+		printf(_("%s: %llu inodes, %zu calls of up to %u records\n"),
+			what, inodes, nr_samples, batch_size);
+	printf(_("%u AGs with %u threads in %s (%.1f inodes/sec, %.1f calls/sec)\n"),
+		last_ag - first_ag + 1, nr_threads, ts,
+		tdiv(inodes, t2), tdiv(nr_samples, t2));
+	report_latency(what, samples, nr_samples, 0);
+
+	free(samples);
+out_mutex:
+	pthread_mutex_destroy(&is.outlock);
+out_close:
+	if (is.outfd >= 0 && close(is.outfd)) {
+		perror(outfile);
+		ret = 1;
+	}
+out_ags:
+	for (i = 0; i < agcount; i++)
+		free(is.ags[i].samples);
+	free(is.ags);
+	return ret ? 1 : 0;
+}
+
 static void
 bulkstat_help(void)
 {
@@ -72,7 +377,12 @@ bulkstat_help(void)
 "   -e <ino>   Stop after this inode.\n"
 "   -n <nr>    Ask for this many results at once.\n"
 "   -s <ino>   Inode to start with.\n"
-"   -v <ver>   Use this version of the ioctl (1 or 5).\n"));
+"   -v <ver>   Use this version of the ioctl (1 or 5).\n"
+"\n"
+"   -b         Benchmark mode: scan each AG in parallel and report inodes/sec\n"
+"              and ioctl latency instead of printing inodes.\n"
+"   -o <file>  In benchmark mode, write the raw bulkstat records to this file.\n"
+"   -t <nr>    In benchmark mode, scan AGs with this many threads.\n"));
 }
 
 static void
@@ -107,12 +417,28 @@ bulkstat_f(
 	bool			has_agno = false;
 	bool			debug = false;
 	bool			quiet = false;
+	bool			bench = false;
+	unsigned int		nr_threads = 1;
+	char			*outfile = NULL;
 	unsigned int		i;
 	int			c;
 	int			ret;
 
-	while ((c = getopt(argc, argv, "a:de:n:qs:v:")) != -1) {
+	while ((c = getopt(argc, argv, "a:bde:n:o:qs:t:v:")) != -1) {
 		switch (c) {
+		case 'b':
+			bench = true;
+			break;
+		case 'o':
+			outfile = optarg;
+			break;
+		case 't':
+			nr_threads = cvt_u32(optarg, 10);
+			if (errno || nr_threads == 0) {
+				perror(optarg);
+				return 1;
+			}
+			break;
 		case 'a':
 			agno = cvt_u32(optarg, 10);
 			if (errno) {
@@ -176,6 +502,13 @@ bulkstat_f(
 		return 0;
 	}
 
+	if (bench) {
+		set_xfd_flags(&xfd, ver);
+		exitcode = iscan_bench(&xfd, false, batch_size, nr_threads,
+				has_agno, agno, outfile);
+		return 0;
+	}
+
 	ret = -xfrog_bulkstat_alloc_req(batch_size, startino, &breq);
 	if (ret) {
 		xfrog_perror(ret, "alloc bulkreq");
@@ -351,7 +684,12 @@ inumbers_help(void)
 "   -e <ino>   Stop after this inode.\n"
 "   -n <nr>    Ask for this many results at once.\n"
 "   -s <ino>   Inode to start with.\n"
-"   -v <ver>   Use this version of the ioctl (1 or 5).\n"));
+"   -v <ver>   Use this version of the ioctl (1 or 5).\n"
+"\n"
+"   -b         Benchmark mode: scan each AG in parallel and report inodes/sec\n"
+"              and ioctl latency instead of printing inode groups.\n"
+"   -o <file>  In benchmark mode, write the raw inumbers records to this file.\n"
+"   -t <nr>    In benchmark mode, scan AGs with this many threads.\n"));
 }
 
 static int
@@ -368,12 +706,28 @@ inumbers_f(
 	uint32_t		ver = 0;
 	bool			has_agno = false;
 	bool			debug = false;
+	bool			bench = false;
+	unsigned int		nr_threads = 1;
+	char			*outfile = NULL;
 	unsigned int		i;
 	int			c;
 	int			ret;
 
-	while ((c = getopt(argc, argv, "a:de:n:s:v:")) != -1) {
+	while ((c = getopt(argc, argv, "a:bde:n:o:s:t:v:")) != -1) {
 		switch (c) {
+		case 'b':
+			bench = true;
+			break;
+		case 'o':
+			outfile = optarg;
+			break;
+		case 't':
+			nr_threads = cvt_u32(optarg, 10);
+			if (errno || nr_threads == 0) {
+				perror(optarg);
+				return 1;
+			}
+			break;
 		case 'a':
 			agno = cvt_u32(optarg, 10);
 			if (errno) {
@@ -434,6 +788,13 @@ inumbers_f(
 		return 0;
 	}
 
+	if (bench) {
+		set_xfd_flags(&xfd, ver);
+		exitcode = iscan_bench(&xfd, true, batch_size, nr_threads,
+				has_agno, agno, outfile);
+		return 0;
+	}
+
 	ret = -xfrog_inumbers_alloc_req(batch_size, startino, &ireq);
 	if (ret) {
 		xfrog_perror(ret, "alloc inumbersreq");
@@ -505,14 +866,14 @@ void
 bulkstat_init(void)
 {
 	bulkstat_cmd.args =
-_("[-a agno] [-d] [-e endino] [-n batchsize] [-s startino] [-v version]");
+_("[-a agno] [-d] [-e endino] [-n batchsize] [-s startino] [-v version] [-b [-o file] [-t nr]]");
 	bulkstat_cmd.oneline = _("Bulk stat of inodes in a filesystem");
 
 	bulkstat_single_cmd.args = _("[-d] [-v version] inum...");
 	bulkstat_single_cmd.oneline = _("Stat one inode in a filesystem");
 
 	inumbers_cmd.args =
-_("[-a agno] [-d] [-e endino] [-n batchsize] [-s startino] [-v version]");
+_("[-a agno] [-d] [-e endino] [-n batchsize] [-s startino] [-v version] [-b [-o file] [-t nr]]");
 	inumbers_cmd.oneline = _("Query inode groups in a filesystem");
 
 	add_command(&bulkstat_cmd);
@@ -0,0 +1,396 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Multithreaded, sparse-aware chunked copy for copy_range and sendfile.
+ */
+#include <sys/syscall.h>
+#ifdef HAVE_SENDFILE
+#include <sys/sendfile.h>
+#endif
+#if defined(HAVE_FALLOCATE)
+#include <linux/falloc.h>
+#endif
+#include "platform_defs.h"
+#include "command.h"
+#include "input.h"
+#include "init.h"
+#include "libfrog/workqueue.h"
+#include "libfrog/ptvar.h"
+#include "io.h"
+
+#ifndef FALLOC_FL_PUNCH_HOLE
+#define FALLOC_FL_PUNCH_HOLE	0x02
+#endif
+
+/* One piece of the source file to be copied by a worker. */
+struct chunk_item {
+	long long		src_off;
+	long long		dst_off;
+	long long		len;
+};
+
+/* Per-thread destination file descriptor for sendfile. */
+struct chunk_dst {
+	int			fd;
+	bool			open;
+};
+
+struct chunk_state {
+	struct chunk_copy	*cc;
+	struct ptvar		*dst_ptvar;
+	pthread_mutex_t		lock;
+	size_t			lat_size;
+};
+
+static inline uint64_t
+chunk_now(void)
+{
+	struct timespec		ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void
+chunk_set_error(
+	struct chunk_state	*cs,
+	int			error)
+{
+	pthread_mutex_lock(&cs->lock);
+	if (!cs->cc->error)
+		cs->cc->error = error;
+	pthread_mutex_unlock(&cs->lock);
+}
+
+#ifdef HAVE_SENDFILE
+/*
+ * sendfile writes at the file position of the output descriptor, so each
+ * thread needs its own open file description of the destination.
+ */
+static int
+chunk_dst_fd(
+	struct chunk_state	*cs,
+	int			*fd)
+{
+	struct chunk_dst	*cd;
+	char			path[64];
+	int			flags;
+	int			ret;
+
+	cd = ptvar_get(cs->dst_ptvar, &ret);
+	if (ret)
+		return ret;
+	if (!cd->open) {
+		/* keep O_DIRECT, O_SYNC etc. so we test the same I/O */
+		flags = fcntl(cs->cc->dst_fd, F_GETFL);
+		if (flags < 0)
+			return errno;
+		snprintf(path, sizeof(path), "/proc/self/fd/%d",
+				cs->cc->dst_fd);
+		cd->fd = open(path, (flags & ~O_ACCMODE) | O_WRONLY);
+		if (cd->fd < 0)
+			return errno;
+		cd->open = true;
+	}
+	*fd = cd->fd;
+	return 0;
+}
+
+static int
+chunk_close_dst(
+	struct ptvar		*ptv,
+	void			*data,
+	void			*arg)
+{
+	struct chunk_dst	*cd = data;
+
+	if (cd->open)
+		close(cd->fd);
+	return 0;
+}
+#endif
+
+/* Copy one chunk; returns the number of syscalls or negative errno. */
+static int
+chunk_copy_one(
+	struct chunk_state	*cs,
+	struct chunk_item	*ci,
+	long long		*copied)
+{
+	struct chunk_copy	*cc = cs->cc;
+	loff_t			src_off = ci->src_off;
+	loff_t			dst_off = ci->dst_off;
+	long long		len = ci->len;
+	ssize_t			bytes;
+	int			ops = 0;
+
+	*copied = 0;
+	switch (cc->method) {
+#ifdef HAVE_COPY_FILE_RANGE
+	case CHUNK_COPY_RANGE:
+		while (len > 0) {
+			bytes = syscall(__NR_copy_file_range, cc->src_fd,
+					&src_off, cc->dst_fd, &dst_off, len, 0);
+			if (bytes < 0)
+				return -errno;
+			if (bytes == 0)
+				break;
+			ops++;
+			len -= bytes;
+			*copied += bytes;
+		}
+		break;
+#endif
+#ifdef HAVE_SENDFILE
+	case CHUNK_COPY_SENDFILE: {
+		int		fd = -1;
+		int		ret;
+
+		ret = chunk_dst_fd(cs, &fd);
+		if (ret)
+			return -ret;
+		if (lseek(fd, dst_off, SEEK_SET) < 0)
+			return -errno;
+		while (len > 0) {
+			bytes = sendfile(fd, cc->src_fd, &src_off, len);
+			if (bytes < 0)
+				return -errno;
+			if (bytes == 0)
+				break;
+			ops++;
+			len -= bytes;
+			*copied += bytes;
+		}
+		break;
+	}
+#endif
+	default:
+		return -EOPNOTSUPP;
+	}
+
+	return ops;
+}
+
+static void
+chunk_copy_worker(
+	struct workqueue	*wq,
+	uint32_t		index,
+	void			*arg)
+{
+	struct chunk_state	*cs = wq->wq_ctx;
+	struct chunk_copy	*cc = cs->cc;
+	struct chunk_item	*ci = arg;
+	uint64_t		*lat;
+	uint64_t		start;
+	long long		copied;
+	int			ops;
+
+	if (cc->error)
+		goto out;
+
+	start = chunk_now();
+	ops = chunk_copy_one(cs, ci, &copied);
+	if (ops < 0) {
+		chunk_set_error(cs, -ops);
+		goto out;
+	}
+
+	pthread_mutex_lock(&cs->lock);
+	cc->total += copied;
+	cc->ops += ops;
+	if (cc->nr_latencies == cs->lat_size) {
+		size_t		new_size = max(1024, cs->lat_size * 2);
+
+		lat = realloc(cc->latencies, new_size * sizeof(uint64_t));
+		if (lat) {
+			cc->latencies = lat;
+			cs->lat_size = new_size;
+		}
+	}
+	if (cc->nr_latencies < cs->lat_size)
+		cc->latencies[cc->nr_latencies++] = chunk_now() - start;
+	pthread_mutex_unlock(&cs->lock);
+out:
+	free(ci);
+}
+
+static int
+chunk_queue(
+	struct workqueue	*wq,
+	struct chunk_copy	*cc,
+	long long		pos,
+	long long		end)
+{
+	struct chunk_item	*ci;
+	int			ret;
+
+	while (pos < end) {
+		ci = malloc(sizeof(struct chunk_item));
+		if (!ci)
+			return errno;
+		ci->src_off = pos;
+		ci->dst_off = cc->dst_off + (pos - cc->src_off);
+		ci->len = min(cc->chunksize, end - pos);
+		pos += ci->len;
+
+		ret = -workqueue_add(wq, chunk_copy_worker, 0, ci);
+		if (ret) {
+			free(ci);
+			return ret;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Free the destination range corresponding to a hole in the source.  Returns
+ * false if the range has to be copied instead.
+ */
+static bool
+chunk_punch_hole(
+	struct chunk_copy	*cc,
+	long long		pos,
+	long long		end)
+{
+#if defined(HAVE_FALLOCATE)
+	if (fallocate(cc->dst_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+			cc->dst_off + (pos - cc->src_off), end - pos) == 0) {
+		cc->holes += end - pos;
+		return true;
+	}
+#endif
+	return false;
+}
+
+/*
+ * Split the source range into chunks and copy them with a pool of threads.
+ * When sparse copying is enabled, holes in the source are found with
+ * SEEK_DATA/SEEK_HOLE and punched out of the destination instead of copied.
+ * Returns zero or a positive errno; cc->total and friends say how far we got.
+ */
+int
+chunk_copy(
+	struct chunk_copy	*cc)
+{
+	struct chunk_state	cs = { .cc = cc };
+	struct workqueue	wq;
+	struct stat		st;
+	long long		pos = cc->src_off;
+	long long		end = cc->src_off + cc->len;
+	long long		data, hole;
+	bool			sparse = cc->sparse;
+	int			ret, ret2;
+
+	cc->total = 0;
+	cc->holes = 0;
+	cc->ops = 0;
+	cc->error = 0;
+	cc->latencies = NULL;
+	cc->nr_latencies = 0;
+
+	if (cc->chunksize <= 0 || cc->nr_threads == 0)
+		return EINVAL;
+
+	/* Don't go looking for data past the end of the source. */
+	if (sparse) {
+		if (fstat(cc->src_fd, &st) < 0)
+			return errno;
+		end = min(end, (long long)st.st_size);
+	}
+
+	ret = -pthread_mutex_init(&cs.lock, NULL);
+	if (ret)
+		return ret;
+	ret = -ptvar_alloc(cc->nr_threads, sizeof(struct chunk_dst),
+			&cs.dst_ptvar);
+	if (ret)
+		goto out_mutex;
+	ret = -workqueue_create(&wq, &cs, cc->nr_threads);
+	if (ret)
+		goto out_ptvar;
+
+	while (pos < end && !cc->error) {
+		if (!sparse) {
+			ret = chunk_queue(&wq, cc, pos, end);
+			break;
+		}
+
+		data = lseek(cc->src_fd, pos, SEEK_DATA);
+		if (data < 0 && errno == ENXIO) {
+			data = end;
+		} else if (data < 0 && errno == EINVAL) {
+			/* No SEEK_DATA support; copy everything. */
+			sparse = false;
+			continue;
+		} else if (data < 0) {
+			ret = errno;
+			break;
+		}
+		data = min(data, end);
+
+		if (data > pos) {
+			if (!chunk_punch_hole(cc, pos, data)) {
+				ret = chunk_queue(&wq, cc, pos, data);
+				if (ret)
+					break;
+			}
+			pos = data;
+			continue;
+		}
+
+		hole = lseek(cc->src_fd, pos, SEEK_HOLE);
+		if (hole < 0) {
+			ret = errno;
+			break;
+		}
+		hole = min(hole, end);
+		ret = chunk_queue(&wq, cc, pos, hole);
+		if (ret)
+			break;
+		pos = hole;
+	}
+
+	ret2 = -workqueue_terminate(&wq);
+	if (!ret)
+		ret = ret2;
+	workqueue_destroy(&wq);
+	if (!ret)
+		ret = cc->error;
+
+	/* Holes at the end of the source still count towards the size. */
+	if (!ret && cc->holes > 0) {
+		end = cc->dst_off + (end - cc->src_off);
+		if (fstat(cc->dst_fd, &st) < 0)
+			ret = errno;
+		else if (st.st_size < end && ftruncate(cc->dst_fd, end) < 0)
+			ret = errno;
+	}
+
+#ifdef HAVE_SENDFILE
+	ptvar_foreach(cs.dst_ptvar, chunk_close_dst, NULL);
+#endif
+out_ptvar:
+	ptvar_free(cs.dst_ptvar);
+out_mutex:
+	pthread_mutex_destroy(&cs.lock);
+	return ret;
+}
+
+/* Report bandwidth and per-chunk latency of a chunked copy. */
+void
+chunk_copy_report(
+	struct chunk_copy	*cc,
+	const char		*verb,
+	struct timeval		*t,
+	int			compact)
+{
+	char			s1[64];
+
+	report_io_times(verb, t, cc->src_off, cc->len, cc->total, cc->ops,
+			compact);
+	if (!compact) {
+		cvtstr((double)cc->holes, s1, sizeof(s1));
+		printf(_("%s skipped in holes, %u threads, %lld byte chunks\n"),
+			s1, cc->nr_threads, cc->chunksize);
+	}
+	report_latency(_("chunk"), cc->latencies, cc->nr_latencies, compact);
+}
@@ -28,6 +28,14 @@ copy_range_help(void)
                           at position 0\n\
  'copy_range -f 2' - copies all bytes from open file 2 into the current open file\n\
                           at position 0\n\
+ 'copy_range -S -t 8 -c 64m some_file' - copies some_file in 64MiB chunks with\n\
+                          8 threads, skipping holes\n\
+\n\
+ -c -- split the copy into chunks of this size (default 16MiB)\n\
+ -q -- don't report bandwidth and chunk latency of a chunked copy\n\
+ -S -- preserve holes in the source file by punching them in the destination\n\
+ -t -- copy chunks with this many threads\n\
+ Passing any of -c, -S or -t selects a chunked copy.\n\
 "));
 }
 
@@ -66,6 +74,32 @@ copy_src_filesize(int fd)
 	return st.st_size;
 }
 
+static int
+copy_range_chunked(
+	struct chunk_copy	*cc,
+	bool			quiet)
+{
+	struct timeval		t1, t2;
+	int			ret;
+
+	gettimeofday(&t1, NULL);
+	ret = chunk_copy(cc);
+	gettimeofday(&t2, NULL);
+	if (ret) {
+		errno = ret;
+		perror("copy_range");
+		goto out;
+	}
+
+	if (!quiet) {
+		t2 = tsub(t2, t1);
+		chunk_copy_report(cc, "copied", &t2, 0);
+	}
+out:
+	free(cc->latencies);
+	return ret;
+}
+
 static int
 copy_range_f(int argc, char **argv)
 {
@@ -80,11 +114,43 @@ copy_range_f(int argc, char **argv)
 	int src_path_arg = 1;
 	int src_file_nr = 0;
 	size_t fsblocksize, fssectsize;
+	struct chunk_copy cc = {
+		.method = CHUNK_COPY_RANGE,
+		.chunksize = 16 << 20,
+		.nr_threads = 1,
+	};
+	bool chunked = false;
+	bool quiet = false;
 
 	init_cvtnum(&fsblocksize, &fssectsize);
 
-	while ((opt = getopt(argc, argv, "s:d:l:f:")) != -1) {
+	while ((opt = getopt(argc, argv, "s:d:l:f:c:qSt:")) != -1) {
 		switch (opt) {
+		case 'c':
+			cc.chunksize = cvtnum(fsblocksize, fssectsize, optarg);
+			if (cc.chunksize <= 0) {
+				printf(_("invalid chunk size -- %s\n"), optarg);
+				exitcode = 1;
+				return 0;
+			}
+			chunked = true;
+			break;
+		case 'q':
+			quiet = true;
+			break;
+		case 'S':
+			cc.sparse = true;
+			chunked = true;
+			break;
+		case 't':
+			cc.nr_threads = cvt_u32(optarg, 10);
+			if (errno || cc.nr_threads == 0) {
+				printf(_("invalid thread count -- %s\n"), optarg);
+				exitcode = 1;
+				return 0;
+			}
+			chunked = true;
+			break;
 		case 's':
 			src_off = cvtnum(fsblocksize, fssectsize, optarg);
 			if (src_off < 0) {
@@ -165,6 +231,18 @@ copy_range_f(int argc, char **argv)
 			len = sz - src_off;
 	}
 
+	if (chunked) {
+		cc.src_fd = fd;
+		cc.dst_fd = file->fd;
+		cc.src_off = src_off;
+		cc.dst_off = dst_off;
+		cc.len = len;
+		ret = copy_range_chunked(&cc, quiet);
+		if (ret)
+			exitcode = 1;
+		goto out;
+	}
+
 	ret = copy_file_range_cmd(fd, &src_off, &dst_off, len);
 out:
 	close(fd);
@@ -179,9 +257,10 @@ copy_range_init(void)
 	copy_range_cmd.name = "copy_range";
 	copy_range_cmd.cfunc = copy_range_f;
 	copy_range_cmd.argmin = 1;
-	copy_range_cmd.argmax = 8;
+	copy_range_cmd.argmax = -1;
 	copy_range_cmd.flags = CMD_NOMAP_OK | CMD_FOREIGN_OK;
-	copy_range_cmd.args = _("[-s src_off] [-d dst_off] [-l len] src_file | -f N");
+	copy_range_cmd.args =
+		_("[-qS] [-c chunk] [-t nr] [-s src_off] [-d dst_off] [-l len] src_file | -f N");
 	copy_range_cmd.oneline = _("Copy a range of data between two files");
 	copy_range_cmd.help = copy_range_help;
 
@@ -0,0 +1,845 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Filesystem-wide content-aware deduplication scanner.
+ */
+#include "xfs.h"
+#include <linux/fiemap.h>
+#include <linux/fs.h>
+#include "platform_defs.h"
+#include "command.h"
+#include "input.h"
+#include "init.h"
+#include "handle.h"
+#include "libfrog/logging.h"
+#include "libfrog/fsgeom.h"
+#include "libfrog/bulkstat.h"
+#include "libfrog/workqueue.h"
+#include "libfrog/crc32c.h"
+#include "libfrog/platform.h"
+#include "io.h"
+
+static cmdinfo_t dedupe_scan_cmd;
+
+/* Default size of the chunks that we hash and dedupe. */
+#define DSCAN_CHUNKSIZE		(128ULL << 10)
+
+/* Largest chunk size we allow. */
+#define DSCAN_MAX_CHUNKSIZE	(16ULL << 20)
+
+/* Split files into work items of about this size so big files hash in parallel. */
+#define DSCAN_SEGMENT		(1ULL << 30)
+
+/* Inodes per bulkstat call.  This is also the granularity of the checkpoint. */
+#define DSCAN_BATCH		1024
+
+/* Number of destination ranges per FIDEDUPERANGE call. */
+#define DSCAN_MAX_DESTS		64
+
+/* Number of extents per FIEMAP call. */
+#define DSCAN_FIEMAP_BATCH	64
+
+/* Default memory budget for the chunk hash table. */
+#define DSCAN_DEFAULT_MEM	(256ULL << 20)
+
+/* Extents that we cannot or need not dedupe. */
+#define DSCAN_SKIP_FLAGS	(FIEMAP_EXTENT_UNKNOWN | \
+				 FIEMAP_EXTENT_DELALLOC | \
+				 FIEMAP_EXTENT_ENCODED | \
+				 FIEMAP_EXTENT_DATA_ENCRYPTED | \
+				 FIEMAP_EXTENT_NOT_ALIGNED | \
+				 FIEMAP_EXTENT_DATA_INLINE | \
+				 FIEMAP_EXTENT_DATA_TAIL | \
+				 FIEMAP_EXTENT_UNWRITTEN | \
+				 FIEMAP_EXTENT_SHARED)
+
+/* One hashed chunk of a file. */
+struct dscan_rec {
+	uint64_t		hash;
+	uint64_t		ino;
+	uint64_t		offset;
+	uint32_t		gen;
+	uint32_t		length;
+};
+
+/* A range of a file to hash. */
+struct dscan_item {
+	uint64_t		ino;
+	uint64_t		offset;
+	uint64_t		length;
+	uint32_t		gen;
+};
+
+struct dscan {
+	struct xfs_fd		xfd;
+
+	/* template handle for opening files by inode number */
+	struct xfs_handle	handle;
+
+	/* protects the hash table and the counters */
+	pthread_mutex_t		lock;
+
+	/* serializes flushes, which run without the table lock */
+	pthread_mutex_t		flush_lock;
+
+	/* chunk hash table */
+	struct dscan_rec	*recs;
+	size_t			nr_recs;
+	size_t			sz_recs;
+	size_t			max_recs;
+	size_t			flush_recs;	/* size of the table being flushed */
+	uint64_t		chunksize;
+
+	/*
+	 * First inode of the bulkstat batch being hashed, and the first inode
+	 * whose chunks have not been deduped yet.  The second one is where a
+	 * restarted scan has to begin.
+	 */
+	uint64_t		batch_ino;
+	uint64_t		resume_ino;
+
+	/* I/O throttling */
+	pthread_mutex_t		throttle_lock;
+	uint64_t		rate;
+	uint64_t		throttle_bytes;
+	struct timeval		start;
+
+	/* statistics */
+	uint64_t		files;
+	uint64_t		hashed_bytes;
+	uint64_t		hashed_chunks;
+	uint64_t		shared_bytes;
+	uint64_t		dedupe_calls;
+	uint64_t		deduped_bytes;
+	uint64_t		deduped_chunks;
+	uint64_t		differed;
+	uint64_t		failed;
+	uint64_t		flushes;
+
+	bool			dry_run;
+	bool			verbose;
+};
+
+static void
+dedupe_scan_help(void)
+{
+	printf(_(
+"\n"
+" Scans the whole filesystem for identical blocks of file data and shares\n"
+" them.\n"
+"\n"
+" Every regular file is enumerated with bulkstat and its data is read and\n"
+" hashed in chunks by a pool of threads.  Extents that are already shared\n"
+" are skipped.  Whenever the hash table fills up, chunks with the same hash\n"
+" are passed to the kernel in batched FIDEDUPERANGE calls.  The kernel\n"
+" compares the contents before sharing anything, so hash collisions are\n"
+" harmless.  Duplicates are only found within the same hash table load.\n"
+"\n"
+" Example:\n"
+" 'dedupe_scan -r 100m -c /var/tmp/ckpt' - dedupe the filesystem containing\n"
+"                                          the open file, reading at most\n"
+"                                          100MiB/s, and record progress so\n"
+"                                          that an interrupted scan resumes\n"
+"\n"
+"   -b <size>  Hash and dedupe chunks of this size (default 128k).\n"
+"   -c <file>  Save progress in this file and resume from it.\n"
+"   -m <size>  Use at most this much memory for chunk hashes (default 256m).\n"
+"   -n         Dry run; report what could be deduped.\n"
+"   -r <rate>  Read and compare at most this many bytes per second.\n"
+"   -t <nr>    Hash with this many threads.\n"
+"   -v         Report progress after every dedupe pass.\n"
+"\n"));
+}
+
+static int
+dscan_open(
+	struct dscan		*ds,
+	uint64_t		ino,
+	uint32_t		gen)
+{
+	struct xfs_handle	handle = ds->handle;
+
+	handle.ha_fid.fid_ino = ino;
+	handle.ha_fid.fid_gen = gen;
+	return open_by_fshandle(&handle, sizeof(handle),
+			O_RDONLY | O_NOATIME | O_NOFOLLOW | O_NOCTTY);
+}
+
+/* Sleep until the rate limit allows us to do another @bytes of I/O. */
+static void
+dscan_throttle(
+	struct dscan		*ds,
+	uint64_t		bytes)
+{
+	struct timeval		now;
+	double			due;
+	double			elapsed;
+
+	if (!ds->rate)
+		return;
+
+	pthread_mutex_lock(&ds->throttle_lock);
+	ds->throttle_bytes += bytes;
+	due = (double)ds->throttle_bytes / ds->rate;
+	pthread_mutex_unlock(&ds->throttle_lock);
+
+	gettimeofday(&now, NULL);
+	now = tsub(now, ds->start);
+	elapsed = now.tv_sec + now.tv_usec / 1000000.0;
+	if (due > elapsed)
+		usleep((due - elapsed) * 1000000);
+}
+
+/*
+ * Hash a chunk.  Any collisions are caught by the kernel when it compares
+ * the ranges, so two crc32c values over each half of the chunk are plenty.
+ */
+static uint64_t
+dscan_hash(
+	const unsigned char	*buf,
+	size_t			len)
+{
+	size_t			half = len / 2;
+
+	return ((uint64_t)crc32c_le(~0U, buf, half) << 32) |
+			crc32c_le(~0U, buf + half, len - half);
+}
+
+static int
+dscan_rec_cmp(
+	const void		*a,
+	const void		*b)
+{
+	const struct dscan_rec	*ra = a;
+	const struct dscan_rec	*rb = b;
+
+	if (ra->hash != rb->hash)
+		return ra->hash < rb->hash ? -1 : 1;
+	if (ra->length != rb->length)
+		return ra->length < rb->length ? -1 : 1;
+	if (ra->ino != rb->ino)
+		return ra->ino < rb->ino ? -1 : 1;
+	if (ra->offset != rb->offset)
+		return ra->offset < rb->offset ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Share the first chunk of a group of identical chunks with all the others,
+ * DSCAN_MAX_DESTS at a time.
+ */
+static void
+dscan_dedupe_group(
+	struct dscan			*ds,
+	struct file_dedupe_range	*fdr,
+	struct dscan_rec		*recs,
+	size_t				nr)
+{
+	struct file_dedupe_range_info	*info;
+	size_t				i, j;
+	int				src_fd;
+	int				ret;
+
+	src_fd = dscan_open(ds, recs[0].ino, recs[0].gen);
+	if (src_fd < 0)
+		return;
+
+	for (i = 1; i < nr; i += DSCAN_MAX_DESTS) {
+		memset(fdr, 0, sizeof(*fdr) + DSCAN_MAX_DESTS * sizeof(*info));
+		fdr->src_offset = recs[0].offset;
+		fdr->src_length = recs[0].length;
+
+		for (j = i; j < nr && j < i + DSCAN_MAX_DESTS; j++) {
+			int	fd;
+
+			fd = dscan_open(ds, recs[j].ino, recs[j].gen);
+			if (fd < 0)
+				continue;
+			info = &fdr->info[fdr->dest_count++];
+			info->dest_fd = fd;
+			info->dest_offset = recs[j].offset;
+		}
+		if (fdr->dest_count == 0)
+			continue;
+
+		if (ds->dry_run) {
+			pthread_mutex_lock(&ds->lock);
+			ds->deduped_chunks += fdr->dest_count;
+			ds->deduped_bytes += fdr->dest_count * fdr->src_length;
+			pthread_mutex_unlock(&ds->lock);
+			goto close;
+		}
+
+		/* The kernel reads the source and every destination. */
+		dscan_throttle(ds, (fdr->dest_count + 1) * fdr->src_length);
+		ret = ioctl(src_fd, FIDEDUPERANGE, fdr);
+		if (ret && ds->verbose)
+			perror("FIDEDUPERANGE");
+
+		pthread_mutex_lock(&ds->lock);
+		ds->dedupe_calls++;
+		if (ret) {
+			ds->failed += fdr->dest_count;
+			pthread_mutex_unlock(&ds->lock);
+			goto close;
+		}
+
+		for (j = 0; j < fdr->dest_count; j++) {
+			info = &fdr->info[j];
+			if (info->status == FILE_DEDUPE_RANGE_SAME) {
+				ds->deduped_chunks++;
+				ds->deduped_bytes += info->bytes_deduped;
+			} else if (info->status == FILE_DEDUPE_RANGE_DIFFERS) {
+				ds->differed++;
+			} else {
+				ds->failed++;
+			}
+		}
+		pthread_mutex_unlock(&ds->lock);
+close:
+		for (j = 0; j < fdr->dest_count; j++)
+			close(fdr->info[j].dest_fd);
+	}
+
+	close(src_fd);
+}
+
+/*
+ * Take the hash table away from the hashing threads, then sort it and dedupe
+ * every group of chunks with the same hash.  The threads keep filling a new
+ * table meanwhile; only one flush runs at a time.
+ */
+static void
+dscan_flush(
+	struct dscan			*ds)
+{
+	struct file_dedupe_range	*fdr;
+	struct dscan_rec		*recs;
+	uint64_t			batch_ino;
+	size_t				nr, i, j;
+
+	pthread_mutex_lock(&ds->flush_lock);
+	pthread_mutex_lock(&ds->lock);
+	recs = ds->recs;
+	nr = ds->nr_recs;
+	batch_ino = ds->batch_ino;
+	ds->flush_recs = ds->sz_recs;
+	ds->recs = NULL;
+	ds->nr_recs = ds->sz_recs = 0;
+	pthread_mutex_unlock(&ds->lock);
+
+	fdr = calloc(1, sizeof(*fdr) +
+			DSCAN_MAX_DESTS * sizeof(struct file_dedupe_range_info));
+	if (!fdr) {
+		perror("dedupe_scan");
+		goto out;
+	}
+
+	qsort(recs, nr, sizeof(struct dscan_rec), dscan_rec_cmp);
+	for (i = 0; i < nr; i = j) {
+		for (j = i + 1; j < nr; j++) {
+			if (recs[j].hash != recs[i].hash ||
+			    recs[j].length != recs[i].length)
+				break;
+		}
+		if (j - i > 1)
+			dscan_dedupe_group(ds, fdr, &recs[i], j - i);
+	}
+	free(fdr);
+
+out:
+	free(recs);
+	pthread_mutex_lock(&ds->lock);
+	ds->flush_recs = 0;
+	ds->flushes++;
+	ds->resume_ino = batch_ino;
+
+	if (ds->verbose) {
+		char	s1[64], s2[64];
+
+		cvtstr((double)ds->hashed_bytes, s1, sizeof(s1));
+		cvtstr((double)ds->deduped_bytes, s2, sizeof(s2));
+		printf(_("pass %llu: hashed %s, deduped %s, next inode %llu\n"),
+				(unsigned long long)ds->flushes, s1, s2,
+				(unsigned long long)batch_ino);
+	}
+	pthread_mutex_unlock(&ds->lock);
+	pthread_mutex_unlock(&ds->flush_lock);
+}
+
+/*
+ * Make room for more chunk hashes, up to the memory limit, which also covers
+ * a table that is being flushed.  Caller holds ds->lock.
+ */
+static bool
+dscan_grow(
+	struct dscan		*ds)
+{
+	struct dscan_rec	*p;
+	size_t			sz;
+
+	if (ds->sz_recs + ds->flush_recs >= ds->max_recs)
+		return false;
+
+	sz = min(max(ds->sz_recs * 2, 65536), ds->max_recs - ds->flush_recs);
+	p = realloc(ds->recs, sz * sizeof(struct dscan_rec));
+	if (!p)
+		return false;
+	ds->recs = p;
+	ds->sz_recs = sz;
+	return true;
+}
+
+/* Record the hash of a chunk, deduping everything if the table is full. */
+static void
+dscan_add(
+	struct dscan		*ds,
+	const struct dscan_rec	*rec)
+{
+	pthread_mutex_lock(&ds->lock);
+	while (ds->nr_recs == ds->sz_recs && !dscan_grow(ds)) {
+		pthread_mutex_unlock(&ds->lock);
+		dscan_flush(ds);
+		pthread_mutex_lock(&ds->lock);
+	}
+	ds->recs[ds->nr_recs++] = *rec;
+	ds->hashed_chunks++;
+	ds->hashed_bytes += rec->length;
+	pthread_mutex_unlock(&ds->lock);
+}
+
+/* Hash every whole chunk in a run of unshared file data. */
+static void
+dscan_hash_run(
+	struct dscan		*ds,
+	struct dscan_item	*item,
+	int			fd,
+	unsigned char		*buf,
+	uint64_t		start,
+	uint64_t		end)
+{
+	struct dscan_rec	rec = {
+		.ino		= item->ino,
+		.gen		= item->gen,
+		.length		= ds->chunksize,
+	};
+	uint64_t		pos;
+	ssize_t			ret;
+
+	pos = howmany(start, ds->chunksize) * ds->chunksize;
+	for (; pos + ds->chunksize <= end; pos += ds->chunksize) {
+		dscan_throttle(ds, ds->chunksize);
+		ret = pread(fd, buf, ds->chunksize, pos);
+		if (ret != ds->chunksize)
+			return;
+
+		rec.offset = pos;
+		rec.hash = dscan_hash(buf, ds->chunksize);
+		dscan_add(ds, &rec);
+	}
+}
+
+/* Hash all the unshared written extents in a range of a file. */
+static void
+dscan_hash_item(
+	struct workqueue	*wq,
+	uint32_t		index,
+	void			*arg)
+{
+	struct dscan		*ds = wq->wq_ctx;
+	struct dscan_item	*item = arg;
+	struct fiemap		*fm;
+	struct fiemap_extent	*fe;
+	unsigned char		*buf = NULL;
+	uint64_t		end = item->offset + item->length;
+	uint64_t		pos = item->offset;
+	uint64_t		run_start = 0, run_end = 0;
+	uint64_t		estart, eend;
+	unsigned int		i;
+	int			fd;
+
+	fm = calloc(1, sizeof(struct fiemap) +
+			DSCAN_FIEMAP_BATCH * sizeof(struct fiemap_extent));
+	if (!fm)
+		goto out;
+
+	fd = dscan_open(ds, item->ino, item->gen);
+	if (fd < 0)
+		goto out_fm;
+
+	buf = malloc(ds->chunksize);
+	if (!buf)
+		goto out_fd;
+
+	while (pos < end) {
+		memset(fm, 0, sizeof(struct fiemap));
+		fm->fm_start = pos;
+		fm->fm_length = end - pos;
+		fm->fm_extent_count = DSCAN_FIEMAP_BATCH;
+		if (ioctl(fd, FS_IOC_FIEMAP, fm) < 0 ||
+		    fm->fm_mapped_extents == 0)
+			break;
+
+		for (i = 0; i < fm->fm_mapped_extents; i++) {
+			fe = &fm->fm_extents[i];
+			estart = max(fe->fe_logical, item->offset);
+			eend = min(fe->fe_logical + fe->fe_length, end);
+			pos = fe->fe_logical + fe->fe_length;
+			if (fe->fe_flags & FIEMAP_EXTENT_LAST)
+				pos = end;
+			if (estart >= eend)
+				continue;
+
+			if (fe->fe_flags & DSCAN_SKIP_FLAGS) {
+				if (fe->fe_flags & FIEMAP_EXTENT_SHARED) {
+					pthread_mutex_lock(&ds->lock);
+					ds->shared_bytes += eend - estart;
+					pthread_mutex_unlock(&ds->lock);
+				}
+				continue;
+			}
+
+			/* Coalesce extents that are contiguous in the file. */
+			if (estart == run_end) {
+				run_end = eend;
+				continue;
+			}
+			dscan_hash_run(ds, item, fd, buf, run_start, run_end);
+			run_start = estart;
+			run_end = eend;
+		}
+	}
+	dscan_hash_run(ds, item, fd, buf, run_start, run_end);
+
+	free(buf);
+out_fd:
+	close(fd);
+out_fm:
+	free(fm);
+out:
+	free(item);
+}
+
+/* Queue every regular file in a bulkstat batch for hashing. */
+static int
+dscan_queue_batch(
+	struct dscan		*ds,
+	struct xfs_bulkstat_req	*breq,
+	unsigned int		nr_threads)
+{
+	struct workqueue	wq;
+	struct xfs_bulkstat	*bs;
+	struct dscan_item	*item;
+	uint64_t		segment;
+	uint64_t		off;
+	unsigned int		i;
+	int			ret, ret2;
+
+	/* Work items must start on a chunk boundary. */
+	segment = max(DSCAN_SEGMENT / ds->chunksize, 1) * ds->chunksize;
+
+	ret = -workqueue_create(&wq, ds, nr_threads);
+	if (ret) {
+		xfrog_perror(ret, "creating dedupe workqueue");
+		return ret;
+	}
+
+	for (i = 0, bs = breq->bulkstat; i < breq->hdr.ocount; i++, bs++) {
+		if (!S_ISREG(bs->bs_mode) || bs->bs_size < ds->chunksize)
+			continue;
+
+		ds->files++;
+		for (off = 0; off < bs->bs_size; off += segment) {
+			item = malloc(sizeof(struct dscan_item));
+			if (!item) {
+				ret = -errno;
+				xfrog_perror(ret, "dedupe_scan");
+				goto out;
+			}
+			item->ino = bs->bs_ino;
+			item->gen = bs->bs_gen;
+			item->offset = off;
+			item->length = min(segment, bs->bs_size - off);
+			ret = -workqueue_add(&wq, dscan_hash_item, 0, item);
+			if (ret) {
+				free(item);
+				xfrog_perror(ret, "queueing dedupe work");
+				goto out;
+			}
+		}
+	}
+
+out:
+	ret2 = -workqueue_terminate(&wq);
+	if (!ret && ret2) {
+		xfrog_perror(ret2, "finishing dedupe work");
+		ret = ret2;
+	}
+	workqueue_destroy(&wq);
+	return ret;
+}
+
+/* Load the inode number to resume from, if there is a checkpoint. */
+static int
+dscan_load_checkpoint(
+	const char		*path,
+	uint64_t		*startino)
+{
+	unsigned long long	ino;
+	FILE			*fp;
+	int			ret = 0;
+
+	fp = fopen(path, "r");
+	if (!fp)
+		return errno == ENOENT ? 0 : -errno;
+	if (fscanf(fp, "%llu", &ino) == 1)
+		*startino = ino;
+	else
+		ret = -EINVAL;
+	fclose(fp);
+	return ret;
+}
+
+/* Atomically replace the checkpoint. */
+static int
+dscan_save_checkpoint(
+	const char		*path,
+	uint64_t		startino)
+{
+	char			tmp[PATH_MAX];
+	FILE			*fp;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	fp = fopen(tmp, "w");
+	if (!fp)
+		return -errno;
+	fprintf(fp, "%llu\n", (unsigned long long)startino);
+	if (fflush(fp) || fsync(fileno(fp))) {
+		fclose(fp);
+		return -errno;
+	}
+	if (fclose(fp))
+		return -errno;
+	if (rename(tmp, path))
+		return -errno;
+	return 0;
+}
+
+static void
+dscan_report(
+	struct dscan		*ds)
+{
+	struct timeval		t;
+	char			s1[64], s2[64], s3[64], ts[64];
+
+	gettimeofday(&t, NULL);
+	t = tsub(t, ds->start);
+	timestr(&t, ts, sizeof(ts), 0);
+
+	cvtstr((double)ds->hashed_bytes, s1, sizeof(s1));
+	cvtstr(tdiv((double)ds->hashed_bytes, t), s2, sizeof(s2));
+	cvtstr((double)ds->shared_bytes, s3, sizeof(s3));
+	printf(_("scanned %llu files, hashed %s in %llu chunks, skipped %s already shared\n"),
+			(unsigned long long)ds->files, s1,
+			(unsigned long long)ds->hashed_chunks, s3);
+
+	cvtstr((double)ds->deduped_bytes, s3, sizeof(s3));
+	if (ds->dry_run)
+		printf(_("could dedupe %s in %llu chunks\n"), s3,
+				(unsigned long long)ds->deduped_chunks);
+	else
+		printf(_("deduped %s in %llu chunks with %llu calls, %llu differed, %llu failed\n"),
+				s3, (unsigned long long)ds->deduped_chunks,
+				(unsigned long long)ds->dedupe_calls,
+				(unsigned long long)ds->differed,
+				(unsigned long long)ds->failed);
+	printf(_("%llu passes; %s (%s/sec)\n"),
+			(unsigned long long)ds->flushes, ts, s2);
+}
+
+static int
+dedupe_scan_f(
+	int			argc,
+	char			**argv)
+{
+	struct dscan		ds = {
+		.xfd		= XFS_FD_INIT(file->fd),
+		.chunksize	= DSCAN_CHUNKSIZE,
+	};
+	struct xfs_bulkstat_req	*breq;
+	void			*fshandle;
+	size_t			fshandle_len;
+	size_t			fsblocksize, fssectsize;
+	uint64_t		mem = DSCAN_DEFAULT_MEM;
+	uint64_t		saved_ino;
+	unsigned int		nr_threads = platform_nproc();
+	char			*ckpt = NULL;
+	long long		l;
+	int			c;
+	int			ret;
+
+	init_cvtnum(&fsblocksize, &fssectsize);
+
+	while ((c = getopt(argc, argv, "b:c:m:nr:t:v")) != EOF) {
+		switch (c) {
+		case 'b':
+			l = cvtnum(fsblocksize, fssectsize, optarg);
+			if (l <= 0 || l > DSCAN_MAX_CHUNKSIZE) {
+				printf(_("bad chunk size -- %s\n"), optarg);
+				exitcode = 1;
+				return 0;
+			}
+			ds.chunksize = l;
+			break;
+		case 'c':
+			ckpt = optarg;
+			break;
+		case 'm':
+			l = cvtnum(fsblocksize, fssectsize, optarg);
+			if (l <= 0) {
+				printf(_("bad memory limit -- %s\n"), optarg);
+				exitcode = 1;
+				return 0;
+			}
+			mem = l;
+			break;
+		case 'n':
+			ds.dry_run = true;
+			break;
+		case 'r':
+			l = cvtnum(fsblocksize, fssectsize, optarg);
+			if (l <= 0) {
+				printf(_("bad rate -- %s\n"), optarg);
+				exitcode = 1;
+				return 0;
+			}
+			ds.rate = l;
+			break;
+		case 't':
+			nr_threads = cvt_u32(optarg, 10);
+			if (errno || nr_threads == 0) {
+				printf(_("bad thread count -- %s\n"), optarg);
+				exitcode = 1;
+				return 0;
+			}
+			break;
+		case 'v':
+			ds.verbose = true;
+			break;
+		default:
+			exitcode = 1;
+			return command_usage(&dedupe_scan_cmd);
+		}
+	}
+	if (optind != argc) {
+		exitcode = 1;
+		return command_usage(&dedupe_scan_cmd);
+	}
+
+	ret = -xfd_prepare_geometry(&ds.xfd);
+	if (ret) {
+		xfrog_perror(ret, "xfd_prepare_geometry");
+		exitcode = 1;
+		return 0;
+	}
+
+	if (ds.chunksize % ds.xfd.fsgeom.blocksize) {
+		printf(_("chunk size must be a multiple of the block size (%u)\n"),
+				ds.xfd.fsgeom.blocksize);
+		exitcode = 1;
+		return 0;
+	}
+	ds.max_recs = max(mem / sizeof(struct dscan_rec), 1024);
+
+	if (path_to_fshandle(file->fs_path.fs_dir, &fshandle, &fshandle_len)) {
+		perror(file->fs_path.fs_dir);
+		exitcode = 1;
+		return 0;
+	}
+	memcpy(&ds.handle.ha_fsid, fshandle, sizeof(ds.handle.ha_fsid));
+	ds.handle.ha_fid.fid_len = sizeof(xfs_fid_t) -
+			sizeof(ds.handle.ha_fid.fid_len);
+	free_handle(fshandle, fshandle_len);
+
+	if (ckpt) {
+		ret = dscan_load_checkpoint(ckpt, &ds.resume_ino);
+		if (ret) {
+			xfrog_perror(ret, ckpt);
+			exitcode = 1;
+			return 0;
+		}
+		if (ds.resume_ino)
+			printf(_("resuming scan at inode %llu\n"),
+					(unsigned long long)ds.resume_ino);
+	}
+	saved_ino = ds.resume_ino;
+
+	ret = -xfrog_bulkstat_alloc_req(DSCAN_BATCH, ds.resume_ino, &breq);
+	if (ret) {
+		xfrog_perror(ret, "alloc bulkreq");
+		exitcode = 1;
+		return 0;
+	}
+
+	pthread_mutex_init(&ds.lock, NULL);
+	pthread_mutex_init(&ds.flush_lock, NULL);
+	pthread_mutex_init(&ds.throttle_lock, NULL);
+	gettimeofday(&ds.start, NULL);
+
+	ds.batch_ino = breq->hdr.ino;
+	while ((ret = -xfrog_bulkstat(&ds.xfd, breq)) == 0) {
+		if (breq->hdr.ocount == 0)
+			break;
+
+		ret = dscan_queue_batch(&ds, breq, nr_threads);
+		if (ret)
+			break;
+
+		ds.batch_ino = breq->hdr.ino;
+		if (ckpt && ds.resume_ino != saved_ino) {
+			ret = dscan_save_checkpoint(ckpt, ds.resume_ino);
+			if (ret) {
+				xfrog_perror(ret, ckpt);
+				break;
+			}
+			saved_ino = ds.resume_ino;
+		}
+	}
+	if (ret) {
+		xfrog_perror(ret, "dedupe_scan");
+		exitcode = 1;
+		goto out;
+	}
+
+	/* Dedupe whatever is left; the scan is complete. */
+	dscan_flush(&ds);
+	if (ckpt && unlink(ckpt) && errno != ENOENT) {
+		perror(ckpt);
+		exitcode = 1;
+	}
+
+	dscan_report(&ds);
+out:
+	free(ds.recs);
+	free(breq);
+	pthread_mutex_destroy(&ds.throttle_lock);
+	pthread_mutex_destroy(&ds.flush_lock);
+	pthread_mutex_destroy(&ds.lock);
+	return 0;
+}
+
+void
+dedupe_scan_init(void)
+{
+	dedupe_scan_cmd.name = "dedupe_scan";
+	dedupe_scan_cmd.cfunc = dedupe_scan_f;
+	dedupe_scan_cmd.argmin = 0;
+	dedupe_scan_cmd.argmax = -1;
+	dedupe_scan_cmd.flags = CMD_NOMAP_OK | CMD_FLAG_ONESHOT;
+	dedupe_scan_cmd.args =
+_("[-nv] [-b chunksize] [-c checkpoint] [-m mem] [-r rate] [-t threads]");
+	dedupe_scan_cmd.oneline =
+		_("find and dedupe identical file data across the filesystem");
+	dedupe_scan_cmd.help = dedupe_scan_help;
+
+	add_command(&dedupe_scan_cmd);
+}
@@ -49,6 +49,7 @@ init_commands(void)
 	bulkstat_init();
 	copy_range_init();
 	cowextsize_init();
+	dedupe_scan_init();
 	encrypt_init();
 	fadvise_init();
 	fiemap_init();
@@ -62,6 +63,7 @@ init_commands(void)
 	imap_init();
 	inject_init();
 	label_init();
+	layout_scan_init();
 	log_writes_init();
 	madvise_init();
 	mincore_init();
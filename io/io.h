@@ -88,6 +88,68 @@ extern int		read_buffer(int, off64_t, long long, long long *,
 					int, int);
 extern void		dump_buffer(off64_t, ssize_t);
 
+/*
+ * Chunked, multithreaded copies for copy_range and sendfile
+ */
+enum chunk_copy_method {
+	CHUNK_COPY_RANGE,		/* copy_file_range */
+	CHUNK_COPY_SENDFILE,		/* sendfile */
+};
+
+struct chunk_copy {
+	int		src_fd;		/* source file */
+	int		dst_fd;		/* destination file */
+	int		method;		/* CHUNK_COPY_* */
+	long long	src_off;	/* start of source range */
+	long long	dst_off;	/* start of destination range */
+	long long	len;		/* length of range */
+	long long	chunksize;	/* bytes per work item */
+	unsigned int	nr_threads;	/* copy threads */
+	bool		sparse;		/* skip holes in the source */
+
+	/* results */
+	long long	total;		/* bytes copied */
+	long long	holes;		/* bytes of holes punched */
+	int		ops;		/* copy syscalls issued */
+	int		error;		/* first error seen */
+	uint64_t	*latencies;	/* per-chunk latency, in ns */
+	size_t		nr_latencies;
+};
+
+extern int		chunk_copy(struct chunk_copy *cc);
+extern void		chunk_copy_report(struct chunk_copy *cc,
+					const char *verb, struct timeval *t,
+					int compact);
+
+struct stamp_io {
+	int		fd;		/* file to write or check */
+	bool		verify;		/* read back and check stamps */
+	long long	offset;		/* start of range */
+	long long	nr_blocks;	/* blocks in range */
+	unsigned int	bsize;		/* block size */
+	unsigned int	depth;		/* I/Os in flight per thread */
+	unsigned int	nr_threads;	/* I/O threads */
+	int		direction;	/* IO_FORWARD, IO_BACKWARD, IO_RANDOM */
+	unsigned int	zeed;		/* random order seed */
+	uint32_t	seed;		/* stamp seed */
+	uint32_t	generation;	/* stamp generation */
+	bool		check_seed;	/* verify: seed must match */
+	bool		check_generation; /* verify: generation must match */
+
+	/* results */
+	long long	total;		/* bytes transferred */
+	long long	ops;		/* I/Os completed */
+	long long	mismatches;	/* bad blocks found by verify */
+	int		error;		/* first error seen */
+	uint64_t	*latencies;	/* per-I/O latency, in ns */
+	size_t		nr_latencies;
+};
+
+extern int		stamp_io(struct stamp_io *si);
+extern void		stamp_io_report(struct stamp_io *si,
+					const char *verb, struct timeval *t,
+					int compact);
+
 extern void		attr_init(void);
 extern void		bmap_init(void);
 extern void		encrypt_init(void);
@@ -142,8 +204,12 @@ extern void		mincore_init(void);
 
 #ifdef HAVE_FIEMAP
 extern void		fiemap_init(void);
+extern void		dedupe_scan_init(void);
+extern void		layout_scan_init(void);
 #else
 #define fiemap_init()	do { } while (0)
+#define dedupe_scan_init()	do { } while (0)
+#define layout_scan_init()	do { } while (0)
 #endif
 
 #ifdef HAVE_COPY_FILE_RANGE
@@ -0,0 +1,827 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Filesystem-wide file layout quality analyzer.
+ */
+#include "xfs.h"
+#include <linux/fiemap.h>
+#ifdef HAVE_GETFSMAP
+#include <linux/fsmap.h>
+#endif
+#include "platform_defs.h"
+#include "command.h"
+#include "input.h"
+#include "init.h"
+#include "handle.h"
+#include "libfrog/logging.h"
+#include "libfrog/fsgeom.h"
+#include "libfrog/bulkstat.h"
+#include "libfrog/workqueue.h"
+#include "libfrog/platform.h"
+#include "io.h"
+
+static cmdinfo_t layout_scan_cmd;
+
+/* Number of files listed in the ranked report by default. */
+#define LSCAN_TOP		20
+
+/* Inodes per bulkstat call. */
+#define LSCAN_BATCH		1024
+
+/* Extents per FIEMAP call. */
+#define LSCAN_FIEMAP_BATCH	256
+
+/* Records per GETFSMAP call. */
+#define LSCAN_FSMAP_BATCH	1024
+
+/* Default size below which an extent counts as small. */
+#define LSCAN_SMALL		(1ULL << 20)
+
+/* Longest extent that a bmbt record can describe, in fs blocks. */
+#define LSCAN_MAX_EXTLEN	((1ULL << 21) - 1)
+
+/* Number of log2 buckets in the histograms. */
+#define LSCAN_LOG_BUCKETS	32
+
+/* Number of buckets in the score histogram; each covers ten points. */
+#define LSCAN_SCORE_BUCKETS	11
+
+/* Extents whose physical location means nothing to us. */
+#define LSCAN_SKIP_FLAGS	(FIEMAP_EXTENT_UNKNOWN | \
+				 FIEMAP_EXTENT_DELALLOC | \
+				 FIEMAP_EXTENT_DATA_INLINE | \
+				 FIEMAP_EXTENT_DATA_TAIL)
+
+/* Layout statistics for one file. */
+struct lscan_file {
+	uint64_t		ino;
+	uint64_t		bytes;		/* allocated bytes */
+	uint32_t		extents;	/* physically discontiguous */
+	uint32_t		ideal;		/* fewest extents possible */
+	uint32_t		ags;		/* AGs touched */
+	uint32_t		ideal_ags;	/* fewest AGs possible */
+	uint32_t		unaligned;	/* extents not stripe aligned */
+	uint32_t		small;		/* small extents */
+	unsigned int		score;		/* 0 (good) to 100 (bad) */
+};
+
+/* Results of scanning one AG. */
+struct lscan_ag {
+	/* worst files whose inodes live in this AG */
+	struct lscan_file	*files;
+	size_t			nr_files;
+	size_t			sz_files;
+
+	/* files scanned, and totals over them */
+	uint64_t		scanned;
+	uint64_t		skipped;
+	uint64_t		bytes;
+	uint64_t		extents;
+	uint64_t		ideal;
+	uint64_t		unaligned;
+	uint64_t		small;
+
+	uint64_t		extents_hist[LSCAN_LOG_BUCKETS];
+	uint64_t		extlen_hist[LSCAN_LOG_BUCKETS];
+	uint64_t		score_hist[LSCAN_SCORE_BUCKETS];
+
+	/* free space in this AG, from GETFSMAP */
+	uint64_t		free_bytes;
+	uint64_t		free_extents;
+	uint64_t		free_max;
+	bool			have_fsmap;
+
+	int			error;
+};
+
+struct lscan {
+	struct xfs_fd		xfd;
+
+	/* template handle for opening files by inode number */
+	struct xfs_handle	handle;
+
+	struct lscan_ag		*ags;
+	dev_t			datadev;
+
+	uint64_t		blocksize;
+	uint64_t		agbytes;
+	uint64_t		max_extbytes;
+	uint64_t		sunit;		/* bytes, or zero */
+	uint64_t		swidth;		/* bytes, or zero */
+	uint64_t		small;
+	size_t			top;
+};
+
+static void
+layout_scan_help(void)
+{
+	printf(_(
+"\n"
+" Scans every regular file in the filesystem and ranks them by how badly\n"
+" their data is laid out on disk.\n"
+"\n"
+" Files are enumerated one AG at a time with bulkstat, and each file's\n"
+" extents are mapped with FIEMAP.  Physically contiguous extents are counted\n"
+" as one.  Each file gets a score from 0 (ideal) to 100 (worst):\n"
+"\n"
+"   40 points for extents beyond the fewest possible for its size\n"
+"   20 points for extents not aligned to the stripe unit or width\n"
+"   20 points for being spread over more AGs than necessary\n"
+"   20 points for extents smaller than the small extent size\n"
+"\n"
+" The worst files are listed, followed by histograms of extents per file,\n"
+" extent length and score.  If GETFSMAP is available, free space in each\n"
+" AG is summarized as well, to show whether defragmentation can succeed.\n"
+"\n"
+"   -n <nr>    List this many files (default 20).\n"
+"   -s <size>  Extents shorter than this are small (default 1m).\n"
+"   -t <nr>    Scan with this many threads.\n"
+"   -v         Print per-AG statistics.\n"
+"\n"));
+}
+
+static int
+lscan_open(
+	struct lscan		*ls,
+	uint64_t		ino,
+	uint32_t		gen)
+{
+	struct xfs_handle	handle = ls->handle;
+
+	handle.ha_fid.fid_ino = ino;
+	handle.ha_fid.fid_gen = gen;
+	return open_by_fshandle(&handle, sizeof(handle),
+			O_RDONLY | O_NOATIME | O_NOFOLLOW | O_NOCTTY);
+}
+
+static inline unsigned int
+lscan_log2(
+	uint64_t		v)
+{
+	unsigned int		b = 0;
+
+	while (v > 1 && b < LSCAN_LOG_BUCKETS - 1) {
+		v >>= 1;
+		b++;
+	}
+	return b;
+}
+
+static unsigned int
+lscan_score(
+	const struct lscan_file	*f)
+{
+	double			frag = 0, misalign, spread = 0, small;
+
+	if (f->extents == 0)
+		return 0;
+	if (f->extents > f->ideal)
+		frag = 1.0 - (double)f->ideal / f->extents;
+	if (f->ags > f->ideal_ags)
+		spread = (double)(f->ags - f->ideal_ags) / f->ags;
+	misalign = (double)f->unaligned / f->extents;
+	small = (double)f->small / f->extents;
+
+	return 40 * frag + 20 * misalign + 20 * spread + 20 * small + 0.5;
+}
+
+static int
+lscan_file_cmp(
+	const void		*a,
+	const void		*b)
+{
+	const struct lscan_file	*fa = a;
+	const struct lscan_file	*fb = b;
+
+	if (fa->score != fb->score)
+		return fa->score > fb->score ? -1 : 1;
+	if (fa->bytes != fb->bytes)
+		return fa->bytes > fb->bytes ? -1 : 1;
+	if (fa->ino != fb->ino)
+		return fa->ino < fb->ino ? -1 : 1;
+	return 0;
+}
+
+/* Remember a badly laid out file, keeping only the worst few per AG. */
+static int
+lscan_keep(
+	struct lscan		*ls,
+	struct lscan_ag		*ag,
+	const struct lscan_file	*f)
+{
+	struct lscan_file	*p;
+
+	if (ag->nr_files == ag->sz_files) {
+		if (ag->sz_files >= 4 * ls->top) {
+			qsort(ag->files, ag->nr_files,
+					sizeof(struct lscan_file),
+					lscan_file_cmp);
+			ag->nr_files = ls->top;
+		} else {
+			size_t	sz = max(4 * ls->top, 16);
+
+			p = realloc(ag->files, sz * sizeof(struct lscan_file));
+			if (!p)
+				return errno;
+			ag->files = p;
+			ag->sz_files = sz;
+		}
+	}
+	ag->files[ag->nr_files++] = *f;
+	return 0;
+}
+
+/*
+ * Count one physically contiguous extent.  Stripe alignment only matters for
+ * extents at least as long as the stripe unit (or width).
+ */
+static void
+lscan_extent(
+	struct lscan		*ls,
+	struct lscan_ag		*ag,
+	struct lscan_file	*f,
+	uint32_t		*ag_seen,
+	uint32_t		stamp,
+	uint64_t		physical,
+	uint64_t		length,
+	bool			last)
+{
+	uint32_t		agno = physical / ls->agbytes;
+
+	f->extents++;
+	ag->extlen_hist[lscan_log2(howmany(length, ls->blocksize))]++;
+
+	if (agno < ls->xfd.fsgeom.agcount && ag_seen[agno] != stamp) {
+		ag_seen[agno] = stamp;
+		f->ags++;
+	}
+
+	if (ls->swidth && length >= ls->swidth) {
+		if (physical % ls->swidth)
+			f->unaligned++;
+	} else if (ls->sunit && length >= ls->sunit) {
+		if (physical % ls->sunit)
+			f->unaligned++;
+	}
+
+	/* The tail of a file is allowed to be short. */
+	if (!last && length < ls->small && f->bytes >= ls->small)
+		f->small++;
+}
+
+/* Map a file's extents and work out its layout statistics. */
+static int
+lscan_map_file(
+	struct lscan		*ls,
+	struct lscan_ag		*ag,
+	struct lscan_file	*f,
+	struct fiemap		*fm,
+	uint32_t		*ag_seen,
+	uint32_t		stamp,
+	int			fd)
+{
+	struct fiemap_extent	*fe;
+	uint64_t		pos = 0;
+	uint64_t		run_phys = 0, run_len = 0, run_end = 0;
+	bool			have_run = false;
+	bool			done = false;
+	unsigned int		i;
+
+	while (!done) {
+		memset(fm, 0, sizeof(struct fiemap));
+		fm->fm_start = pos;
+		fm->fm_length = FIEMAP_MAX_OFFSET - pos;
+		fm->fm_extent_count = LSCAN_FIEMAP_BATCH;
+		if (ioctl(fd, FS_IOC_FIEMAP, fm) < 0)
+			return errno;
+		if (fm->fm_mapped_extents == 0)
+			break;
+
+		for (i = 0; i < fm->fm_mapped_extents; i++) {
+			fe = &fm->fm_extents[i];
+			pos = fe->fe_logical + fe->fe_length;
+			if (fe->fe_flags & FIEMAP_EXTENT_LAST)
+				done = true;
+			if (fe->fe_flags & LSCAN_SKIP_FLAGS)
+				continue;
+
+			/* Merge extents that are contiguous on disk too. */
+			if (have_run && fe->fe_logical == run_end &&
+			    fe->fe_physical == run_phys + run_len) {
+				run_len += fe->fe_length;
+				run_end += fe->fe_length;
+				continue;
+			}
+			if (have_run)
+				lscan_extent(ls, ag, f, ag_seen, stamp,
+						run_phys, run_len, false);
+			run_phys = fe->fe_physical;
+			run_len = fe->fe_length;
+			run_end = fe->fe_logical + fe->fe_length;
+			have_run = true;
+		}
+	}
+	if (have_run)
+		lscan_extent(ls, ag, f, ag_seen, stamp, run_phys, run_len,
+				true);
+	return 0;
+}
+
+static int
+lscan_file(
+	struct lscan		*ls,
+	struct lscan_ag		*ag,
+	struct xfs_bulkstat	*bs,
+	struct fiemap		*fm,
+	uint32_t		*ag_seen,
+	uint32_t		stamp)
+{
+	struct lscan_file	f = {
+		.ino		= bs->bs_ino,
+		.bytes		= bs->bs_blocks << BBSHIFT,
+	};
+	int			fd;
+	int			ret;
+
+	if (!S_ISREG(bs->bs_mode) || bs->bs_blocks == 0)
+		return 0;
+
+	/* Realtime extents don't live in AGs. */
+	if (bs->bs_xflags & FS_XFLAG_REALTIME) {
+		ag->skipped++;
+		return 0;
+	}
+
+	f.ideal = max(howmany(f.bytes, ls->max_extbytes), 1);
+	f.ideal_ags = min(max(howmany(f.bytes, ls->agbytes), 1),
+			ls->xfd.fsgeom.agcount);
+
+	/*
+	 * A single extent can't be fragmented or spread out, and if there's
+	 * no stripe geometry it can't be misaligned either.
+	 */
+	if (bs->bs_extents64 == 1 && !ls->sunit) {
+		f.extents = f.ags = 1;
+		ag->extlen_hist[lscan_log2(howmany(f.bytes,
+						ls->blocksize))]++;
+	} else {
+		fd = lscan_open(ls, bs->bs_ino, bs->bs_gen);
+		if (fd < 0) {
+			ag->skipped++;
+			return 0;
+		}
+		ret = lscan_map_file(ls, ag, &f, fm, ag_seen, stamp, fd);
+		close(fd);
+		if (ret) {
+			ag->skipped++;
+			return 0;
+		}
+	}
+
+	f.score = lscan_score(&f);
+
+	ag->scanned++;
+	ag->bytes += f.bytes;
+	ag->extents += f.extents;
+	ag->ideal += f.ideal;
+	ag->unaligned += f.unaligned;
+	ag->small += f.small;
+	ag->extents_hist[lscan_log2(f.extents)]++;
+	ag->score_hist[min(f.score / 10, LSCAN_SCORE_BUCKETS - 1)]++;
+
+	if (f.score == 0)
+		return 0;
+	return lscan_keep(ls, ag, &f);
+}
+
+#ifdef HAVE_GETFSMAP
+/* Summarize the free space in an AG. */
+static void
+lscan_free_space(
+	struct lscan		*ls,
+	uint32_t		agno,
+	struct lscan_ag		*ag)
+{
+	struct fsmap_head	*head;
+	struct fsmap		*p;
+	unsigned int		i;
+
+	if (!ls->datadev)
+		return;
+
+	head = calloc(1, fsmap_sizeof(LSCAN_FSMAP_BATCH));
+	if (!head)
+		return;
+
+	head->fmh_keys[0].fmr_device = ls->datadev;
+	head->fmh_keys[0].fmr_physical = agno * ls->agbytes;
+	head->fmh_keys[1].fmr_device = ls->datadev;
+	head->fmh_keys[1].fmr_physical = (agno + 1) * ls->agbytes - 1;
+	head->fmh_keys[1].fmr_owner = ULLONG_MAX;
+	head->fmh_keys[1].fmr_offset = ULLONG_MAX;
+	head->fmh_keys[1].fmr_flags = UINT_MAX;
+	head->fmh_count = LSCAN_FSMAP_BATCH;
+
+	for (;;) {
+		if (ioctl(ls->xfd.fd, FS_IOC_GETFSMAP, head) < 0)
+			goto out;
+		if (head->fmh_entries == 0)
+			break;
+
+		for (i = 0, p = head->fmh_recs; i < head->fmh_entries;
+		     i++, p++) {
+			if (p->fmr_owner != XFS_FMR_OWN_FREE)
+				continue;
+			ag->free_bytes += p->fmr_length;
+			ag->free_extents++;
+			ag->free_max = max(ag->free_max, p->fmr_length);
+		}
+
+		p = &head->fmh_recs[head->fmh_entries - 1];
+		if (p->fmr_flags & FMR_OF_LAST)
+			break;
+		fsmap_advance(head);
+	}
+	ag->have_fsmap = true;
+out:
+	free(head);
+}
+#else
+# define lscan_free_space(ls, agno, ag)	((void)0)
+#endif
+
+/* Scan every file whose inode lives in this AG. */
+static void
+lscan_ag(
+	struct workqueue	*wq,
+	uint32_t		agno,
+	void			*arg)
+{
+	struct lscan		*ls = wq->wq_ctx;
+	struct lscan_ag		*ag = &ls->ags[agno];
+	struct xfs_bulkstat_req	*breq;
+	struct fiemap		*fm;
+	uint32_t		*ag_seen;
+	uint32_t		stamp = 0;
+	unsigned int		i;
+	int			ret;
+
+	lscan_free_space(ls, agno, ag);
+
+	ag_seen = calloc(ls->xfd.fsgeom.agcount, sizeof(uint32_t));
+	fm = calloc(1, sizeof(struct fiemap) +
+			LSCAN_FIEMAP_BATCH * sizeof(struct fiemap_extent));
+	if (!ag_seen || !fm) {
+		ag->error = errno;
+		goto out;
+	}
+
+	ret = -xfrog_bulkstat_alloc_req(LSCAN_BATCH, 0, &breq);
+	if (ret) {
+		ag->error = ret;
+		goto out;
+	}
+	xfrog_bulkstat_set_ag(breq, agno);
+
+	while ((ret = -xfrog_bulkstat(&ls->xfd, breq)) == 0) {
+		if (breq->hdr.ocount == 0)
+			break;
+		for (i = 0; i < breq->hdr.ocount; i++) {
+			ret = lscan_file(ls, ag, &breq->bulkstat[i], fm,
+					ag_seen, ++stamp);
+			if (ret)
+				goto out_breq;
+		}
+	}
+out_breq:
+	if (ret)
+		ag->error = ret;
+	free(breq);
+out:
+	free(fm);
+	free(ag_seen);
+}
+
+static void
+lscan_print_hist(
+	const char		*title,
+	const char		*unit,
+	const uint64_t		*hist,
+	unsigned int		nr,
+	bool			log2)
+{
+	uint64_t		total = 0, most = 0;
+	unsigned int		first = nr, last = 0;
+	unsigned int		i;
+	char			range[64];
+
+	for (i = 0; i < nr; i++) {
+		total += hist[i];
+		most = max(most, hist[i]);
+		if (hist[i]) {
+			first = min(first, i);
+			last = i;
+		}
+	}
+	if (!total)
+		return;
+
+	printf(_("\n%s:\n"), title);
+	for (i = first; i <= last; i++) {
+		if (!log2)
+			snprintf(range, sizeof(range), "%u-%u", i * 10,
+					min(i * 10 + 9, 100));
+		else if (i == 0)
+			snprintf(range, sizeof(range), "1");
+		else
+			snprintf(range, sizeof(range), "%llu-%llu",
+					1ULL << i, (1ULL << (i + 1)) - 1);
+		printf("%18s %-6s %10llu %5.1f%% ", range, unit,
+				(unsigned long long)hist[i],
+				100.0 * hist[i] / total);
+		printf("%.*s\n", (int)(40 * hist[i] / most),
+				"########################################");
+	}
+}
+
+static void
+lscan_report(
+	struct lscan		*ls,
+	struct timeval		*t,
+	unsigned int		nr_threads,
+	bool			verbose)
+{
+	struct lscan_ag		sum = { NULL };
+	struct lscan_file	*files = NULL;
+	struct lscan_ag		*ag;
+	size_t			nr_files = 0;
+	uint32_t		agcount = ls->xfd.fsgeom.agcount;
+	uint32_t		agno;
+	size_t			i;
+	char			s1[64], s2[64], s3[64], ts[64];
+
+	for (agno = 0; agno < agcount; agno++) {
+		ag = &ls->ags[agno];
+		sum.scanned += ag->scanned;
+		sum.skipped += ag->skipped;
+		sum.bytes += ag->bytes;
+		sum.extents += ag->extents;
+		sum.ideal += ag->ideal;
+		sum.unaligned += ag->unaligned;
+		sum.small += ag->small;
+		sum.free_bytes += ag->free_bytes;
+		sum.free_extents += ag->free_extents;
+		sum.free_max = max(sum.free_max, ag->free_max);
+		if (ag->have_fsmap)
+			sum.have_fsmap = true;
+		for (i = 0; i < LSCAN_LOG_BUCKETS; i++) {
+			sum.extents_hist[i] += ag->extents_hist[i];
+			sum.extlen_hist[i] += ag->extlen_hist[i];
+		}
+		for (i = 0; i < LSCAN_SCORE_BUCKETS; i++)
+			sum.score_hist[i] += ag->score_hist[i];
+		nr_files += ag->nr_files;
+	}
+
+	files = malloc(max(nr_files, 1) * sizeof(struct lscan_file));
+	if (files) {
+		nr_files = 0;
+		for (agno = 0; agno < agcount; agno++) {
+			ag = &ls->ags[agno];
+			memcpy(files + nr_files, ag->files,
+					ag->nr_files * sizeof(struct lscan_file));
+			nr_files += ag->nr_files;
+		}
+		qsort(files, nr_files, sizeof(struct lscan_file),
+				lscan_file_cmp);
+	} else {
+		perror("layout_scan");
+		nr_files = 0;
+	}
+
+	timestr(t, ts, sizeof(ts), 0);
+	cvtstr((double)sum.bytes, s1, sizeof(s1));
+	printf(_("scanned %llu files, %s, in %u AGs with %u threads in %s\n"),
+			(unsigned long long)sum.scanned, s1, agcount,
+			nr_threads, ts);
+	if (sum.skipped)
+		printf(_("skipped %llu files that could not be mapped\n"),
+				(unsigned long long)sum.skipped);
+	printf(_("%llu extents, %llu at best; %llu unaligned, %llu small\n"),
+			(unsigned long long)sum.extents,
+			(unsigned long long)sum.ideal,
+			(unsigned long long)sum.unaligned,
+			(unsigned long long)sum.small);
+	if (ls->sunit) {
+		cvtstr((double)ls->sunit, s1, sizeof(s1));
+		cvtstr((double)ls->swidth, s2, sizeof(s2));
+		printf(_("stripe unit %s, stripe width %s\n"), s1, s2);
+	}
+	if (sum.have_fsmap) {
+		cvtstr((double)sum.free_bytes, s1, sizeof(s1));
+		cvtstr((double)sum.free_max, s2, sizeof(s2));
+		cvtstr(sum.free_extents ?
+				(double)sum.free_bytes / sum.free_extents : 0,
+				s3, sizeof(s3));
+		printf(_("free space %s in %llu extents, largest %s, average %s\n"),
+				s1, (unsigned long long)sum.free_extents,
+				s2, s3);
+	}
+
+	if (nr_files) {
+		printf(_("\nworst %zu files:\n"), min(nr_files, ls->top));
+		printf(_("%5s %20s %8s %8s %5s %9s %8s %10s\n"),
+				_("score"), _("inode"), _("extents"),
+				_("ideal"), _("AGs"), _("unaligned"),
+				_("small"), _("size"));
+		for (i = 0; i < nr_files && i < ls->top; i++) {
+			struct lscan_file	*f = &files[i];
+
+			cvtstr((double)f->bytes, s1, sizeof(s1));
+			printf("%5u %20llu %8u %8u %5u %9u %8u %10s\n",
+					f->score, (unsigned long long)f->ino,
+					f->extents, f->ideal, f->ags,
+					f->unaligned, f->small, s1);
+		}
+	}
+
+	lscan_print_hist(_("extents per file"), _("ext"), sum.extents_hist,
+			LSCAN_LOG_BUCKETS, true);
+	lscan_print_hist(_("extent length"), _("blks"), sum.extlen_hist,
+			LSCAN_LOG_BUCKETS, true);
+	lscan_print_hist(_("score"), "", sum.score_hist,
+			LSCAN_SCORE_BUCKETS, false);
+
+	if (verbose) {
+		printf(_("\n%6s %10s %10s %8s %10s %10s %10s\n"),
+				_("AG"), _("files"), _("extents"), _("ideal"),
+				_("free"), _("freeexts"), _("largest"));
+		for (agno = 0; agno < agcount; agno++) {
+			ag = &ls->ags[agno];
+			cvtstr((double)ag->free_bytes, s1, sizeof(s1));
+			cvtstr((double)ag->free_max, s2, sizeof(s2));
+			printf("%6u %10llu %10llu %8llu %10s %10llu %10s\n",
+					agno,
+					(unsigned long long)ag->scanned,
+					(unsigned long long)ag->extents,
+					(unsigned long long)ag->ideal,
+					ag->have_fsmap ? s1 : "-",
+					(unsigned long long)ag->free_extents,
+					ag->have_fsmap ? s2 : "-");
+		}
+	}
+
+	free(files);
+}
+
+static int
+layout_scan_f(
+	int			argc,
+	char			**argv)
+{
+	struct lscan		ls = {
+		.xfd		= XFS_FD_INIT(file->fd),
+		.small		= LSCAN_SMALL,
+		.top		= LSCAN_TOP,
+	};
+	struct workqueue	wq;
+	struct timeval		t1, t2;
+	void			*fshandle;
+	size_t			fshandle_len;
+	size_t			fsblocksize, fssectsize;
+	unsigned int		nr_threads = platform_nproc();
+	uint32_t		agno;
+	bool			verbose = false;
+	long long		l;
+	int			c;
+	int			ret, ret2;
+
+	init_cvtnum(&fsblocksize, &fssectsize);
+
+	while ((c = getopt(argc, argv, "n:s:t:v")) != EOF) {
+		switch (c) {
+		case 'n':
+			ls.top = cvt_u32(optarg, 10);
+			if (errno || ls.top == 0) {
+				printf(_("bad file count -- %s\n"), optarg);
+				exitcode = 1;
+				return 0;
+			}
+			break;
+		case 's':
+			l = cvtnum(fsblocksize, fssectsize, optarg);
+			if (l <= 0) {
+				printf(_("bad small extent size -- %s\n"),
+						optarg);
+				exitcode = 1;
+				return 0;
+			}
+			ls.small = l;
+			break;
+		case 't':
+			nr_threads = cvt_u32(optarg, 10);
+			if (errno || nr_threads == 0) {
+				printf(_("bad thread count -- %s\n"), optarg);
+				exitcode = 1;
+				return 0;
+			}
+			break;
+		case 'v':
+			verbose = true;
+			break;
+		default:
+			exitcode = 1;
+			return command_usage(&layout_scan_cmd);
+		}
+	}
+	if (optind != argc) {
+		exitcode = 1;
+		return command_usage(&layout_scan_cmd);
+	}
+
+	ret = -xfd_prepare_geometry(&ls.xfd);
+	if (ret) {
+		xfrog_perror(ret, "xfd_prepare_geometry");
+		exitcode = 1;
+		return 0;
+	}
+
+	ls.blocksize = ls.xfd.fsgeom.blocksize;
+	ls.agbytes = (uint64_t)ls.xfd.fsgeom.agblocks * ls.blocksize;
+	ls.max_extbytes = min(LSCAN_MAX_EXTLEN,
+			(uint64_t)ls.xfd.fsgeom.agblocks) * ls.blocksize;
+	ls.sunit = (uint64_t)ls.xfd.fsgeom.sunit * ls.blocksize;
+	ls.swidth = (uint64_t)ls.xfd.fsgeom.swidth * ls.blocksize;
+	ls.datadev = file->fs_path.fs_datadev;
+
+	if (path_to_fshandle(file->fs_path.fs_dir, &fshandle, &fshandle_len)) {
+		perror(file->fs_path.fs_dir);
+		exitcode = 1;
+		return 0;
+	}
+	memcpy(&ls.handle.ha_fsid, fshandle, sizeof(ls.handle.ha_fsid));
+	ls.handle.ha_fid.fid_len = sizeof(xfs_fid_t) -
+			sizeof(ls.handle.ha_fid.fid_len);
+	free_handle(fshandle, fshandle_len);
+
+	ls.ags = calloc(ls.xfd.fsgeom.agcount, sizeof(struct lscan_ag));
+	if (!ls.ags) {
+		perror("layout_scan");
+		exitcode = 1;
+		return 0;
+	}
+
+	ret = -workqueue_create(&wq, &ls, nr_threads);
+	if (ret) {
+		xfrog_perror(ret, "creating layout scan workqueue");
+		exitcode = 1;
+		goto out;
+	}
+
+	gettimeofday(&t1, NULL);
+	for (agno = 0; agno < ls.xfd.fsgeom.agcount; agno++) {
+		ret = -workqueue_add(&wq, lscan_ag, agno, NULL);
+		if (ret) {
+			xfrog_perror(ret, "queueing layout scan");
+			break;
+		}
+	}
+	ret2 = -workqueue_terminate(&wq);
+	if (!ret)
+		ret = ret2;
+	workqueue_destroy(&wq);
+	gettimeofday(&t2, NULL);
+	t2 = tsub(t2, t1);
+
+	for (agno = 0; agno < ls.xfd.fsgeom.agcount; agno++) {
+		if (ls.ags[agno].error) {
+			fprintf(stderr, _("scan of AG %u failed: %s\n"), agno,
+					strerror(ls.ags[agno].error));
+			ret = ls.ags[agno].error;
+		}
+	}
+	if (ret)
+		exitcode = 1;
+
+	lscan_report(&ls, &t2, nr_threads, verbose);
+out:
+	for (agno = 0; agno < ls.xfd.fsgeom.agcount; agno++)
+		free(ls.ags[agno].files);
+	free(ls.ags);
+	return 0;
+}
+
+void
+layout_scan_init(void)
+{
+	layout_scan_cmd.name = "layout_scan";
+	layout_scan_cmd.cfunc = layout_scan_f;
+	layout_scan_cmd.argmin = 0;
+	layout_scan_cmd.argmax = -1;
+	layout_scan_cmd.flags = CMD_NOMAP_OK | CMD_FLAG_ONESHOT;
+	layout_scan_cmd.args = _("[-v] [-n nr] [-s size] [-t threads]");
+	layout_scan_cmd.oneline =
+		_("rank files by how badly their data is laid out");
+	layout_scan_cmd.help = layout_scan_help;
+
+	add_command(&layout_scan_cmd);
+}
@@ -8,8 +8,10 @@
 #include "input.h"
 #include <sys/mman.h>
 #include <signal.h>
+#include <sys/resource.h>
 #include "init.h"
 #include "io.h"
+#include "libfrog/workqueue.h"
 
 static cmdinfo_t mmap_cmd;
 static cmdinfo_t mread_cmd;
@@ -371,6 +373,399 @@ msync_f(
 	return 0;
 }
 
+/* Default huge page size, if sysfs doesn't tell us. */
+#define MBENCH_HPAGE_SIZE	(2ULL << 20)
+
+static const struct {
+	const char	*name;
+	int		advice;
+} mbench_advice[] = {
+	{ "normal",	MADV_NORMAL },
+	{ "random",	MADV_RANDOM },
+	{ "sequential",	MADV_SEQUENTIAL },
+	{ "willneed",	MADV_WILLNEED },
+#ifdef MADV_HUGEPAGE
+	{ "hugepage",	MADV_HUGEPAGE },
+	{ "nohugepage",	MADV_NOHUGEPAGE },
+#endif
+#ifdef MADV_POPULATE_READ
+	{ "populate_read", MADV_POPULATE_READ },
+	{ "populate_write", MADV_POPULATE_WRITE },
+#endif
+	{ NULL,		0 },
+};
+
+/* Fault latencies measured by one benchmark thread. */
+struct mbench_thread {
+	uint64_t	*lat;
+	size_t		nr;
+};
+
+/* Page fault benchmark parameters and results. */
+struct mbench {
+	/* options */
+	unsigned int	nr_threads;
+	int		advice;		/* -1 for none */
+	bool		populate;
+	bool		huge;
+	bool		random;
+	bool		reverse;
+	bool		drop;
+	bool		compact;
+
+	/* benchmark mapping */
+	char		*base;
+	size_t		pages;
+	size_t		*order;		/* page visit order, or NULL */
+	bool		write;
+	int		seed;
+
+	struct mbench_thread *threads;
+};
+
+static inline uint64_t
+mbench_now(void)
+{
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int
+mbench_parse_advice(
+	struct mbench	*mb,
+	const char	*arg)
+{
+	int		i;
+
+	for (i = 0; mbench_advice[i].name; i++) {
+		if (!strcmp(arg, mbench_advice[i].name)) {
+			mb->advice = mbench_advice[i].advice;
+			return 0;
+		}
+	}
+	printf(_("unknown madvise advice -- %s\n"), arg);
+	return -1;
+}
+
+/* Size of a PMD-mapped transparent huge page. */
+static size_t
+mbench_hpage_size(void)
+{
+	FILE		*fp;
+	unsigned long long sz = 0;
+
+	fp = fopen("/sys/kernel/mm/transparent_hugepage/hpage_pmd_size", "r");
+	if (fp) {
+		if (fscanf(fp, "%llu", &sz) != 1)
+			sz = 0;
+		fclose(fp);
+	}
+	return sz ? sz : MBENCH_HPAGE_SIZE;
+}
+
+/*
+ * Each thread touches every nr_threads'th page of the visit order, so all
+ * threads fault adjacent pages of the file at the same time.
+ */
+static void
+mbench_worker(
+	struct workqueue	*wq,
+	uint32_t		index,
+	void			*arg)
+{
+	struct mbench		*mb = wq->wq_ctx;
+	struct mbench_thread	*mt = &mb->threads[index];
+	volatile char		*p;
+	uint64_t		start;
+	size_t			i, pg;
+
+	for (i = index; i < mb->pages; i += mb->nr_threads) {
+		pg = mb->order ? mb->order[i] : i;
+		p = mb->base + pg * pagesize;
+		start = mbench_now();
+		if (mb->write)
+			*p = mb->seed;
+		else
+			(void)*p;
+		mt->lat[mt->nr++] = mbench_now() - start;
+	}
+}
+
+/* Build the page visit order for reverse or random access. */
+static int
+mbench_order(
+	struct mbench	*mb)
+{
+	size_t		i, j, tmp;
+
+	if (!mb->reverse && !mb->random)
+		return 0;
+
+	mb->order = malloc(mb->pages * sizeof(size_t));
+	if (!mb->order) {
+		perror("malloc");
+		return -1;
+	}
+	for (i = 0; i < mb->pages; i++)
+		mb->order[i] = mb->reverse ? mb->pages - 1 - i : i;
+	if (mb->random) {
+		for (i = mb->pages - 1; i > 0; i--) {
+			j = random() % (i + 1);
+			tmp = mb->order[i];
+			mb->order[i] = mb->order[j];
+			mb->order[j] = tmp;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Map a range of the current file afresh and time the page faults taken
+ * while touching one byte of every page in it.
+ */
+static int
+mmap_bench(
+	struct mbench	*mb,
+	off64_t		offset,
+	size_t		length)
+{
+	struct workqueue wq;
+	struct rusage	ru1, ru2;
+	struct timeval	t1, t2;
+	struct stat	st;
+	uint64_t	*samples = NULL;
+	uint64_t	map_ns, faults, majflt;
+	char		*reserve = NULL, *addr;
+	size_t		reserve_len = 0, align = 0;
+	size_t		nr = 0;
+	off64_t		end;
+	unsigned int	i;
+	int		prot = PROT_READ | (mb->write ? PROT_WRITE : 0);
+	int		flags = mapping->flags;
+	int		ret = -1, ret2;
+
+	if (!file || strcmp(file->name, mapping->name)) {
+		printf(_("current mapping is not of the current file\n"));
+		return -1;
+	}
+
+	end = offset + length;
+	offset -= offset % pagesize;
+	length = roundup(end - offset, pagesize);
+	mb->pages = length / pagesize;
+	if (!mb->pages)
+		return 0;
+
+	/* Touching pages past EOF would kill us with SIGBUS. */
+	if (fstat(file->fd, &st) < 0) {
+		perror("fstat");
+		return -1;
+	}
+	if (end > roundup(st.st_size, pagesize)) {
+		printf(_("range (%lld:%lld) is beyond end of file (%lld)\n"),
+			(long long)offset, (long long)length,
+			(long long)st.st_size);
+		return -1;
+	}
+
+	if (mb->drop &&
+	    posix_fadvise(file->fd, offset, length, POSIX_FADV_DONTNEED))
+		perror("fadvise");
+	if (mb->populate)
+		flags |= MAP_POPULATE;
+
+	if (mb->huge) {
+		/*
+		 * Reserve enough address space to place the mapping so that
+		 * file offsets and addresses agree modulo the huge page size,
+		 * which the kernel needs to map the file with huge pages.
+		 */
+		align = mbench_hpage_size();
+		reserve_len = length + align;
+		reserve = mmap(NULL, reserve_len, PROT_NONE,
+				MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (reserve == MAP_FAILED) {
+			perror("mmap");
+			return -1;
+		}
+		addr = reserve + ((offset - (off64_t)(uintptr_t)reserve) &
+				(align - 1));
+		flags |= MAP_FIXED;
+	} else {
+		addr = NULL;
+	}
+
+	getrusage(RUSAGE_SELF, &ru1);
+	gettimeofday(&t1, NULL);
+	map_ns = mbench_now();
+	mb->base = mmap(addr, length, prot, flags, file->fd, offset);
+	map_ns = mbench_now() - map_ns;
+	if (mb->base == MAP_FAILED) {
+		perror("mmap");
+		goto out_reserve;
+	}
+	if (mb->advice >= 0 && madvise(mb->base, length, mb->advice) < 0) {
+		perror("madvise");
+		goto out_unmap;
+	}
+
+	if (mbench_order(mb))
+		goto out_unmap;
+
+	mb->threads = calloc(mb->nr_threads, sizeof(struct mbench_thread));
+	if (!mb->threads) {
+		perror("calloc");
+		goto out_order;
+	}
+	for (i = 0; i < mb->nr_threads; i++) {
+		mb->threads[i].lat = malloc((mb->pages / mb->nr_threads + 1) *
+				sizeof(uint64_t));
+		if (!mb->threads[i].lat) {
+			perror("malloc");
+			goto out_threads;
+		}
+	}
+
+	ret = -workqueue_create(&wq, mb, mb->nr_threads);
+	if (ret) {
+		errno = ret;
+		perror("workqueue_create");
+		ret = -1;
+		goto out_threads;
+	}
+	for (i = 0; i < mb->nr_threads; i++) {
+		ret = -workqueue_add(&wq, mbench_worker, i, NULL);
+		if (ret) {
+			errno = ret;
+			perror("workqueue_add");
+			ret = -1;
+			break;
+		}
+	}
+	ret2 = -workqueue_terminate(&wq);
+	workqueue_destroy(&wq);
+	if (ret2 && !ret) {
+		errno = ret2;
+		perror("workqueue_terminate");
+		ret = -1;
+	}
+	gettimeofday(&t2, NULL);
+	getrusage(RUSAGE_SELF, &ru2);
+	if (ret)
+		goto out_threads;
+
+	/* Merge the per-thread samples and report. */
+	for (i = 0; i < mb->nr_threads; i++)
+		nr += mb->threads[i].nr;
+	samples = malloc(nr * sizeof(uint64_t));
+	if (!samples) {
+		perror("malloc");
+		ret = -1;
+		goto out_threads;
+	}
+	for (nr = 0, i = 0; i < mb->nr_threads; i++) {
+		memcpy(samples + nr, mb->threads[i].lat,
+				mb->threads[i].nr * sizeof(uint64_t));
+		nr += mb->threads[i].nr;
+	}
+
+	t2 = tsub(t2, t1);
+	majflt = ru2.ru_majflt - ru1.ru_majflt;
+	faults = ru2.ru_minflt - ru1.ru_minflt + majflt;
+	if (mb->compact) {
+		printf("%zu,%llu,%llu,%.3f,%.2f,%.2f\n", mb->pages,
+			(unsigned long long)faults,
+			(unsigned long long)majflt, map_ns / 1000.0,
+			tdiv((double)mb->pages, t2),
+			tdiv((double)faults, t2));
+	} else {
+		char	ts[64];
+
+		timestr(&t2, ts, sizeof(ts), 0);
+		printf(_("%s %zu pages with %u threads in %s (%.2f pages/sec)\n"),
+			mb->write ? _("wrote") : _("read"), mb->pages,
+			mb->nr_threads, ts, tdiv((double)mb->pages, t2));
+		printf(_("%llu faults (%llu major), %.2f faults/sec, mmap took %.3f usec\n"),
+			(unsigned long long)faults,
+			(unsigned long long)majflt, tdiv((double)faults, t2),
+			map_ns / 1000.0);
+	}
+	report_latency(_("access"), samples, nr, mb->compact);
+	ret = 0;
+
+	free(samples);
+out_threads:
+	for (i = 0; i < mb->nr_threads; i++)
+		free(mb->threads[i].lat);
+	free(mb->threads);
+	mb->threads = NULL;
+out_order:
+	free(mb->order);
+	mb->order = NULL;
+out_unmap:
+	if (!reserve)
+		munmap(mb->base, length);
+out_reserve:
+	if (reserve)
+		munmap(reserve, reserve_len);
+	return ret;
+}
+
+/* Parse an option shared by the mread and mwrite benchmark modes. */
+static int
+mbench_getopt(
+	struct mbench	*mb,
+	int		c,
+	char		*arg)
+{
+	switch (c) {
+	case 'A':
+		return mbench_parse_advice(mb, arg);
+	case 'd':
+		mb->drop = true;
+		break;
+	case 'H':
+		mb->huge = true;
+		break;
+	case 'p':
+		mb->populate = true;
+		break;
+	case 'q':
+		mb->compact = true;
+		break;
+	case 'R':
+		mb->random = true;
+		break;
+	case 't':
+		mb->nr_threads = cvt_u32(arg, 10);
+		if (errno || mb->nr_threads == 0) {
+			printf(_("bad thread count -- %s\n"), arg);
+			return -1;
+		}
+		break;
+	}
+	return 0;
+}
+
+static void
+mbench_help(void)
+{
+	printf(_(
+" -b -- benchmark page faults instead; the range is mapped again from the\n"
+"       current file and one byte of every page is accessed and timed\n"
+"   -A <advice> -- madvise the new mapping (normal, random, sequential,\n"
+"                  willneed, hugepage, nohugepage, populate_read,\n"
+"                  populate_write)\n"
+"   -d -- drop the range from the page cache first\n"
+"   -H -- align the mapping so that it can use huge pages\n"
+"   -p -- map with MAP_POPULATE\n"
+"   -q -- print the results in CSV format\n"
+"   -R -- access pages in random order\n"
+"   -t <nr> -- fault the range with this many threads\n"));
+}
+
 static void
 mread_help(void)
 {
@@ -386,7 +781,9 @@ mread_help(void)
 " -f -- verbose mode, dump bytes with offsets relative to start of file.\n"
 " -r -- reverse order; start accessing from the end of range, moving backward\n"
 " -v -- verbose mode, dump bytes with offsets relative to start of mapping.\n"
-" The accesses are performed sequentially from the start offset by default.\n"
+" The accesses are performed sequentially from the start offset by default.\n"));
+	mbench_help();
+	printf(_(
 " Notes:\n"
 "   References to whole pages following the end of the backing file results\n"
 "   in delivery of the SIGBUS signal.  SIGBUS signals may also be delivered\n"
@@ -408,9 +805,27 @@ mread_f(
 	void		*start;
 	int		dump = 0, rflag = 0, c;
 	size_t		blocksize, sectsize;
+	struct mbench	mb = { .nr_threads = 1, .advice = -1 };
+	bool		bench = false, bench_opt = false;
 
-	while ((c = getopt(argc, argv, "frv")) != EOF) {
+	while ((c = getopt(argc, argv, "A:bdfHpqRrt:v")) != EOF) {
 		switch (c) {
+		case 'b':
+			bench = true;
+			break;
+		case 'A':
+		case 'd':
+		case 'H':
+		case 'p':
+		case 'q':
+		case 'R':
+		case 't':
+			bench_opt = true;
+			if (mbench_getopt(&mb, c, optarg)) {
+				exitcode = 1;
+				return 0;
+			}
+			break;
 		case 'f':
 			dump = 2;	/* file offset dump */
 			break;
@@ -425,6 +840,10 @@ mread_f(
 			return command_usage(&mread_cmd);
 		}
 	}
+	if (bench_opt && !bench) {
+		exitcode = 1;
+		return command_usage(&mread_cmd);
+	}
 
 	if (optind == argc) {
 		offset = mapping->offset;
@@ -455,6 +874,12 @@ mread_f(
 		exitcode = 1;
 		return 0;
 	}
+	if (bench) {
+		mb.reverse = rflag;
+		if (mmap_bench(&mb, offset, length))
+			exitcode = 1;
+		return 0;
+	}
 	dumpoffset = offset - mapping->offset;
 	if (dump == 2)
 		printoffset = offset;
@@ -557,8 +982,9 @@ mwrite_help(void)
 " The default stored value is 'X', repeated to fill the range specified.\n"
 " -S -- use an alternate seed character\n"
 " -r -- reverse order; start storing from the end of range, moving backward\n"
-" The stores are performed sequentially from the start offset by default.\n"
-"\n"));
+" The stores are performed sequentially from the start offset by default.\n"));
+	mbench_help();
+	printf("\n");
 }
 
 static int
@@ -574,9 +1000,27 @@ mwrite_f(
 	int		rflag = 0;
 	int		c;
 	size_t		blocksize, sectsize;
+	struct mbench	mb = { .nr_threads = 1, .advice = -1 };
+	bool		bench = false, bench_opt = false;
 
-	while ((c = getopt(argc, argv, "rS:")) != EOF) {
+	while ((c = getopt(argc, argv, "A:bdHpqRrS:t:")) != EOF) {
 		switch (c) {
+		case 'b':
+			bench = true;
+			break;
+		case 'A':
+		case 'd':
+		case 'H':
+		case 'p':
+		case 'q':
+		case 'R':
+		case 't':
+			bench_opt = true;
+			if (mbench_getopt(&mb, c, optarg)) {
+				exitcode = 1;
+				return 0;
+			}
+			break;
 		case 'r':
 			rflag = 1;
 			break;
@@ -592,6 +1036,10 @@ mwrite_f(
 			return command_usage(&mwrite_cmd);
 		}
 	}
+	if (bench_opt && !bench) {
+		exitcode = 1;
+		return command_usage(&mwrite_cmd);
+	}
 
 	if (optind == argc) {
 		offset = mapping->offset;
@@ -624,6 +1072,15 @@ mwrite_f(
 		return 0;
 	}
 
+	if (bench) {
+		mb.reverse = rflag;
+		mb.write = true;
+		mb.seed = seed;
+		if (mmap_bench(&mb, offset, length))
+			exitcode = 1;
+		return 0;
+	}
+
 	offset -= mapping->offset;
 	if (rflag) {
 		for (tmp = offset + length -1; tmp >= offset; tmp--)
@@ -735,7 +1192,8 @@ mmap_init(void)
 	mread_cmd.argmin = 0;
 	mread_cmd.argmax = -1;
 	mread_cmd.flags = CMD_NOFILE_OK | CMD_FOREIGN_OK;
-	mread_cmd.args = _("[-r] [off len]");
+	mread_cmd.args =
+		_("[-r] [-b [-dHpqR] [-A advice] [-t nr]] [off len]");
 	mread_cmd.oneline =
 		_("reads data from a region in the current memory mapping");
 	mread_cmd.help = mread_help;
@@ -764,7 +1222,8 @@ mmap_init(void)
 	mwrite_cmd.argmin = 0;
 	mwrite_cmd.argmax = -1;
 	mwrite_cmd.flags = CMD_NOFILE_OK | CMD_FOREIGN_OK;
-	mwrite_cmd.args = _("[-r] [-S seed] [off len]");
+	mwrite_cmd.args =
+		_("[-r] [-S seed] [-b [-dHpqR] [-A advice] [-t nr]] [off len]");
 	mwrite_cmd.oneline =
 		_("writes data into a region in the current memory mapping");
 	mwrite_cmd.help = mwrite_help;
@@ -9,12 +9,18 @@
 #include "libfrog/paths.h"
 #include "parent.h"
 #include "handle.h"
-#include "jdm.h"
 #include "init.h"
 #include "io.h"
+#include "libfrog/logging.h"
+#include "libfrog/fsgeom.h"
+#include "libfrog/bulkstat.h"
+#include "libfrog/workqueue.h"
+#include "libfrog/ptvar.h"
+#include "libfrog/platform.h"
 
 #define PARENTBUF_SZ		16384
-#define BSTATBUF_SZ		16384
+#define BSTATBUF_SZ		4096
+#define PATHCACHE_SZ		256
 
 static cmdinfo_t parent_cmd;
 static int verbose_flag;
@@ -22,18 +28,91 @@ static int err_status;
 static __u64 inodes_checked;
 static char *mntpt;
 
+/* Remembers the inode number of a recently stat'd parent directory. */
+struct pathcache_ent {
+	char			*path;
+	__u64			ino;
+};
+
+/* Per-thread state for the parent pointer checker. */
+struct parent_scan {
+	parent_t		*parentbuf;
+	size_t			parentbuf_size;
+	struct xfs_bulkstat_req	*breq;
+	struct xfs_handle	handle;
+	struct pathcache_ent	pathcache[PATHCACHE_SZ];
+};
+
+/* Global state for the parent pointer checker. */
+static struct {
+	struct xfs_fd		xfd;
+	struct ptvar		*ptvar;
+	struct xfs_handle	handle;
+	__u64			rootino;
+	pthread_mutex_t		lock;
+	struct timeval		start;
+	struct timeval		last_report;
+	bool			reported;
+	bool			aborted;
+} pc = {
+	.xfd			= XFS_FD_INIT_EMPTY,
+	.lock			= PTHREAD_MUTEX_INITIALIZER,
+};
+
+static void
+parent_error(void)
+{
+	pthread_mutex_lock(&pc.lock);
+	err_status++;
+	pthread_mutex_unlock(&pc.lock);
+}
+
+/*
+ * Look up the inode number of a parent directory.  Most inodes in a directory
+ * are checked by the same thread, so keep a small per-thread cache of the
+ * directories we've already stat'd.
+ */
+static int
+parent_dir_ino(struct parent_scan *ps, const char *path, __u64 *ino)
+{
+	struct pathcache_ent *ent;
+	struct stat statbuf;
+	const char *p;
+	unsigned int hash = 0;
+
+	for (p = path; *p; p++)
+		hash = (hash << 5) + hash + (unsigned char)*p;
+	ent = &ps->pathcache[hash % PATHCACHE_SZ];
+
+	if (ent->path && !strcmp(ent->path, path)) {
+		*ino = ent->ino;
+		return 0;
+	}
+
+	if (stat(path, &statbuf) != 0)
+		return -1;
+
+	free(ent->path);
+	ent->path = strdup(path);
+	ent->ino = statbuf.st_ino;
+	*ino = statbuf.st_ino;
+	return 0;
+}
+
 /*
  * check out a parent entry to see if the values seem valid
  */
 static void
-check_parent_entry(struct xfs_bstat *bstatp, parent_t *parent)
+check_parent_entry(struct parent_scan *ps, struct xfs_bulkstat *bstatp,
+		parent_t *parent)
 {
 	int sts;
 	char fullpath[PATH_MAX];
 	struct stat statbuf;
+	__u64 parent_ino;
 	char *str;
 
-	sprintf(fullpath, _("%s%s"), mntpt, parent->p_name);
+	snprintf(fullpath, sizeof(fullpath), _("%s%s"), mntpt, parent->p_name);
 
 	sts = lstat(fullpath, &statbuf);
 	if (sts != 0) {
@@ -47,7 +126,7 @@ check_parent_entry(struct xfs_bstat *bstatp, parent_t *parent)
 			       (unsigned long long) bstatp->bs_ino,
 				strerror(errno));
 		}
-		err_status++;
+		parent_error();
 		return;
 	} else {
 		if (verbose_flag > 1) {
@@ -66,7 +145,7 @@ check_parent_entry(struct xfs_bstat *bstatp, parent_t *parent)
 				(unsigned long long)statbuf.st_ino,
 				(unsigned long long)bstatp->bs_ino);
 		}
-		err_status++;
+		parent_error();
 		return;
 	} else if (verbose_flag > 1) {
 		printf(_("inode number match: %llu\n"),
@@ -76,16 +155,16 @@ check_parent_entry(struct xfs_bstat *bstatp, parent_t *parent)
 	/* get parent path */
 	str = strrchr(fullpath, '/');
 	*str = '\0';
-	sts = stat(fullpath, &statbuf);
+	sts = parent_dir_ino(ps, fullpath, &parent_ino);
 	if (sts != 0) {
 		fprintf(stderr,
 			_("parent path \"%s\" does not stat: %s\n"),
 			fullpath,
 			strerror(errno));
-		err_status++;
+		parent_error();
 		return;
 	} else {
-		if (parent->p_ino != statbuf.st_ino) {
+		if (parent->p_ino != parent_ino) {
 			fprintf(stderr,
 				_("inode-path for inode: %llu is incorrect - wrong parent inode#\n"),
 			       (unsigned long long) bstatp->bs_ino);
@@ -94,9 +173,9 @@ check_parent_entry(struct xfs_bstat *bstatp, parent_t *parent)
 					_("ino mismatch for path \"%s\" %llu vs %llu\n"),
 					fullpath,
 					(unsigned long long)parent->p_ino,
-					(unsigned long long)statbuf.st_ino);
+					(unsigned long long)parent_ino);
 			}
-			err_status++;
+			parent_error();
 			return;
 		} else {
 			if (verbose_flag > 1) {
@@ -108,90 +187,180 @@ check_parent_entry(struct xfs_bstat *bstatp, parent_t *parent)
 }
 
 static void
-check_parents(parent_t *parentbuf, size_t *parentbuf_size,
-	     jdm_fshandle_t *fshandlep, struct xfs_bstat *statp)
+check_parents(struct parent_scan *ps, struct xfs_bulkstat *statp)
 {
 	int error, i;
-	__u32 count;
+	__u32 count = 0;
 	parent_t *entryp;
 
+	/* Reuse this thread's handle; only the inode number changes. */
+	ps->handle.ha_fid.fid_ino = statp->bs_ino;
+	ps->handle.ha_fid.fid_gen = statp->bs_gen;
+
 	do {
-		error = jdm_parentpaths(fshandlep, statp, parentbuf, *parentbuf_size, &count);
+		error = parentpaths_by_handle(&ps->handle, sizeof(ps->handle),
+				ps->parentbuf, ps->parentbuf_size, &count);
+		if (error && errno == ERANGE) {
+			parent_t *newbuf;
 
-		if (error == ERANGE) {
-			*parentbuf_size *= 2;
-			parentbuf = (parent_t *)realloc(parentbuf, *parentbuf_size);
+			newbuf = realloc(ps->parentbuf, ps->parentbuf_size * 2);
+			if (!newbuf) {
+				fprintf(stderr,
+					_("unable to allocate buffers: %s\n"),
+					strerror(errno));
+				parent_error();
+				return;
+			}
+			ps->parentbuf = newbuf;
+			ps->parentbuf_size *= 2;
 		} else if (error) {
+			/*
+			 * Every other inode will fail the same way if the
+			 * kernel can't hand out parent pointers, so say so
+			 * once and stop the whole scan.
+			 */
+			if (errno == EOPNOTSUPP || errno == ENOTTY) {
+				pthread_mutex_lock(&pc.lock);
+				if (!pc.aborted)
+					fprintf(stderr,
+						_("parentpaths not supported: %s\n"),
+						strerror(errno));
+				pc.aborted = true;
+				err_status++;
+				pthread_mutex_unlock(&pc.lock);
+				return;
+			}
 			fprintf(stderr, _("parentpaths failed for ino %llu: %s\n"),
 			       (unsigned long long) statp->bs_ino,
 				strerror(errno));
-			err_status++;
-			break;
+			parent_error();
+			return;
 		}
-	} while (error == ERANGE);
-
+	} while (error);
 
 	if (count == 0) {
 		/* no links for inode - something wrong here */
 	       fprintf(stderr, _("inode-path for inode: %llu is missing\n"),
 			       (unsigned long long) statp->bs_ino);
-		err_status++;
+		parent_error();
 	}
 
-	entryp = parentbuf;
+	entryp = ps->parentbuf;
 	for (i = 0; i < count; i++) {
-		check_parent_entry(statp, entryp);
+		check_parent_entry(ps, statp, entryp);
 		entryp = (parent_t*) (((char*)entryp) + entryp->p_reclen);
 	}
 }
 
-static int
-do_bulkstat(parent_t *parentbuf, size_t *parentbuf_size,
-	    struct xfs_bstat *bstatbuf, int fsfd, jdm_fshandle_t *fshandlep)
+/* Add to the number of inodes checked and report progress now and then. */
+static void
+parent_progress(unsigned int nr)
 {
-	__s32 buflenout;
-	__u64 lastino = 0;
-	struct xfs_bstat *p;
-	struct xfs_bstat *endp;
-	struct xfs_fsop_bulkreq bulkreq;
-	struct stat mntstat;
+	struct timeval now, elapsed;
+
+	pthread_mutex_lock(&pc.lock);
+	inodes_checked += nr;
+	if (verbose_flag == 1) {
+		gettimeofday(&now, NULL);
+		elapsed = tsub(now, pc.last_report);
+		if (elapsed.tv_sec >= 1) {
+			pc.last_report = now;
+			pc.reported = true;
+			printf(_("\rchecked %llu inodes (%.0f inodes/sec)"),
+				(unsigned long long)inodes_checked,
+				tdiv(inodes_checked, tsub(now, pc.start)));
+			fflush(stdout);
+		}
+	}
+	pthread_mutex_unlock(&pc.lock);
+}
 
-	if (stat(mntpt, &mntstat)) {
-		fprintf(stderr, _("can't stat mount point \"%s\": %s\n"),
-			mntpt, strerror(errno));
-		return 1;
+/* Set up this thread's buffers the first time it runs. */
+static struct parent_scan *
+parent_scan_get(void)
+{
+	struct parent_scan *ps;
+	int ret;
+
+	ps = ptvar_get(pc.ptvar, &ret);
+	if (ret) {
+		xfrog_perror(ret, "getting per-thread parent scan state");
+		return NULL;
 	}
+	if (ps->parentbuf)
+		return ps;
 
-	bulkreq.lastip  = &lastino;
-	bulkreq.icount  = BSTATBUF_SZ;
-	bulkreq.ubuffer = (void *)bstatbuf;
-	bulkreq.ocount  = &buflenout;
+	ret = -xfrog_bulkstat_alloc_req(BSTATBUF_SZ, 0, &ps->breq);
+	if (ret) {
+		xfrog_perror(ret, "allocating bulkstat request");
+		return NULL;
+	}
+	ps->parentbuf_size = PARENTBUF_SZ;
+	ps->parentbuf = malloc(ps->parentbuf_size);
+	if (!ps->parentbuf) {
+		fprintf(stderr, _("unable to allocate buffers: %s\n"),
+			strerror(errno));
+		free(ps->breq);
+		ps->breq = NULL;
+		return NULL;
+	}
+	memcpy(&ps->handle, &pc.handle, sizeof(ps->handle));
+	return ps;
+}
 
-	while (xfsctl(mntpt, fsfd, XFS_IOC_FSBULKSTAT, &bulkreq) == 0) {
-		if (*(bulkreq.ocount) == 0) {
-			return 0;
-		}
-		for (p = bstatbuf, endp = bstatbuf + *bulkreq.ocount; p < endp; p++) {
+/* Check the parent pointers of every inode in an AG. */
+static void
+check_ag_parents(struct workqueue *wq, uint32_t agno, void *arg)
+{
+	struct parent_scan *ps;
+	struct xfs_bulkstat_req *breq;
+	struct xfs_bulkstat *p, *endp;
+	struct xfs_bulkstat single;
+	unsigned int checked;
+	int ret;
+
+	ps = parent_scan_get();
+	if (!ps) {
+		parent_error();
+		return;
+	}
+	breq = ps->breq;
+	memset(&breq->hdr, 0, sizeof(breq->hdr));
+	breq->hdr.icount = BSTATBUF_SZ;
+	xfrog_bulkstat_set_ag(breq, agno);
 
-			/* inode being modified, get synced data with iget */
-			if ( (!p->bs_nlink || !p->bs_mode) && p->bs_ino != 0 ) {
+	while ((ret = -xfrog_bulkstat(&pc.xfd, breq)) == 0) {
+		if (breq->hdr.ocount == 0)
+			return;
 
-				if (xfsctl(mntpt, fsfd, XFS_IOC_FSBULKSTAT_SINGLE, &bulkreq) < 0) {
+		checked = 0;
+		for (p = breq->bulkstat, endp = p + breq->hdr.ocount;
+		     p < endp; p++) {
+			if (pc.aborted)
+				return;
+
+			/* inode being modified, get synced data */
+			if ((!p->bs_nlink || !p->bs_mode) && p->bs_ino != 0) {
+				ret = -xfrog_bulkstat_single(&pc.xfd,
+						p->bs_ino, 0, &single);
+				if (ret) {
 				    fprintf(stderr,
 					  _("failed to get bulkstat information for inode %llu\n"),
 					 (unsigned long long) p->bs_ino);
 				    continue;
 				}
-				if (!p->bs_nlink || !p->bs_mode || !p->bs_ino) {
+				if (!single.bs_nlink || !single.bs_mode ||
+				    !single.bs_ino) {
 				    fprintf(stderr,
 					  _("failed to get valid bulkstat information for inode %llu\n"),
 					 (unsigned long long) p->bs_ino);
 				    continue;
 				}
+				memcpy(p, &single, sizeof(single));
 			}
 
 			/* skip root */
-			if (p->bs_ino == mntstat.st_ino) {
+			if (p->bs_ino == pc.rootino) {
 				continue;
 			}
 
@@ -200,57 +369,112 @@ do_bulkstat(parent_t *parentbuf, size_t *parentbuf_size,
 				       (unsigned long long) p->bs_ino);
 			}
 
-			/* print dotted progress */
-			if ((inodes_checked % 100) == 0 && verbose_flag == 1) {
-				printf("."); fflush(stdout);
-			}
-			inodes_checked++;
-
-			check_parents(parentbuf, parentbuf_size, fshandlep, p);
+			checked++;
+			check_parents(ps, p);
 		}
+		parent_progress(checked);
+	}
+
+	fprintf(stderr, _("bulkstat failed for AG %u: %s\n"), agno,
+			strerror(ret));
+	parent_error();
+}
 
-	}/*while*/
+static int
+parent_scan_free(struct ptvar *ptv, void *data, void *arg)
+{
+	struct parent_scan *ps = data;
+	int i;
 
-	fprintf(stderr, _("syssgi bulkstat failed: %s\n"), strerror(errno));
-	return 1;
+	for (i = 0; i < PATHCACHE_SZ; i++)
+		free(ps->pathcache[i].path);
+	free(ps->parentbuf);
+	free(ps->breq);
+	return 0;
 }
 
 static int
-parent_check(void)
+parent_check(unsigned int nr_threads)
 {
-	int fsfd;
-	jdm_fshandle_t *fshandlep;
-	parent_t *parentbuf;
-	size_t parentbuf_size = PARENTBUF_SZ;
-	struct xfs_bstat *bstatbuf;
+	struct workqueue wq;
+	struct stat mntstat;
+	struct timeval end;
+	void *fshandle;
+	size_t fshlen;
+	uint32_t agno;
+	int ret;
 
 	err_status = 0;
 	inodes_checked = 0;
+	pc.reported = false;
+	pc.aborted = false;
 
 	sync();
 
-        fsfd = file->fd;
+	if (stat(mntpt, &mntstat)) {
+		fprintf(stderr, _("can't stat mount point \"%s\": %s\n"),
+			mntpt, strerror(errno));
+		return 1;
+	}
+	pc.rootino = mntstat.st_ino;
 
-	fshandlep = jdm_getfshandle(mntpt);
-	if (fshandlep == NULL) {
+	if (path_to_fshandle(mntpt, &fshandle, &fshlen) != 0) {
 		fprintf(stderr, _("unable to open \"%s\" for jdm: %s\n"),
 		      mntpt,
 		      strerror(errno));
 		return 1;
 	}
+	memset(&pc.handle, 0, sizeof(pc.handle));
+	memcpy(&pc.handle.ha_fsid, fshandle, sizeof(pc.handle.ha_fsid));
+	pc.handle.ha_fid.fid_len = sizeof(xfs_fid_t) -
+			sizeof(pc.handle.ha_fid.fid_len);
+	free_handle(fshandle, fshlen);
+
+	pc.xfd.fd = file->fd;
+	ret = -xfd_prepare_geometry(&pc.xfd);
+	if (ret) {
+		xfrog_perror(ret, "xfd_prepare_geometry");
+		return 1;
+	}
 
-	/* allocate buffers */
-        bstatbuf = (struct xfs_bstat *)calloc(BSTATBUF_SZ, sizeof(struct xfs_bstat));
-	parentbuf = (parent_t *)malloc(parentbuf_size);
-	if (!bstatbuf || !parentbuf) {
-		fprintf(stderr, _("unable to allocate buffers: %s\n"),
-			strerror(errno));
+	if (nr_threads == 0)
+		nr_threads = min(platform_nproc(), pc.xfd.fsgeom.agcount);
+
+	ret = -ptvar_alloc(nr_threads, sizeof(struct parent_scan), &pc.ptvar);
+	if (ret) {
+		xfrog_perror(ret, "creating per-thread parent scan state");
+		return 1;
+	}
+
+	ret = -workqueue_create(&wq, NULL, nr_threads);
+	if (ret) {
+		xfrog_perror(ret, "creating parent check workqueue");
 		err_status = 1;
-		goto out;
+		goto out_ptvar;
 	}
 
-	if (do_bulkstat(parentbuf, &parentbuf_size, bstatbuf, fsfd, fshandlep) != 0)
+	gettimeofday(&pc.start, NULL);
+	pc.last_report = pc.start;
+
+	for (agno = 0; agno < pc.xfd.fsgeom.agcount; agno++) {
+		ret = -workqueue_add(&wq, check_ag_parents, agno, NULL);
+		if (ret) {
+			xfrog_perror(ret, "queueing parent check");
+			err_status++;
+			break;
+		}
+	}
+
+	ret = -workqueue_terminate(&wq);
+	if (ret) {
+		xfrog_perror(ret, "finishing parent check");
 		err_status++;
+	}
+	workqueue_destroy(&wq);
+	gettimeofday(&end, NULL);
+
+	if (pc.reported)
+		printf("\n");
 
 	if (err_status > 0)
 		fprintf(stderr, _("num errors: %d\n"), err_status);
@@ -258,10 +482,22 @@ parent_check(void)
 		printf(_("succeeded checking %llu inodes\n"),
 			(unsigned long long) inodes_checked);
 
-out:
-	free(bstatbuf);
-	free(parentbuf);
-	free(fshandlep);
+	if (verbose_flag) {
+		char ts[64];
+
+		end = tsub(end, pc.start);
+		timestr(&end, ts, sizeof(ts), 0);
+		printf(_("checked %llu inodes in %u AGs with %u threads in %s (%.0f inodes/sec)\n"),
+			(unsigned long long)inodes_checked,
+			pc.xfd.fsgeom.agcount, nr_threads, ts,
+			tdiv(inodes_checked, end));
+	}
+
+out_ptvar:
+	ptvar_foreach(pc.ptvar, parent_scan_free, NULL);
+	ptvar_free(pc.ptvar);
+	pc.ptvar = NULL;
+	pc.xfd.fd = -1;
 	return err_status;
 }
 
@@ -364,6 +600,7 @@ parent_f(int argc, char **argv)
 	int c;
 	int listpath_flag = 0;
 	int check_flag = 0;
+	unsigned int nr_threads = 1;
 	fs_path_t *fs;
 	static int tab_init;
 
@@ -382,7 +619,7 @@ parent_f(int argc, char **argv)
 
 	verbose_flag = 0;
 
-	while ((c = getopt(argc, argv, "cpv")) != EOF) {
+	while ((c = getopt(argc, argv, "cpt:v")) != EOF) {
 		switch (c) {
 		case 'c':
 			check_flag = 1;
@@ -390,6 +627,14 @@ parent_f(int argc, char **argv)
 		case 'p':
 			listpath_flag = 1;
 			break;
+		case 't':
+			nr_threads = cvt_u32(optarg, 10);
+			if (errno) {
+				perror(optarg);
+				exitcode = 1;
+				return 0;
+			}
+			break;
 		case 'v':
 			verbose_flag++;
 			break;
@@ -404,7 +649,7 @@ parent_f(int argc, char **argv)
 		if (listpath_flag)
 			exitcode = parent_list(listpath_flag);
 		if (check_flag)
-			exitcode = parent_check();
+			exitcode = parent_check(nr_threads);
 	}
 
 	return 0;
@@ -419,7 +664,9 @@ parent_help(void)
 "\n"
 " -c -- check the current file's file system for parent consistency\n"
 " -p -- list the current file's parents and their full paths\n"
-" -v -- verbose mode\n"
+" -t -- check with this many threads, one AG at a time per thread;\n"
+"       0 picks a thread count from the CPU and AG counts\n"
+" -v -- verbose mode; with -c, report progress and inodes checked per second\n"
 "\n"));
 }
 
@@ -430,7 +677,7 @@ parent_init(void)
 	parent_cmd.cfunc = parent_f;
 	parent_cmd.argmin = 0;
 	parent_cmd.argmax = -1;
-	parent_cmd.args = _("[-cpv]");
+	parent_cmd.args = _("[-cpv] [-t nr]");
 	parent_cmd.flags = CMD_NOMAP_OK;
 	parent_cmd.oneline = _("print or check parent inodes");
 	parent_cmd.help = parent_help;
@@ -40,6 +40,11 @@ pread_help(void)
 #ifdef HAVE_PREADV
 " -V N -- use vectored IO with N iovecs of blocksize each (preadv)\n"
 #endif
+" -A N -- check blocks stamped by 'pwrite -A', reading asynchronously with\n"
+"         N reads in flight per thread; bad blocks are reported by offset\n"
+" -G N -- stamps must have generation N (used with -A)\n"
+" -S N -- stamps must have seed N (used with -A)\n"
+" -t N -- check with N threads, each taking a slice of the range (with -A)\n"
 "\n"
 " When in \"random\" mode, the number of read operations will equal the\n"
 " number required to do a complete forward/backward scan of the range.\n"
@@ -377,13 +382,51 @@ pread_f(
 	int		Cflag, qflag, uflag, vflag;
 	int		eof = 0, direction = IO_FORWARD;
 	int		c;
+	struct stamp_io	si = {
+		.verify		= true,
+		.nr_threads	= 1,
+	};
 
 	Cflag = qflag = uflag = vflag = 0;
 	init_cvtnum(&fsblocksize, &fssectsize);
 	bsize = fsblocksize;
 
-	while ((c = getopt(argc, argv, "b:BCFRquvV:Z:")) != EOF) {
+	while ((c = getopt(argc, argv, "A:b:BCFG:RqS:t:uvV:Z:")) != EOF) {
 		switch (c) {
+		case 'A':
+			si.depth = cvt_u32(optarg, 10);
+			if (errno || si.depth == 0) {
+				printf(_("bad queue depth -- %s\n"), optarg);
+				exitcode = 1;
+				return 0;
+			}
+			break;
+		case 'G':
+			si.generation = cvt_u32(optarg, 0);
+			if (errno) {
+				printf(_("bad generation -- %s\n"), optarg);
+				exitcode = 1;
+				return 0;
+			}
+			si.check_generation = true;
+			break;
+		case 'S':
+			si.seed = cvt_u32(optarg, 0);
+			if (errno) {
+				printf(_("bad seed -- %s\n"), optarg);
+				exitcode = 1;
+				return 0;
+			}
+			si.check_seed = true;
+			break;
+		case 't':
+			si.nr_threads = cvt_u32(optarg, 10);
+			if (errno || si.nr_threads == 0) {
+				printf(_("bad thread count -- %s\n"), optarg);
+				exitcode = 1;
+				return 0;
+			}
+			break;
 		case 'b':
 			tmp = cvtnum(fsblocksize, fssectsize, optarg);
 			if (tmp < 0) {
@@ -461,6 +504,31 @@ pread_f(
 		return 0;
 	}
 
+	if (si.depth) {
+		if (eof || vectors || vflag) {
+			exitcode = 1;
+			return command_usage(&pread_cmd);
+		}
+		si.fd = file->fd;
+		si.offset = offset;
+		si.nr_blocks = count / bsize;
+		si.bsize = bsize;
+		si.direction = direction;
+		si.zeed = zeed ? zeed : time(NULL);
+
+		gettimeofday(&t1, NULL);
+		if (stamp_io(&si) || si.mismatches)
+			exitcode = 1;
+		gettimeofday(&t2, NULL);
+		t2 = tsub(t2, t1);
+		if (!qflag)
+			stamp_io_report(&si, "read", &t2, Cflag);
+		else if (si.mismatches)
+			printf(_("%lld mismatches\n"), si.mismatches);
+		free(si.latencies);
+		return 0;
+	}
+
 	if (alloc_buffer(bsize, uflag, 0xabababab) < 0) {
 		exitcode = 1;
 		return 0;
@@ -507,7 +575,7 @@ pread_init(void)
 	pread_cmd.argmin = 2;
 	pread_cmd.argmax = -1;
 	pread_cmd.flags = CMD_NOMAP_OK | CMD_FOREIGN_OK;
-	pread_cmd.args = _("[-b bs] [-qv] [-i N] [-FBR [-Z N]] off len");
+	pread_cmd.args = _("[-b bs] [-qv] [-i N] [-FBR [-Z N]] [-A N [-G gen] [-S seed] [-t N]] off len");
 	pread_cmd.oneline = _("reads a number of bytes at a specified offset");
 	pread_cmd.help = pread_help;
 
@@ -40,6 +40,12 @@ pwrite_help(void)
 " -R   -- write at random offsets in the specified range of bytes\n"
 " -Z N -- zeed the random number generator (used when writing randomly)\n"
 "         (heh, zorry, the -s/-S arguments were already in use in pwrite)\n"
+" -A N -- write stamped blocks asynchronously, N writes in flight per thread\n"
+"         each block starts with a header recording its offset, the seed\n"
+"         and the generation, and the rest is derived from the header, so\n"
+"         that 'pread -A' can check it later.  -R writes each block once.\n"
+" -G N -- stamp blocks with generation N (default 1, used with -A)\n"
+" -t N -- write with N threads, each taking a slice of the range (with -A)\n"
 #ifdef HAVE_PWRITEV
 " -V N -- use vectored IO with N iovecs of blocksize each (pwritev)\n"
 #endif
@@ -285,13 +291,25 @@ pwrite_f(
 	int		direction = IO_FORWARD;
 	int		c, fd = -1;
 	int		pwritev2_flags = 0;
+	struct stamp_io	si = {
+		.nr_threads	= 1,
+		.generation	= 1,
+	};
 
 	Cflag = qflag = uflag = dflag = wflag = Wflag = 0;
 	init_cvtnum(&fsblocksize, &fssectsize);
 	bsize = fsblocksize;
 
-	while ((c = getopt(argc, argv, "b:BCdDf:Fi:NqRs:OS:uV:wWZ:")) != EOF) {
+	while ((c = getopt(argc, argv, "A:b:BCdDf:Fi:G:NqRs:OS:t:uV:wWZ:")) != EOF) {
 		switch (c) {
+		case 'A':
+			si.depth = cvt_u32(optarg, 10);
+			if (errno || si.depth == 0) {
+				printf(_("bad queue depth -- %s\n"), optarg);
+				exitcode = 1;
+				return 0;
+			}
+			break;
 		case 'b':
 			tmp = cvtnum(fsblocksize, fssectsize, optarg);
 			if (tmp < 0) {
@@ -301,6 +319,22 @@ pwrite_f(
 			}
 			bsize = tmp;
 			break;
+		case 'G':
+			si.generation = cvt_u32(optarg, 0);
+			if (errno) {
+				printf(_("bad generation -- %s\n"), optarg);
+				exitcode = 1;
+				return 0;
+			}
+			break;
+		case 't':
+			si.nr_threads = cvt_u32(optarg, 10);
+			if (errno || si.nr_threads == 0) {
+				printf(_("bad thread count -- %s\n"), optarg);
+				exitcode = 1;
+				return 0;
+			}
+			break;
 		case 'C':
 			Cflag = 1;
 			break;
@@ -396,6 +430,10 @@ pwrite_f(
 		exitcode = 1;
 		return command_usage(&pwrite_cmd);
 	}
+	if (si.depth && (infile || vectors || direction == IO_ONCE)) {
+		exitcode = 1;
+		return command_usage(&pwrite_cmd);
+	}
 	offset = cvtnum(fsblocksize, fssectsize, argv[optind]);
 	if (offset < 0) {
 		printf(_("non-numeric offset argument -- %s\n"), argv[optind]);
@@ -422,6 +460,18 @@ pwrite_f(
 	}
 
 	gettimeofday(&t1, NULL);
+	if (si.depth) {
+		si.fd = file->fd;
+		si.offset = offset;
+		si.nr_blocks = count / bsize;
+		si.bsize = bsize;
+		si.direction = direction;
+		si.zeed = zeed ? zeed : time(NULL);
+		si.seed = seed;
+		c = stamp_io(&si) ? -1 : 0;
+		total = si.total;
+		goto sync;
+	}
 	switch (direction) {
 	case IO_RANDOM:
 		if (!zeed)	/* srandom seed */
@@ -442,6 +492,7 @@ pwrite_f(
 		total = 0;
 		ASSERT(0);
 	}
+sync:
 	if (c < 0) {
 		exitcode = 1;
 		goto done;
@@ -466,11 +517,15 @@ pwrite_f(
 	gettimeofday(&t2, NULL);
 	t2 = tsub(t2, t1);
 
-	report_io_times("wrote", &t2, (long long)offset, count, total, c,
-			Cflag);
+	if (si.depth)
+		stamp_io_report(&si, "wrote", &t2, Cflag);
+	else
+		report_io_times("wrote", &t2, (long long)offset, count, total,
+				c, Cflag);
 done:
 	if (infile)
 		close(fd);
+	free(si.latencies);
 	return 0;
 }
 
@@ -484,7 +539,7 @@ pwrite_init(void)
 	pwrite_cmd.argmax = -1;
 	pwrite_cmd.flags = CMD_NOMAP_OK | CMD_FOREIGN_OK;
 	pwrite_cmd.args =
-_("[-i infile [-qdDwNOW] [-s skip]] [-b bs] [-S seed] [-FBR [-Z N]] [-V N] off len");
+_("[-i infile [-qdDwNOW] [-s skip]] [-b bs] [-S seed] [-FBR [-Z N]] [-V N] [-A N [-G gen] [-t N]] off len");
 	pwrite_cmd.oneline =
 		_("writes a number of bytes at a specified offset");
 	pwrite_cmd.help = pwrite_help;
@@ -8,8 +8,12 @@
 #include "input.h"
 #include "init.h"
 #include "io.h"
+#include "statx.h"
+#include "libfrog/workqueue.h"
+#include "libfrog/ptvar.h"
 
 #include <sys/types.h>
+#include <sys/syscall.h>
 #include <dirent.h>
 
 #ifndef _DIRENT_HAVE_D_RECLEN
@@ -120,6 +124,350 @@ read_directory(
 	return count;
 }
 
+/*
+ * Directory benchmark mode
+ *
+ * Read the whole directory with raw getdents64 calls of a given buffer size
+ * and time each call.  Optionally hand each buffer full of entries to a pool
+ * of threads that stat every entry, so that lookup and inode read costs can
+ * be measured along with the directory read itself.
+ */
+struct linux_dirent64 {
+	uint64_t		d_ino;
+	int64_t			d_off;
+	unsigned short		d_reclen;
+	unsigned char		d_type;
+	char			d_name[];
+};
+
+enum rdbench_stat {
+	RDBENCH_NOSTAT,
+	RDBENCH_FSTATAT,
+	RDBENCH_STATX,
+};
+
+/* Per-thread stat latency samples. */
+struct rdbench_lat {
+	uint64_t		*samples;
+	size_t			nr;
+	size_t			size;
+};
+
+struct rdbench {
+	int			dfd;
+	enum rdbench_stat	stat_mode;
+	struct ptvar		*lat_ptvar;
+	pthread_mutex_t		lock;
+	unsigned long long	stat_errors;
+	int			error;
+};
+
+/* A buffer full of directory entries to stat. */
+struct rdbench_batch {
+	char			*buf;
+	long			len;
+};
+
+static inline uint64_t
+rdbench_now(void)
+{
+	struct timespec		ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int
+rdbench_add_sample(
+	struct rdbench_lat	*lat,
+	uint64_t		nsec)
+{
+	uint64_t		*p;
+
+	if (lat->nr == lat->size) {
+		size_t		new_size = max(1024, lat->size * 2);
+
+		p = realloc(lat->samples, new_size * sizeof(uint64_t));
+		if (!p)
+			return errno;
+		lat->samples = p;
+		lat->size = new_size;
+	}
+	lat->samples[lat->nr++] = nsec;
+	return 0;
+}
+
+static void
+rdbench_stat_batch(
+	struct workqueue	*wq,
+	uint32_t		index,
+	void			*arg)
+{
+	struct rdbench		*rb = wq->wq_ctx;
+	struct rdbench_batch	*batch = arg;
+	struct rdbench_lat	*lat;
+	struct linux_dirent64	*de;
+	struct statx		stx;
+	struct stat		st;
+	unsigned long long	errors = 0;
+	uint64_t		start;
+	long			pos;
+	int			ret;
+
+	lat = ptvar_get(rb->lat_ptvar, &ret);
+	if (ret)
+		goto out_err;
+
+	for (pos = 0; pos < batch->len; pos += de->d_reclen) {
+		de = (struct linux_dirent64 *)(batch->buf + pos);
+		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+			continue;
+
+		start = rdbench_now();
+		if (rb->stat_mode == RDBENCH_STATX)
+			ret = syscall(__NR_statx, rb->dfd, de->d_name,
+					AT_SYMLINK_NOFOLLOW, STATX_BASIC_STATS,
+					&stx);
+		else
+			ret = fstatat(rb->dfd, de->d_name, &st,
+					AT_SYMLINK_NOFOLLOW);
+		if (ret) {
+			errors++;
+			continue;
+		}
+
+		ret = rdbench_add_sample(lat, rdbench_now() - start);
+		if (ret)
+			goto out_err;
+	}
+
+	if (errors) {
+		pthread_mutex_lock(&rb->lock);
+		rb->stat_errors += errors;
+		pthread_mutex_unlock(&rb->lock);
+	}
+	goto out;
+out_err:
+	pthread_mutex_lock(&rb->lock);
+	if (!rb->error)
+		rb->error = ret;
+	pthread_mutex_unlock(&rb->lock);
+out:
+	free(batch->buf);
+	free(batch);
+}
+
+/* Gather every thread's stat samples into one array. */
+static int
+rdbench_merge_lat(
+	struct ptvar		*ptv,
+	void			*data,
+	void			*arg)
+{
+	struct rdbench_lat	*lat = data;
+	struct rdbench_lat	*all = arg;
+	size_t			i;
+	int			ret;
+
+	for (i = 0; i < lat->nr; i++) {
+		ret = rdbench_add_sample(all, lat->samples[i]);
+		if (ret)
+			return ret;
+	}
+	free(lat->samples);
+	lat->samples = NULL;
+	return 0;
+}
+
+static int
+rdbench_free_lat(
+	struct ptvar		*ptv,
+	void			*data,
+	void			*arg)
+{
+	struct rdbench_lat	*lat = data;
+
+	free(lat->samples);
+	return 0;
+}
+
+static int
+readdir_bench(
+	size_t			bufsize,
+	enum rdbench_stat	stat_mode,
+	unsigned int		nr_threads)
+{
+	struct rdbench		rb = {
+		.stat_mode	= stat_mode,
+	};
+	struct rdbench_lat	getdents_lat = { NULL };
+	struct rdbench_lat	stat_lat = { NULL };
+	struct rdbench_batch	*batch;
+	struct workqueue	wq;
+	struct stat		st;
+	struct timeval		t1, t2;
+	struct linux_dirent64	*de;
+	unsigned long long	entries = 0;
+	unsigned long long	total = 0;
+	unsigned long long	calls = 0;
+	char			s1[64], s2[64], ts[64];
+	char			*buf = NULL;
+	uint64_t		start;
+	long			nread;
+	long			pos;
+	int			ret, ret2;
+
+	/* Our own open file description, so we don't move the file offset. */
+	rb.dfd = openat(file->fd, ".", O_RDONLY | O_DIRECTORY);
+	if (rb.dfd < 0) {
+		perror("openat");
+		return 1;
+	}
+
+	if (fstat(rb.dfd, &st) == 0) {
+		cvtstr(st.st_size, s1, sizeof(s1));
+		printf(_("directory size %s\n"), s1);
+	}
+
+	ret = -pthread_mutex_init(&rb.lock, NULL);
+	if (ret)
+		goto out_close;
+	if (stat_mode != RDBENCH_NOSTAT) {
+		ret = -ptvar_alloc(nr_threads, sizeof(struct rdbench_lat),
+				&rb.lat_ptvar);
+		if (ret)
+			goto out_mutex;
+		ret = -workqueue_create(&wq, &rb, nr_threads);
+		if (ret)
+			goto out_ptvar;
+	}
+
+	gettimeofday(&t1, NULL);
+	for (;;) {
+		if (!buf) {
+			buf = malloc(bufsize);
+			if (!buf) {
+				ret = errno;
+				break;
+			}
+		}
+
+		start = rdbench_now();
+		nread = syscall(SYS_getdents64, rb.dfd, buf, bufsize);
+		if (nread < 0) {
+			ret = errno;
+			break;
+		}
+		ret = rdbench_add_sample(&getdents_lat, rdbench_now() - start);
+		if (ret || nread == 0)
+			break;
+
+		calls++;
+		total += nread;
+		for (pos = 0; pos < nread; pos += de->d_reclen) {
+			de = (struct linux_dirent64 *)(buf + pos);
+			entries++;
+		}
+
+		if (stat_mode == RDBENCH_NOSTAT)
+			continue;
+
+		/* The stat threads own the buffer from here on. */
+		batch = malloc(sizeof(struct rdbench_batch));
+		if (!batch) {
+			ret = errno;
+			break;
+		}
+		batch->buf = buf;
+		batch->len = nread;
+		buf = NULL;
+		ret = -workqueue_add(&wq, rdbench_stat_batch, 0, batch);
+		if (ret) {
+			free(batch->buf);
+			free(batch);
+			break;
+		}
+	}
+
+	if (stat_mode != RDBENCH_NOSTAT) {
+		ret2 = -workqueue_terminate(&wq);
+		if (!ret)
+			ret = ret2;
+		workqueue_destroy(&wq);
+		if (!ret)
+			ret = rb.error;
+	}
+	gettimeofday(&t2, NULL);
+	free(buf);
+
+	if (ret) {
+		errno = ret;
+		perror("readdir");
+		goto out_lat;
+	}
+
+	t2 = tsub(t2, t1);
+	timestr(&t2, ts, sizeof(ts), 0);
+	cvtstr(total, s1, sizeof(s1));
+	cvtstr(tdiv(total, t2), s2, sizeof(s2));
+
+	printf(_("read %llu entries, %s in %llu getdents calls of %zu bytes\n"),
+		entries, s1, calls, bufsize);
+	printf(_("%s (%.1f entries/sec, %s/sec)\n"),
+		ts, tdiv(entries, t2), s2);
+	report_latency("getdents", getdents_lat.samples, getdents_lat.nr, 0);
+
+	if (stat_mode != RDBENCH_NOSTAT) {
+		ret = ptvar_foreach(rb.lat_ptvar, rdbench_merge_lat, &stat_lat);
+		if (ret) {
+			errno = ret;
+			perror("readdir");
+			goto out_lat;
+		}
+		if (rb.stat_errors)
+			printf(_("%llu entries could not be stat'd\n"),
+					rb.stat_errors);
+		report_latency(stat_mode == RDBENCH_STATX ? "statx" : "fstatat",
+				stat_lat.samples, stat_lat.nr, 0);
+	}
+
+out_lat:
+	free(getdents_lat.samples);
+	free(stat_lat.samples);
+out_ptvar:
+	if (rb.lat_ptvar) {
+		ptvar_foreach(rb.lat_ptvar, rdbench_free_lat, NULL);
+		ptvar_free(rb.lat_ptvar);
+	}
+out_mutex:
+	pthread_mutex_destroy(&rb.lock);
+out_close:
+	close(rb.dfd);
+	return ret ? 1 : 0;
+}
+
+static void
+readdir_help(void)
+{
+	printf(_(
+"\n"
+" read a range of directory entries from a given offset of a directory\n"
+"\n"
+" -l -- read at most this many bytes of entries\n"
+" -o -- start reading at this directory offset\n"
+" -v -- dump each directory entry\n"
+"\n"
+" -b -- benchmark reading the whole directory with getdents64\n"
+" -B -- size of the getdents64 buffer in benchmark mode (default 32k)\n"
+" -s -- also fstatat every entry in benchmark mode\n"
+" -x -- also statx every entry in benchmark mode\n"
+" -t -- stat entries with this many threads (default 1)\n"
+"\n"
+" Benchmark mode reports entries/sec and the latency distribution of the\n"
+" getdents64 calls and of the stat calls.\n"
+"\n"));
+}
+
 static int
 readdir_f(
 	int argc,
@@ -136,11 +484,42 @@ readdir_f(
 	int verbose = 0;
 	DIR *dir;
 	int dfd;
+	bool bench = false;
+	long long bufsize = 32768;
+	enum rdbench_stat stat_mode = RDBENCH_NOSTAT;
+	unsigned int nr_threads = 1;
 
 	init_cvtnum(&fsblocksize, &fssectsize);
 
-	while ((c = getopt(argc, argv, "l:o:v")) != EOF) {
+	while ((c = getopt(argc, argv, "bB:l:o:st:vx")) != EOF) {
 		switch (c) {
+		case 'b':
+			bench = true;
+			break;
+		case 'B':
+			bufsize = cvtnum(fsblocksize, fssectsize, optarg);
+			if (bufsize <= 0 || bufsize > INT_MAX) {
+				printf(_("invalid buffer size -- %s\n"),
+						optarg);
+				exitcode = 1;
+				return 0;
+			}
+			break;
+		case 's':
+			stat_mode = RDBENCH_FSTATAT;
+			break;
+		case 't':
+			nr_threads = cvt_u32(optarg, 10);
+			if (errno || nr_threads == 0) {
+				printf(_("invalid thread count -- %s\n"),
+						optarg);
+				exitcode = 1;
+				return 0;
+			}
+			break;
+		case 'x':
+			stat_mode = RDBENCH_STATX;
+			break;
 		case 'l':
 			length = cvtnum(fsblocksize, fssectsize, optarg);
 			break;
@@ -156,6 +535,11 @@ readdir_f(
 		}
 	}
 
+	if (bench) {
+		exitcode = readdir_bench(bufsize, stat_mode, nr_threads);
+		return 0;
+	}
+
 	dfd = dup(file->fd);
 	if (dfd < 0) {
 		exitcode = 1;
@@ -199,10 +583,12 @@ readdir_init(void)
 {
 	readdir_cmd.name = "readdir";
 	readdir_cmd.cfunc = readdir_f;
-	readdir_cmd.argmax = 5;
+	readdir_cmd.argmax = -1;
 	readdir_cmd.flags = CMD_NOMAP_OK|CMD_FOREIGN_OK;
-	readdir_cmd.args = _("[-v][-o offset][-l length]");
+	readdir_cmd.args =
+_("[-v][-o offset][-l length] | -b [-sx] [-B bufsize] [-t nr]");
 	readdir_cmd.oneline = _("read directory entries");
+	readdir_cmd.help = readdir_help;
 
 	add_command(&readdir_cmd);
 }
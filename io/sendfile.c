@@ -28,7 +28,13 @@ sendfile_help(void)
 " -q -- quiet mode, do not write anything to standard output.\n"
 " -f -- specifies an input file from which to source data to write\n"
 " -i -- specifies an input file name from which to source data to write.\n"
+" -c -- split the transfer into chunks of this size (default 16MiB)\n"
+" -S -- preserve holes in the source file by punching them in the destination\n"
+" -t -- transfer chunks with this many threads\n"
 " An offset and length in the source file can be optionally specified.\n"
+" Passing any of -c, -S or -t selects a chunked transfer, which also reports\n"
+" per-chunk latency.  Chunks land at the same relative offsets from the\n"
+" current file position as they had from the source offset.\n"
 "\n"));
 }
 
@@ -61,6 +67,37 @@ send_buffer(
 	return ops;
 }
 
+static int
+send_chunked(
+	struct chunk_copy	*cc,
+	int			fd,
+	off64_t			offset,
+	long long		count)
+{
+	int			ret;
+
+	cc->src_fd = fd;
+	cc->dst_fd = file->fd;
+	cc->src_off = offset;
+	cc->len = count;
+	cc->dst_off = lseek(file->fd, 0, SEEK_CUR);
+	if (cc->dst_off < 0) {
+		perror("lseek");
+		return -1;
+	}
+
+	ret = chunk_copy(cc);
+	if (ret) {
+		errno = ret;
+		perror("sendfile");
+		return -1;
+	}
+
+	/* Leave the file position where a serial sendfile would have. */
+	lseek(file->fd, cc->dst_off + cc->total + cc->holes, SEEK_SET);
+	return cc->ops;
+}
+
 static int
 sendfile_f(
 	int		argc,
@@ -73,11 +110,39 @@ sendfile_f(
 	char		*infile = NULL;
 	int		Cflag, qflag;
 	int		c, fd = -1;
+	struct chunk_copy cc = {
+		.method = CHUNK_COPY_SENDFILE,
+		.chunksize = 16 << 20,
+		.nr_threads = 1,
+	};
+	bool		chunked = false;
 
 	Cflag = qflag = 0;
 	init_cvtnum(&blocksize, &sectsize);
-	while ((c = getopt(argc, argv, "Cf:i:q")) != EOF) {
+	while ((c = getopt(argc, argv, "Cc:f:i:qSt:")) != EOF) {
 		switch (c) {
+		case 'c':
+			cc.chunksize = cvtnum(blocksize, sectsize, optarg);
+			if (cc.chunksize <= 0) {
+				printf(_("invalid chunk size -- %s\n"), optarg);
+				exitcode = 1;
+				return 0;
+			}
+			chunked = true;
+			break;
+		case 'S':
+			cc.sparse = true;
+			chunked = true;
+			break;
+		case 't':
+			cc.nr_threads = cvt_u32(optarg, 10);
+			if (errno || cc.nr_threads == 0) {
+				printf(_("invalid thread count -- %s\n"), optarg);
+				exitcode = 1;
+				return 0;
+			}
+			chunked = true;
+			break;
 		case 'C':
 			Cflag = 1;
 			break;
@@ -141,7 +206,10 @@ sendfile_f(
 	}
 
 	gettimeofday(&t1, NULL);
-	c = send_buffer(offset, count, fd, &total);
+	if (chunked)
+		c = send_chunked(&cc, fd, offset, count);
+	else
+		c = send_buffer(offset, count, fd, &total);
 	if (c < 0) {
 		exitcode = 1;
 		goto done;
@@ -152,8 +220,13 @@ sendfile_f(
 	gettimeofday(&t2, NULL);
 	t2 = tsub(t2, t1);
 
-	report_io_times("sent", &t2, (long long)offset, count, total, c, Cflag);
+	if (chunked)
+		chunk_copy_report(&cc, "sent", &t2, Cflag);
+	else
+		report_io_times("sent", &t2, (long long)offset, count, total,
+				c, Cflag);
 done:
+	free(cc.latencies);
 	if (infile)
 		close(fd);
 	return 0;
@@ -169,7 +242,7 @@ sendfile_init(void)
 	sendfile_cmd.argmax = -1;
 	sendfile_cmd.flags = CMD_NOMAP_OK | CMD_FOREIGN_OK;
 	sendfile_cmd.args =
-		_("[-q] -i infile | -f N [off len]");
+		_("[-qS] [-c chunk] [-t nr] -i infile | -f N [off len]");
 	sendfile_cmd.oneline =
 		_("Transfer data directly between file descriptors");
 	sendfile_cmd.help = sendfile_help;
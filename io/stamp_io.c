@@ -0,0 +1,531 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Asynchronous self-describing block writer and verifier for pwrite/pread.
+ */
+#include <sys/syscall.h>
+#include <linux/aio_abi.h>
+#include <endian.h>
+#include "platform_defs.h"
+#include "command.h"
+#include "input.h"
+#include "init.h"
+#include "libfrog/workqueue.h"
+#include "io.h"
+
+/* "XIOSTAMP" */
+#define STAMP_MAGIC		0x58494f5354414d50ULL
+
+/* Print at most this many mismatches; count the rest. */
+#define STAMP_MAX_REPORT	100
+
+/*
+ * Header at the start of every stamped block.  The rest of the block is
+ * filled with a pseudorandom stream derived from the header fields, so a
+ * block can be checked without knowing how it was written.
+ */
+struct stamp_header {
+	__le64			magic;
+	__le64			offset;		/* file offset of this block */
+	__le32			seed;
+	__le32			generation;
+	__le32			blocksize;
+	__le32			pad;
+};
+
+/* One I/O in flight. */
+struct stamp_slot {
+	struct iocb		iocb;
+	char			*buf;
+	long long		block;
+	uint64_t		start;
+};
+
+struct stamp_state {
+	struct stamp_io		*si;
+	pthread_mutex_t		lock;
+	long long		*done;		/* completed I/Os per thread */
+	long long		reported;
+};
+
+static inline uint64_t
+stamp_now(void)
+{
+	struct timespec		ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline int
+stamp_io_setup(
+	unsigned int		nr,
+	aio_context_t		*ctx)
+{
+	return syscall(__NR_io_setup, nr, ctx);
+}
+
+static inline int
+stamp_io_destroy(
+	aio_context_t		ctx)
+{
+	return syscall(__NR_io_destroy, ctx);
+}
+
+static inline int
+stamp_io_submit(
+	aio_context_t		ctx,
+	long			nr,
+	struct iocb		**iocbs)
+{
+	return syscall(__NR_io_submit, ctx, nr, iocbs);
+}
+
+static inline int
+stamp_io_getevents(
+	aio_context_t		ctx,
+	long			min_nr,
+	long			nr,
+	struct io_event		*events)
+{
+	return syscall(__NR_io_getevents, ctx, min_nr, nr, events, NULL);
+}
+
+/* xorshift64* */
+static inline uint64_t
+stamp_next(
+	uint64_t		*state)
+{
+	uint64_t		x = *state;
+
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	*state = x;
+	return x * 0x2545F4914F6CDD1DULL;
+}
+
+static inline uint64_t
+stamp_state(
+	uint32_t		seed,
+	uint32_t		generation,
+	uint64_t		offset)
+{
+	uint64_t		x;
+
+	x = ((uint64_t)seed << 32 | generation) ^
+	    (offset * 0x9E3779B97F4A7C15ULL);
+	return x ? x : STAMP_MAGIC;
+}
+
+static void
+stamp_fill(
+	struct stamp_io		*si,
+	char			*buf,
+	uint64_t		offset)
+{
+	struct stamp_header	*h = (struct stamp_header *)buf;
+	uint64_t		*p = (uint64_t *)(h + 1);
+	uint64_t		*end = (uint64_t *)(buf + si->bsize);
+	uint64_t		state;
+
+	h->magic = htole64(STAMP_MAGIC);
+	h->offset = htole64(offset);
+	h->seed = htole32(si->seed);
+	h->generation = htole32(si->generation);
+	h->blocksize = htole32(si->bsize);
+	h->pad = 0;
+
+	state = stamp_state(si->seed, si->generation, offset);
+	while (p < end)
+		*p++ = stamp_next(&state);
+}
+
+/*
+ * Check a stamped block.  Returns true if it is intact, or describes what is
+ * wrong with it in @why.
+ */
+static bool
+stamp_check(
+	struct stamp_io		*si,
+	char			*buf,
+	uint64_t		offset,
+	char			*why,
+	size_t			len)
+{
+	struct stamp_header	*h = (struct stamp_header *)buf;
+	uint64_t		*p = (uint64_t *)(h + 1);
+	uint64_t		*end = (uint64_t *)(buf + si->bsize);
+	uint64_t		state;
+	uint32_t		seed = le32toh(h->seed);
+	uint32_t		gen = le32toh(h->generation);
+	size_t			i;
+
+	if (le64toh(h->magic) != STAMP_MAGIC) {
+		for (i = 0; i < si->bsize && !buf[i]; i++)
+			;
+		snprintf(why, len, i == si->bsize ? _("no stamp, zeroes") :
+				_("no stamp"));
+		return false;
+	}
+	if (le64toh(h->offset) != offset) {
+		snprintf(why, len, _("stamped for offset %llu"),
+				(unsigned long long)le64toh(h->offset));
+		return false;
+	}
+	if (le32toh(h->blocksize) != si->bsize) {
+		snprintf(why, len, _("stamped with block size %u"),
+				le32toh(h->blocksize));
+		return false;
+	}
+	if (si->check_seed && seed != si->seed) {
+		snprintf(why, len, _("seed 0x%x, expected 0x%x"), seed,
+				si->seed);
+		return false;
+	}
+	if (si->check_generation && gen != si->generation) {
+		snprintf(why, len, _("generation %u, expected %u"), gen,
+				si->generation);
+		return false;
+	}
+
+	state = stamp_state(seed, gen, offset);
+	for (; p < end; p++) {
+		if (*p != stamp_next(&state)) {
+			snprintf(why, len, _("data mismatch at byte %zu"),
+					(size_t)((char *)p - buf));
+			return false;
+		}
+	}
+	return true;
+}
+
+static void
+stamp_set_error(
+	struct stamp_state	*ss,
+	int			error)
+{
+	pthread_mutex_lock(&ss->lock);
+	if (!ss->si->error)
+		ss->si->error = error;
+	pthread_mutex_unlock(&ss->lock);
+}
+
+static void
+stamp_mismatch(
+	struct stamp_state	*ss,
+	uint64_t		offset,
+	const char		*why)
+{
+	pthread_mutex_lock(&ss->lock);
+	ss->si->mismatches++;
+	if (ss->reported++ < STAMP_MAX_REPORT)
+		printf(_("offset %llu: %s\n"), (unsigned long long)offset,
+				why);
+	else if (ss->reported == STAMP_MAX_REPORT + 1)
+		printf(_("further mismatches are not printed\n"));
+	pthread_mutex_unlock(&ss->lock);
+}
+
+/* Work out the order in which a thread visits the blocks of its slice. */
+static long long *
+stamp_order(
+	struct stamp_io		*si,
+	uint32_t		index,
+	long long		nr)
+{
+	long long		*order, tmp;
+	uint64_t		state;
+	long long		i, j;
+
+	if (si->direction != IO_RANDOM)
+		return NULL;
+
+	order = malloc(nr * sizeof(long long));
+	if (!order)
+		return NULL;
+	for (i = 0; i < nr; i++)
+		order[i] = i;
+
+	state = stamp_state(si->zeed, index, nr);
+	for (i = nr - 1; i > 0; i--) {
+		j = stamp_next(&state) % (i + 1);
+		tmp = order[i];
+		order[i] = order[j];
+		order[j] = tmp;
+	}
+	return order;
+}
+
+/* Handle a completed I/O; returns false if the thread should stop. */
+static bool
+stamp_complete(
+	struct stamp_state	*ss,
+	struct stamp_slot	*slot,
+	struct io_event		*ev,
+	uint64_t		*lat,
+	long long		*bytes)
+{
+	struct stamp_io		*si = ss->si;
+	uint64_t		offset = si->offset + slot->block * si->bsize;
+	char			why[64];
+
+	*lat = stamp_now() - slot->start;
+	if ((long long)ev->res < 0) {
+		fprintf(stderr, _("%s at offset %llu: %s\n"),
+				si->verify ? "pread" : "pwrite",
+				(unsigned long long)offset,
+				strerror(-(long long)ev->res));
+		stamp_set_error(ss, -(long long)ev->res);
+		return false;
+	}
+	*bytes += ev->res;
+	if (ev->res != si->bsize) {
+		if (si->verify) {
+			stamp_mismatch(ss, offset, _("short read"));
+			return true;
+		}
+		fprintf(stderr, _("short write at offset %llu\n"),
+				(unsigned long long)offset);
+		stamp_set_error(ss, EIO);
+		return false;
+	}
+	if (si->verify && !stamp_check(si, slot->buf, offset, why, sizeof(why)))
+		stamp_mismatch(ss, offset, why);
+	return true;
+}
+
+/* Write or verify one contiguous slice of the range with its own context. */
+static void
+stamp_worker(
+	struct workqueue	*wq,
+	uint32_t		index,
+	void			*arg)
+{
+	struct stamp_state	*ss = wq->wq_ctx;
+	struct stamp_io		*si = ss->si;
+	long long		first = si->nr_blocks * index / si->nr_threads;
+	long long		last = si->nr_blocks * (index + 1) /
+					si->nr_threads;
+	long long		nr = last - first;
+	long long		next = 0, k;
+	long long		bytes = 0;
+	long long		*order;
+	uint64_t		*lat = si->latencies + first;
+	struct stamp_slot	*slots, **free_slots, *slot;
+	struct iocb		**iocbs;
+	struct io_event		*events;
+	aio_context_t		ctx = 0;
+	char			*bufs = NULL;
+	unsigned int		depth = si->depth;
+	unsigned int		nr_free, inflight = 0, nsub, done;
+	bool			stop = false;
+	int			i, ret;
+
+	if (nr == 0)
+		return;
+
+	order = stamp_order(si, index, nr);
+	slots = calloc(depth, sizeof(struct stamp_slot));
+	free_slots = calloc(depth, sizeof(struct stamp_slot *));
+	iocbs = calloc(depth, sizeof(struct iocb *));
+	events = calloc(depth, sizeof(struct io_event));
+	ret = posix_memalign((void **)&bufs, pagesize, depth * si->bsize);
+	if (ret || !slots || !free_slots || !iocbs || !events ||
+	    (si->direction == IO_RANDOM && !order)) {
+		ret = ret ? ret : ENOMEM;
+		fprintf(stderr, _("stamp_io: %s\n"), strerror(ret));
+		stamp_set_error(ss, ret);
+		goto out;
+	}
+
+	if (stamp_io_setup(depth, &ctx) < 0) {
+		perror("io_setup");
+		stamp_set_error(ss, errno);
+		goto out;
+	}
+
+	for (i = 0; i < depth; i++) {
+		slots[i].buf = bufs + (size_t)i * si->bsize;
+		free_slots[i] = &slots[i];
+	}
+	nr_free = depth;
+
+	while (inflight || (next < nr && !stop)) {
+		/* Fill the queue up. */
+		nsub = 0;
+		while (!stop && next < nr && nr_free) {
+			slot = free_slots[--nr_free];
+			if (order)
+				k = order[next++];
+			else if (si->direction == IO_BACKWARD)
+				k = nr - 1 - next++;
+			else
+				k = next++;
+			slot->block = first + k;
+
+			memset(&slot->iocb, 0, sizeof(slot->iocb));
+			slot->iocb.aio_data = (uintptr_t)slot;
+			slot->iocb.aio_lio_opcode = si->verify ?
+					IOCB_CMD_PREAD : IOCB_CMD_PWRITE;
+			slot->iocb.aio_fildes = si->fd;
+			slot->iocb.aio_buf = (uintptr_t)slot->buf;
+			slot->iocb.aio_nbytes = si->bsize;
+			slot->iocb.aio_offset = si->offset +
+					slot->block * si->bsize;
+			if (!si->verify)
+				stamp_fill(si, slot->buf,
+						slot->iocb.aio_offset);
+			slot->start = stamp_now();
+			iocbs[nsub++] = &slot->iocb;
+		}
+
+		/* The kernel may take fewer than we offered. */
+		done = 0;
+		while (done < nsub) {
+			ret = stamp_io_submit(ctx, nsub - done, iocbs + done);
+			if (ret < 0) {
+				perror("io_submit");
+				stamp_set_error(ss, errno);
+				break;
+			}
+			done += ret;
+		}
+		inflight += done;
+		if (done < nsub) {
+			/* Put back whatever didn't make it. */
+			while (done < nsub) {
+				free_slots[nr_free++] = (struct stamp_slot *)
+					(uintptr_t)iocbs[done]->aio_data;
+				done++;
+			}
+			stop = true;
+		}
+		if (!inflight)
+			break;
+
+		ret = stamp_io_getevents(ctx, 1, depth, events);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("io_getevents");
+			stamp_set_error(ss, errno);
+			break;
+		}
+		for (i = 0; i < ret; i++) {
+			slot = (struct stamp_slot *)(uintptr_t)events[i].data;
+			if (!stamp_complete(ss, slot, &events[i],
+					&lat[ss->done[index]], &bytes))
+				stop = true;
+			ss->done[index]++;
+			free_slots[nr_free++] = slot;
+			inflight--;
+		}
+	}
+
+	stamp_io_destroy(ctx);
+out:
+	pthread_mutex_lock(&ss->lock);
+	si->total += bytes;
+	si->ops += ss->done[index];
+	pthread_mutex_unlock(&ss->lock);
+
+	free(bufs);
+	free(events);
+	free(iocbs);
+	free(free_slots);
+	free(slots);
+	free(order);
+}
+
+/*
+ * Write stamped blocks over a range of a file, or read them back and check
+ * them, with @nr_threads threads each keeping @depth I/Os in flight.
+ */
+int
+stamp_io(
+	struct stamp_io		*si)
+{
+	struct stamp_state	ss = { .si = si };
+	struct workqueue	wq;
+	long long		nr;
+	unsigned int		i;
+	int			ret, ret2;
+
+	si->total = si->ops = si->mismatches = 0;
+	si->error = 0;
+	si->nr_latencies = 0;
+
+	if (si->bsize < sizeof(struct stamp_header) ||
+	    si->bsize % sizeof(uint64_t)) {
+		fprintf(stderr,
+_("block size must be a multiple of 8 bytes and at least %zu bytes\n"),
+			sizeof(struct stamp_header));
+		return EINVAL;
+	}
+	if (si->nr_blocks <= 0) {
+		fprintf(stderr, _("range is shorter than one block\n"));
+		return EINVAL;
+	}
+	si->nr_threads = min(si->nr_threads, si->nr_blocks);
+
+	si->latencies = calloc(si->nr_blocks, sizeof(uint64_t));
+	ss.done = calloc(si->nr_threads, sizeof(long long));
+	if (!si->latencies || !ss.done) {
+		perror("calloc");
+		free(ss.done);
+		return ENOMEM;
+	}
+	pthread_mutex_init(&ss.lock, NULL);
+
+	ret = -workqueue_create(&wq, &ss, si->nr_threads);
+	if (ret) {
+		fprintf(stderr, _("creating stamp_io workqueue: %s\n"),
+				strerror(ret));
+		goto out;
+	}
+	for (i = 0; i < si->nr_threads; i++) {
+		ret = -workqueue_add(&wq, stamp_worker, i, NULL);
+		if (ret) {
+			fprintf(stderr, _("queueing stamp_io work: %s\n"),
+					strerror(ret));
+			break;
+		}
+	}
+	ret2 = -workqueue_terminate(&wq);
+	if (!ret)
+		ret = ret2;
+	workqueue_destroy(&wq);
+
+	/* Pack the per-thread latency samples together. */
+	for (i = 0; i < si->nr_threads; i++) {
+		nr = ss.done[i];
+		memmove(si->latencies + si->nr_latencies,
+			si->latencies + si->nr_blocks * i / si->nr_threads,
+			nr * sizeof(uint64_t));
+		si->nr_latencies += nr;
+	}
+out:
+	pthread_mutex_destroy(&ss.lock);
+	free(ss.done);
+	if (!ret)
+		ret = si->error;
+	return ret;
+}
+
+void
+stamp_io_report(
+	struct stamp_io		*si,
+	const char		*verb,
+	struct timeval		*t,
+	int			compact)
+{
+	report_io_times(verb, t, si->offset, si->nr_blocks * si->bsize,
+			si->total, (int)si->ops, compact);
+	if (!compact && si->verify)
+		printf(_("%lld blocks checked, %lld mismatches, %u threads, queue depth %u\n"),
+			si->ops, si->mismatches, si->nr_threads, si->depth);
+	else if (!compact)
+		printf(_("%u threads, queue depth %u, seed 0x%x, generation %u\n"),
+			si->nr_threads, si->depth, si->seed, si->generation);
+	report_latency(_("I/O"), si->latencies, si->nr_latencies, compact);
+}
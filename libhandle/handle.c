@@ -30,7 +30,7 @@ typedef union {
 
 static int obj_to_handle(char *, int, unsigned int, comarg_t, void**, size_t*);
 static int handle_to_fsfd(void *, char **);
-static char *path_to_fspath(char *path);
+static char *path_to_fspath(char *path, char *dirpath);
 
 
 /*
@@ -39,6 +39,10 @@ static char *path_to_fspath(char *path);
  * Maps filesystem handles to a corresponding open file descriptor for that
  * filesystem. We need this because we're doing handle operations via xfsctl
  * and we need to remember the open file descriptor for each filesystem.
+ *
+ * The cache is hashed on the filesystem ID and may be used from many threads
+ * at once.  Entries are only freed by fshandle_destroy, so the path returned
+ * by a lookup stays valid after the lock is dropped.
  */
 
 struct fdhash {
@@ -48,20 +52,51 @@ struct fdhash {
 	char	fspath[MAXPATHLEN];
 };
 
-static struct fdhash *fdhash_head = NULL;
+#define	FDHASH_BITS	6
+#define	FDHASH_SIZE	(1U << FDHASH_BITS)
+
+static struct fdhash *fdhash_table[FDHASH_SIZE];
+static pthread_rwlock_t fdhash_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static inline unsigned int
+fdhash_bucket(const void *fsh)
+{
+	uint64_t	fsid;
+
+	memcpy(&fsid, fsh, FSIDSIZE);
+	return (fsid * 0x9E3779B97F4A7C15ULL) >> (64 - FDHASH_BITS);
+}
+
+static struct fdhash *
+fdhash_find(const void *fsh)
+{
+	struct fdhash	*fdhp;
+
+	for (fdhp = fdhash_table[fdhash_bucket(fsh)]; fdhp; fdhp = fdhp->fnxt) {
+		if (memcmp(fdhp->fsh, fsh, FSIDSIZE) == 0)
+			return fdhp;
+	}
+	return NULL;
+}
 
 void
 fshandle_destroy(void)
 {
 	struct fdhash	*nexth;
-	struct fdhash	*h = fdhash_head;
-
-	while (h) {
-		nexth = h->fnxt;
-		free(h);
-		h = nexth;
+	struct fdhash	*h;
+	unsigned int	i;
+
+	pthread_rwlock_wrlock(&fdhash_lock);
+	for (i = 0; i < FDHASH_SIZE; i++) {
+		h = fdhash_table[i];
+		while (h) {
+			nexth = h->fnxt;
+			free(h);
+			h = nexth;
+		}
+		fdhash_table[i] = NULL;
 	}
-	fdhash_head = NULL;
+	pthread_rwlock_unlock(&fdhash_lock);
 }
 
 int
@@ -74,10 +109,11 @@ path_to_fshandle(
 	int		fd;
 	comarg_t	obj;
 	struct fdhash	*fdhp;
-	char		*tmppath;
 	char		*fspath;
+	char		dirpath[MAXPATHLEN];
+	unsigned int	bucket;
 
-	fspath = path_to_fspath(path);
+	fspath = path_to_fspath(path, dirpath);
 	if (fspath == NULL)
 		return -1;
 
@@ -93,28 +129,34 @@ path_to_fshandle(
 		return result;
 	}
 
-	if (handle_to_fsfd(*fshanp, &tmppath) >= 0) {
+	pthread_rwlock_wrlock(&fdhash_lock);
+	if (fdhash_find(*fshanp)) {
 		/* this filesystem is already in the cache */
+		pthread_rwlock_unlock(&fdhash_lock);
 		close(fd);
-	} else {
-		/* new filesystem. add it to the cache */
-		fdhp = malloc(sizeof(struct fdhash));
-		if (fdhp == NULL) {
-			free(*fshanp);
-			close(fd);
-			errno = ENOMEM;
-			return -1;
-		}
-
-		fdhp->fsfd = fd;
-		strncpy(fdhp->fspath, fspath, sizeof(fdhp->fspath) - 1);
-		fdhp->fspath[sizeof(fdhp->fspath) - 1] = 0;
-		memcpy(fdhp->fsh, *fshanp, FSIDSIZE);
+		return result;
+	}
 
-		fdhp->fnxt = fdhash_head;
-		fdhash_head = fdhp;
+	/* new filesystem. add it to the cache */
+	fdhp = malloc(sizeof(struct fdhash));
+	if (fdhp == NULL) {
+		pthread_rwlock_unlock(&fdhash_lock);
+		free(*fshanp);
+		close(fd);
+		errno = ENOMEM;
+		return -1;
 	}
 
+	fdhp->fsfd = fd;
+	strncpy(fdhp->fspath, fspath, sizeof(fdhp->fspath) - 1);
+	fdhp->fspath[sizeof(fdhp->fspath) - 1] = 0;
+	memcpy(fdhp->fsh, *fshanp, FSIDSIZE);
+
+	bucket = fdhash_bucket(fdhp->fsh);
+	fdhp->fnxt = fdhash_table[bucket];
+	fdhash_table[bucket] = fdhp;
+	pthread_rwlock_unlock(&fdhash_lock);
+
 	return result;
 }
 
@@ -128,8 +170,9 @@ path_to_handle(
 	int		result;
 	comarg_t	obj;
 	char		*fspath;
+	char		dirpath[MAXPATHLEN];
 
-	fspath = path_to_fspath(path);
+	fspath = path_to_fspath(path, dirpath);
 	if (fspath == NULL)
 		return -1;
 
@@ -151,11 +194,12 @@ path_to_handle(
  * potentially blocking in an open on a named pipe. Also
  * symlinks to files on other filesystems would be a problem,
  * since an fd would be obtained for the wrong fs.
+ * The parent directory is built in the caller's dirpath
+ * buffer, which must hold MAXPATHLEN bytes.
  */
 static char *
-path_to_fspath(char *path)
+path_to_fspath(char *path, char *dirpath)
 {
-	static char dirpath[MAXPATHLEN];
 	struct stat statbuf;
 
 	if (lstat(path, &statbuf) != 0)
@@ -207,6 +251,7 @@ static int
 handle_to_fsfd(void *hanp, char **path)
 {
 	struct fdhash	*fdhp;
+	int		fsfd = -1;
 
 	/*
 	 * Look in cache for matching fsid field in the handle
@@ -214,14 +259,17 @@ handle_to_fsfd(void *hanp, char **path)
 	 * When found return the file descriptor and path that
 	 * we have in the cache.
 	 */
-	for (fdhp = fdhash_head; fdhp != NULL; fdhp = fdhp->fnxt) {
-		if (memcmp(fdhp->fsh, hanp, FSIDSIZE) == 0) {
-			*path = fdhp->fspath;
-			return fdhp->fsfd;
-		}
+	pthread_rwlock_rdlock(&fdhash_lock);
+	fdhp = fdhash_find(hanp);
+	if (fdhp) {
+		*path = fdhp->fspath;
+		fsfd = fdhp->fsfd;
 	}
-	errno = EBADF;
-	return -1;
+	pthread_rwlock_unlock(&fdhash_lock);
+
+	if (fsfd < 0)
+		errno = EBADF;
+	return fsfd;
 }
 
 static int
@@ -317,6 +365,52 @@ open_by_handle(
 	return xfsctl(path, fsfd, XFS_IOC_OPEN_BY_HANDLE, &hreq);
 }
 
+/*
+ * Open each of @nr handles with open flags @rw.  @fds[i] is set to the new
+ * file descriptor, or to a negative errno if handle i could not be opened.
+ * The cache is only searched when a handle is on a different filesystem from
+ * the one before it.  Returns the number of handles opened.
+ */
+int
+open_by_handle_batch(
+	void		**hanps,
+	size_t		*hlens,
+	int		nr,
+	int		rw,
+	int		*fds)
+{
+	int		fsfd = -1;
+	int		fserr = EBADF;
+	int		opened = 0;
+	int		i;
+	char		*path = NULL;
+	void		*last = NULL;
+	xfs_fsop_handlereq_t hreq = { };
+
+	hreq.oflags = rw | O_LARGEFILE;
+
+	for (i = 0; i < nr; i++) {
+		if (last == NULL || memcmp(last, hanps[i], FSIDSIZE) != 0) {
+			fsfd = handle_to_fsfd(hanps[i], &path);
+			fserr = errno;
+			last = hanps[i];
+		}
+		if (fsfd < 0) {
+			fds[i] = -fserr;
+			continue;
+		}
+
+		hreq.ihandle  = hanps[i];
+		hreq.ihandlen = hlens[i];
+		fds[i] = xfsctl(path, fsfd, XFS_IOC_OPEN_BY_HANDLE, &hreq);
+		if (fds[i] < 0)
+			fds[i] = -errno;
+		else
+			opened++;
+	}
+	return opened;
+}
+
 int
 readlink_by_handle(
 	void		*hanp,
@@ -373,6 +467,57 @@ attr_multi_by_handle(
 	return xfsctl(path, fd, XFS_IOC_ATTRMULTI_BY_HANDLE, &amhreq);
 }
 
+/*
+ * Run attr_multi_by_handle for each of @nr handles, with @rtrvcnts[i]
+ * operations in @bufs[i].  @results[i] is set to zero or to a negative errno
+ * for each handle.  Returns the number of handles whose operations were all
+ * carried out.
+ */
+int
+attr_multi_by_handle_batch(
+	void		**hanps,
+	size_t		*hlens,
+	void		**bufs,
+	int		*rtrvcnts,
+	int		nr,
+	int		flags,
+	int		*results)
+{
+	int		fsfd = -1;
+	int		fserr = EBADF;
+	int		done = 0;
+	int		i;
+	char		*path = NULL;
+	void		*last = NULL;
+	xfs_fsop_attrmulti_handlereq_t amhreq = { };
+
+	amhreq.hreq.oflags = O_LARGEFILE;
+
+	for (i = 0; i < nr; i++) {
+		if (last == NULL || memcmp(last, hanps[i], FSIDSIZE) != 0) {
+			fsfd = handle_to_fsfd(hanps[i], &path);
+			fserr = errno;
+			last = hanps[i];
+		}
+		if (fsfd < 0) {
+			results[i] = -fserr;
+			continue;
+		}
+
+		amhreq.hreq.ihandle  = hanps[i];
+		amhreq.hreq.ihandlen = hlens[i];
+		amhreq.opcount = rtrvcnts[i];
+		amhreq.ops = bufs[i];
+		results[i] = xfsctl(path, fsfd, XFS_IOC_ATTRMULTI_BY_HANDLE,
+				&amhreq);
+		if (results[i] < 0)
+			results[i] = -errno;
+		else
+			done++;
+	}
+	return done;
+}
+
 int
 attr_list_by_handle(
 	void		*hanp,
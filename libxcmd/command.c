@@ -260,3 +260,76 @@ report_io_times(
 			tdiv((double)total, *t2), tdiv((double)ops, *t2));
 	}
 }
+
+static int
+latency_cmp(
+	const void		*a,
+	const void		*b)
+{
+	uint64_t		la = *(const uint64_t *)a;
+	uint64_t		lb = *(const uint64_t *)b;
+
+	if (la < lb)
+		return -1;
+	return la > lb;
+}
+
+static void
+latency_str(
+	uint64_t		nsec,
+	char			*str,
+	size_t			sz)
+{
+	if (nsec < 1000)
+		snprintf(str, sz, "%lluns", (unsigned long long)nsec);
+	else if (nsec < 1000000)
+		snprintf(str, sz, "%.1fus", nsec / 1000.0);
+	else if (nsec < 1000000000)
+		snprintf(str, sz, "%.2fms", nsec / 1000000.0);
+	else
+		snprintf(str, sz, "%.3fs", nsec / 1000000000.0);
+}
+
+/*
+ * Report the distribution of a set of latency samples, in nanoseconds.  The
+ * samples are sorted in place.
+ */
+void
+report_latency(
+	const char		*what,
+	uint64_t		*samples,
+	size_t			nr,
+	int			compact)
+{
+	static const unsigned int pct[] = { 50, 90, 99 };
+	char			s[6][32];
+	long double		sum = 0;
+	uint64_t		avg;
+	size_t			i;
+
+	if (nr == 0)
+		return;
+
+	qsort(samples, nr, sizeof(uint64_t), latency_cmp);
+	for (i = 0; i < nr; i++)
+		sum += samples[i];
+	avg = sum / nr;
+
+	if (compact) {
+		/* min,avg,p50,p90,p99,max in usec */
+		printf("%.3f,%.3f", samples[0] / 1000.0, avg / 1000.0);
+		for (i = 0; i < 3; i++)
+			printf(",%.3f", samples[(nr - 1) * pct[i] / 100] / 1000.0);
+		printf(",%.3f\n", samples[nr - 1] / 1000.0);
+		return;
+	}
+
+	latency_str(samples[0], s[0], sizeof(s[0]));
+	latency_str(avg, s[1], sizeof(s[1]));
+	for (i = 0; i < 3; i++)
+		latency_str(samples[(nr - 1) * pct[i] / 100], s[i + 2],
+				sizeof(s[i + 2]));
+	latency_str(samples[nr - 1], s[5], sizeof(s[5]));
+	printf(_("%s latency: min %s, avg %s, p50 %s, p90 %s, p99 %s, max %s (%zu samples)\n"),
+		what, s[0], s[1], s[2], s[3], s[4], s[5], nr);
+}
@@ -61,6 +61,7 @@ cache_init(
 	cache->compare = cache_operations->compare;
 	cache->bulkrelse = cache_operations->bulkrelse ?
 		cache_operations->bulkrelse : cache_generic_bulkrelse;
+	cache->bulkflush = cache_operations->bulkflush;
 	pthread_mutex_init(&cache->c_mutex, NULL);
 
 	for (i = 0; i < hashsize; i++) {
@@ -359,6 +360,34 @@ __cache_node_purge(
 	return 0;
 }
 
+/*
+ * Take a reference to a node and remove it from its MRU list if it was
+ * unreferenced.  Caller must hold the node mutex.
+ */
+static void
+__cache_node_grab(
+	struct cache *		cache,
+	struct cache_node *	node)
+{
+	struct cache_mru *	mru;
+
+	if (node->cn_count == 0) {
+		ASSERT(node->cn_priority >= 0);
+		ASSERT(!list_empty(&node->cn_mru));
+		mru = &cache->c_mrus[node->cn_priority];
+		pthread_mutex_lock(&mru->cm_mutex);
+		mru->cm_count--;
+		list_del_init(&node->cn_mru);
+		pthread_mutex_unlock(&mru->cm_mutex);
+		if (node->cn_old_priority != -1) {
+			ASSERT(node->cn_priority == CACHE_DIRTY_PRIORITY);
+			node->cn_priority = node->cn_old_priority;
+			node->cn_old_priority = -1;
+		}
+	}
+	node->cn_count++;
+}
+
 /*
  * Lookup in the cache hash table.  With any luck we'll get a cache
  * hit, in which case this will all be over quickly and painlessly.
@@ -375,7 +404,6 @@ cache_node_get(
 {
 	struct cache_node *	node = NULL;
 	struct cache_hash *	hash;
-	struct cache_mru *	mru;
 	struct list_head *	head;
 	struct list_head *	pos;
 	struct list_head *	n;
@@ -414,24 +442,7 @@ cache_node_get(
 			 * from its MRU list, and update stats.
 			 */
 			pthread_mutex_lock(&node->cn_mutex);
-
-			if (node->cn_count == 0) {
-				ASSERT(node->cn_priority >= 0);
-				ASSERT(!list_empty(&node->cn_mru));
-				mru = &cache->c_mrus[node->cn_priority];
-				pthread_mutex_lock(&mru->cm_mutex);
-				mru->cm_count--;
-				list_del_init(&node->cn_mru);
-				pthread_mutex_unlock(&mru->cm_mutex);
-				if (node->cn_old_priority != -1) {
-					ASSERT(node->cn_priority ==
-							CACHE_DIRTY_PRIORITY);
-					node->cn_priority = node->cn_old_priority;
-					node->cn_old_priority = -1;
-				}
-			}
-			node->cn_count++;
-
+			__cache_node_grab(cache, node);
 			pthread_mutex_unlock(&node->cn_mutex);
 			pthread_mutex_unlock(&hash->ch_mutex);
 
@@ -515,6 +526,20 @@ cache_node_put(
 	pthread_mutex_unlock(&node->cn_mutex);
 }
 
+/*
+ * Take another reference to a node the caller already holds, without going
+ * through the hash lookup again.
+ */
+void
+cache_node_hold(
+	struct cache *		cache,
+	struct cache_node *	node)
+{
+	pthread_mutex_lock(&node->cn_mutex);
+	__cache_node_grab(cache, node);
+	pthread_mutex_unlock(&node->cn_mutex);
+}
+
 void
 cache_node_set_priority(
 	struct cache *		cache,
@@ -621,6 +646,77 @@ cache_purge(
 #endif
 }
 
+/*
+ * Hand every node in the cache to the bulk flush routine in one go, so that
+ * it can order and batch the writes.  Nodes are pinned with a reference
+ * rather than locked while they are written, so the flush routine may look
+ * up other nodes.  Returns nonzero if the nodes could not be gathered.
+ */
+static int
+cache_bulk_flush(
+	struct cache *		cache)
+{
+	struct cache_hash *	hash;
+	struct list_head *	head;
+	struct list_head *	pos;
+	struct cache_node *	node;
+	struct cache_node **	nodes, **p;
+	unsigned int		nr = 0, size;
+	unsigned long long	bytes;
+	struct timeval		start, end;
+	int			i;
+	int			error = -1;
+
+	pthread_mutex_lock(&cache->c_mutex);
+	size = cache->c_count + 64;
+	pthread_mutex_unlock(&cache->c_mutex);
+	nodes = malloc(size * sizeof(struct cache_node *));
+	if (!nodes)
+		return -1;
+
+	for (i = 0; i < cache->c_hashsize; i++) {
+		hash = &cache->c_hash[i];
+
+		pthread_mutex_lock(&hash->ch_mutex);
+		head = &hash->ch_list;
+		for (pos = head->next; pos != head; pos = pos->next) {
+			if (nr == size) {
+				p = realloc(nodes, size * 2 *
+						sizeof(struct cache_node *));
+				if (!p) {
+					pthread_mutex_unlock(&hash->ch_mutex);
+					goto out_put;
+				}
+				nodes = p;
+				size *= 2;
+			}
+			node = (struct cache_node *)pos;
+			pthread_mutex_lock(&node->cn_mutex);
+			__cache_node_grab(cache, node);
+			pthread_mutex_unlock(&node->cn_mutex);
+			nodes[nr++] = node;
+		}
+		pthread_mutex_unlock(&hash->ch_mutex);
+	}
+
+	gettimeofday(&start, NULL);
+	bytes = cache->bulkflush(cache, nodes, nr);
+	gettimeofday(&end, NULL);
+
+	pthread_mutex_lock(&cache->c_mutex);
+	cache->c_flushes++;
+	cache->c_flush_bytes += bytes;
+	cache->c_flush_usecs += (end.tv_sec - start.tv_sec) * 1000000ULL +
+				end.tv_usec - start.tv_usec;
+	pthread_mutex_unlock(&cache->c_mutex);
+	error = 0;
+out_put:
+	while (nr > 0)
+		cache_node_put(cache, nodes[--nr]);
+	free(nodes);
+	return error;
+}
+
 /*
  * Flush all nodes in the cache to disk.
  */
@@ -637,6 +733,9 @@ cache_flush(
 	if (!cache->flush)
 		return;
 
+	if (cache->bulkflush && !cache_bulk_flush(cache))
+		return;
+
 	for (i = 0; i < cache->c_hashsize; i++) {
 		hash = &cache->c_hash[i];
 
@@ -686,6 +785,19 @@ cache_report(
 				(cache->c_hits + cache->c_misses)
 	);
 
+	if (cache->c_flushes)
+		fprintf(fp, "Flushes = %llu, %llu bytes in %.3fs (%.1f MiB/s)\n",
+			cache->c_flushes, cache->c_flush_bytes,
+			cache->c_flush_usecs / 1000000.0,
+			cache->c_flush_usecs ?
+				(double)cache->c_flush_bytes /
+				cache->c_flush_usecs * 1000000.0 / 1048576 :
+				0.0);
+
+	/* the rest is in proportion to the active entries */
+	if (!cache->c_count)
+		return;
+
 	for (i = 0; i <= CACHE_MAX_PRIORITY; i++)
 		fprintf(fp, "MRU %d entries = %6u (%3u%%)\n",
 			i, cache->c_mrus[i].cm_count,
@@ -409,6 +409,10 @@ libxfs_init(libxfs_init_t *a)
 		libxfs_bhash_size = LIBXFS_BHASHSIZE(sbp);
 	libxfs_bcache = cache_init(a->bcache_flags, libxfs_bhash_size,
 				   &libxfs_bcache_operations);
+	if (!libxfs_ihash_size)
+		libxfs_ihash_size = LIBXFS_IHASHSIZE(sbp);
+	libxfs_icache = cache_init(0, libxfs_ihash_size,
+				   &libxfs_icache_operations);
 	use_xfs_buf_lock = a->usebuflock;
 	xfs_dir_startup();
 	init_caches();
@@ -770,6 +774,8 @@ libxfs_mount(
 	libxfs_buftarg_init(mp, dev, logdev, rtdev);
 
 	mp->m_finobt_nores = true;
+	mp->m_trans_batch = 0;
+	mp->m_trans_batch_sb = false;
 	xfs_set_inode32(mp);
 	mp->m_sb = *sb;
 	INIT_RADIX_TREE(&mp->m_perag_tree, GFP_KERNEL);
@@ -1008,6 +1014,7 @@ libxfs_umount(
 	int			error;
 
 	libxfs_rtmount_destroy(mp);
+	libxfs_icache_purge();
 
 	/*
 	 * Purge the buffer cache to write all dirty buffers to disk and free
@@ -1046,6 +1053,13 @@ libxfs_destroy(
 
 	libxfs_close_devices(li);
 
+	/* Cached inodes must go before the caches they were allocated from */
+	libxfs_icache_purge();
+	if (libxfs_icache && !libxfs_icache->c_count) {
+		cache_destroy(libxfs_icache);
+		libxfs_icache = NULL;
+	}
+
 	/* Free everything from the buffer cache before freeing buffer cache */
 	libxfs_bcache_purge();
 	libxfs_bcache_free();
@@ -1069,6 +1083,9 @@ libxfs_report(FILE *fp)
 	char *c;
 
 	cache_report(fp, "libxfs_bcache", libxfs_bcache);
+	if (libxfs_icache)
+		cache_report(fp, "libxfs_icache", libxfs_icache);
+	kmem_report(fp);
 
 	t = time(NULL);
 	c = asctime(localtime(&t));
@@ -3,6 +3,245 @@
 
 #include "libxfs_priv.h"
 
+/*
+ * Object caches
+ *
+ * Each thread keeps a magazine of free objects per cache, so that most
+ * allocations and frees are a few instructions with no locking.  An empty
+ * magazine is refilled with half a magazine's worth of objects from the depot
+ * of the cache, and a full magazine gives half of its objects back.  The depot
+ * is fed by carving new slabs into objects.  Slabs are only released when the
+ * cache is destroyed.
+ *
+ * The depot and magazines hold pointers to free objects rather than linking
+ * through them, so an object keeps whatever state its constructor gave it
+ * for as long as it lives in the cache, as it does in the kernel.
+ */
+
+/* Objects per magazine. */
+#define KMEM_MAG_SIZE		64
+
+/* Smallest slab, and the fewest objects in one. */
+#define KMEM_SLAB_SIZE		(64 * 1024)
+#define KMEM_SLAB_MIN_OBJS	16
+
+/* Slab and default object alignment. */
+#define KMEM_SLAB_ALIGN		64
+#define KMEM_OBJ_ALIGN		16
+
+struct kmem_slab {
+	struct kmem_slab	*next;
+};
+
+/* Slab header size, keeping the first object aligned. */
+#define KMEM_SLAB_HDR		KMEM_SLAB_ALIGN
+
+struct kmem_magazine {
+	struct kmem_magazine	*next;
+	struct kmem_magazine	*prev;
+	struct kmem_cache	*cache;
+	long long		allocs;		/* allocations minus frees */
+	unsigned int		rounds;		/* objects in objs[] */
+	void			*objs[KMEM_MAG_SIZE];
+};
+
+static pthread_mutex_t		kmem_caches_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct kmem_cache	*kmem_caches;
+
+/*
+ * Only the owning thread changes a magazine's counter, but kmem_report reads
+ * it from other threads.
+ */
+static inline void
+kmem_mag_count(
+	struct kmem_magazine	*mag,
+	int			delta)
+{
+	__atomic_store_n(&mag->allocs,
+			__atomic_load_n(&mag->allocs, __ATOMIC_RELAXED) + delta,
+			__ATOMIC_RELAXED);
+}
+
+/* Total objects handed out and not yet freed.  Caller holds cache->lock. */
+static long long
+kmem_cache_in_use(
+	struct kmem_cache	*cache)
+{
+	struct kmem_magazine	*mag;
+	long long		in_use = cache->allocated;
+
+	for (mag = cache->mags; mag; mag = mag->next)
+		in_use += __atomic_load_n(&mag->allocs, __ATOMIC_RELAXED);
+	return in_use;
+}
+
+/* Put objects into the depot.  Caller holds cache->lock. */
+static void
+kmem_depot_put(
+	struct kmem_cache	*cache,
+	void			**objs,
+	unsigned int		nr)
+{
+	void			**depot;
+	unsigned int		size;
+
+	if (cache->depot_count + nr > cache->depot_size) {
+		size = max(cache->depot_size * 2, cache->depot_count + nr);
+		size = max(size, KMEM_MAG_SIZE * 4);
+		depot = realloc(cache->depot, size * sizeof(void *));
+		if (depot == NULL) {
+			fprintf(stderr,
+				_("%s: cache depot grow failed (%s, %u objects): %s\n"),
+				progname, cache->cache_name, size,
+				strerror(errno));
+			exit(1);
+		}
+		cache->depot = depot;
+		cache->depot_size = size;
+	}
+	memcpy(cache->depot + cache->depot_count, objs, nr * sizeof(void *));
+	cache->depot_count += nr;
+}
+
+/* Carve a new slab into objects.  Caller holds cache->lock. */
+static void
+kmem_slab_grow(
+	struct kmem_cache	*cache)
+{
+	struct kmem_slab	*slab;
+	size_t			size;
+	char			*p;
+	unsigned int		i;
+	int			error;
+
+	size = KMEM_SLAB_HDR + (size_t)cache->slab_objs * cache->objsize;
+	error = posix_memalign((void **)&slab, KMEM_SLAB_ALIGN, size);
+	if (error) {
+		fprintf(stderr, _("%s: cache slab alloc failed (%s, %zu bytes): %s\n"),
+			progname, cache->cache_name, size, strerror(error));
+		exit(1);
+	}
+	slab->next = cache->slabs;
+	cache->slabs = slab;
+	cache->nr_slabs++;
+
+	cache->slab_next = (char *)slab + KMEM_SLAB_HDR;
+	cache->slab_left = cache->slab_objs;
+
+	if (cache->ctor) {
+		for (i = 0, p = cache->slab_next; i < cache->slab_objs;
+		     i++, p += cache->objsize)
+			cache->ctor(p);
+	}
+}
+
+/* Half fill an empty magazine. */
+static void
+kmem_mag_refill(
+	struct kmem_cache	*cache,
+	struct kmem_magazine	*mag)
+{
+	unsigned int		want = KMEM_MAG_SIZE / 2;
+	unsigned int		nr;
+
+	pthread_mutex_lock(&cache->lock);
+	cache->refills++;
+
+	nr = min(want, cache->depot_count);
+	cache->depot_count -= nr;
+	memcpy(mag->objs, cache->depot + cache->depot_count,
+			nr * sizeof(void *));
+	mag->rounds = nr;
+
+	while (mag->rounds < want) {
+		if (!cache->slab_left)
+			kmem_slab_grow(cache);
+		mag->objs[mag->rounds++] = cache->slab_next;
+		cache->slab_next += cache->objsize;
+		cache->slab_left--;
+	}
+	pthread_mutex_unlock(&cache->lock);
+}
+
+/* Give half of a full magazine back to the depot. */
+static void
+kmem_mag_drain(
+	struct kmem_cache	*cache,
+	struct kmem_magazine	*mag,
+	unsigned int		nr)
+{
+	pthread_mutex_lock(&cache->lock);
+	cache->drains++;
+	mag->rounds -= nr;
+	kmem_depot_put(cache, mag->objs + mag->rounds, nr);
+	pthread_mutex_unlock(&cache->lock);
+}
+
+/* Unhook a magazine and give everything in it back.  Caller holds the lock. */
+static void
+__kmem_mag_free(
+	struct kmem_cache	*cache,
+	struct kmem_magazine	*mag)
+{
+	kmem_depot_put(cache, mag->objs, mag->rounds);
+	cache->allocated += mag->allocs;
+	if (mag->prev)
+		mag->prev->next = mag->next;
+	else
+		cache->mags = mag->next;
+	if (mag->next)
+		mag->next->prev = mag->prev;
+	free(mag);
+}
+
+/* Thread exit destructor for magazines. */
+static void
+kmem_mag_free(
+	void			*arg)
+{
+	struct kmem_magazine	*mag = arg;
+	struct kmem_cache	*cache = mag->cache;
+
+	pthread_mutex_lock(&cache->lock);
+	__kmem_mag_free(cache, mag);
+	pthread_mutex_unlock(&cache->lock);
+}
+
+static struct kmem_magazine *
+kmem_mag_create(
+	struct kmem_cache	*cache)
+{
+	struct kmem_magazine	*mag = calloc(1, sizeof(struct kmem_magazine));
+
+	if (mag == NULL) {
+		fprintf(stderr, _("%s: cache magazine alloc failed (%s): %s\n"),
+			progname, cache->cache_name, strerror(errno));
+		exit(1);
+	}
+	mag->cache = cache;
+
+	pthread_mutex_lock(&cache->lock);
+	mag->next = cache->mags;
+	if (mag->next)
+		mag->next->prev = mag;
+	cache->mags = mag;
+	pthread_mutex_unlock(&cache->lock);
+
+	pthread_setspecific(cache->mag_key, mag);
+	return mag;
+}
+
+static inline struct kmem_magazine *
+kmem_mag_get(
+	struct kmem_cache	*cache)
+{
+	struct kmem_magazine	*mag = pthread_getspecific(cache->mag_key);
+
+	if (mag)
+		return mag;
+	return kmem_mag_create(cache);
+}
+
 /*
  * Simple memory interface
  */
@@ -10,7 +249,8 @@ struct kmem_cache *
 kmem_cache_create(const char *name, unsigned int size, unsigned int align,
 		unsigned int slab_flags, void (*ctor)(void *))
 {
-	struct kmem_cache	*ptr = malloc(sizeof(struct kmem_cache));
+	struct kmem_cache	*ptr = calloc(1, sizeof(struct kmem_cache));
+	int			error;
 
 	if (ptr == NULL) {
 		fprintf(stderr, _("%s: cache init failed (%s, %d bytes): %s\n"),
@@ -24,19 +264,70 @@ kmem_cache_create(const char *name, unsigned int size, unsigned int align,
 	ptr->align = align;
 	ptr->ctor = ctor;
 
+	align = max(align, KMEM_OBJ_ALIGN);
+	ptr->objsize = roundup(max(size, 1U), align);
+	ptr->slab_objs = max(KMEM_SLAB_SIZE / ptr->objsize,
+			     KMEM_SLAB_MIN_OBJS);
+	ptr->use_malloc = getenv("LIBXFS_KMEM_MALLOC") != NULL;
+
+	pthread_mutex_init(&ptr->lock, NULL);
+	error = pthread_key_create(&ptr->mag_key, kmem_mag_free);
+	if (error) {
+		fprintf(stderr, _("%s: cache init failed (%s): %s\n"),
+			progname, name, strerror(error));
+		exit(1);
+	}
+
+	pthread_mutex_lock(&kmem_caches_lock);
+	ptr->next = kmem_caches;
+	kmem_caches = ptr;
+	pthread_mutex_unlock(&kmem_caches_lock);
+
 	return ptr;
 }
 
 int
 kmem_cache_destroy(struct kmem_cache *cache)
 {
-	int	leaked = 0;
+	struct kmem_cache	**pp;
+	struct kmem_slab	*slab;
+	long long		in_use;
+	int			leaked = 0;
 
-	if (getenv("LIBXFS_LEAK_CHECK") && cache->allocated) {
+	if (!cache)
+		return 0;
+
+	pthread_mutex_lock(&kmem_caches_lock);
+	for (pp = &kmem_caches; *pp; pp = &(*pp)->next) {
+		if (*pp == cache) {
+			*pp = cache->next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&kmem_caches_lock);
+
+	pthread_mutex_lock(&cache->lock);
+	in_use = kmem_cache_in_use(cache);
+	while (cache->mags)
+		__kmem_mag_free(cache, cache->mags);
+	pthread_mutex_unlock(&cache->lock);
+
+	/* Other threads' magazines are gone, so don't run the destructor. */
+	pthread_setspecific(cache->mag_key, NULL);
+	pthread_key_delete(cache->mag_key);
+
+	if (getenv("LIBXFS_LEAK_CHECK") && in_use) {
 		leaked = 1;
-		fprintf(stderr, "cache %s freed with %d items allocated\n",
-				cache->cache_name, cache->allocated);
+		fprintf(stderr, "cache %s freed with %lld items allocated\n",
+				cache->cache_name, in_use);
 	}
+
+	while ((slab = cache->slabs) != NULL) {
+		cache->slabs = slab->next;
+		free(slab);
+	}
+	free(cache->depot);
+	pthread_mutex_destroy(&cache->lock);
 	free(cache);
 	return leaked;
 }
@@ -44,15 +335,29 @@ kmem_cache_destroy(struct kmem_cache *cache)
 void *
 kmem_cache_alloc(struct kmem_cache *cache, gfp_t flags)
 {
-	void	*ptr = malloc(cache->cache_unitsize);
+	struct kmem_magazine	*mag;
+	void			*ptr;
 
-	if (ptr == NULL) {
-		fprintf(stderr, _("%s: cache alloc failed (%s, %d bytes): %s\n"),
-			progname, cache->cache_name, cache->cache_unitsize,
-			strerror(errno));
-		exit(1);
+	if (cache->use_malloc) {
+		ptr = malloc(cache->cache_unitsize);
+		if (ptr == NULL) {
+			fprintf(stderr,
+				_("%s: cache alloc failed (%s, %d bytes): %s\n"),
+				progname, cache->cache_name,
+				cache->cache_unitsize, strerror(errno));
+			exit(1);
+		}
+		if (cache->ctor)
+			cache->ctor(ptr);
+		__atomic_fetch_add(&cache->allocated, 1, __ATOMIC_RELAXED);
+		return ptr;
 	}
-	cache->allocated++;
+
+	mag = kmem_mag_get(cache);
+	if (!mag->rounds)
+		kmem_mag_refill(cache, mag);
+	ptr = mag->objs[--mag->rounds];
+	kmem_mag_count(mag, 1);
 	return ptr;
 }
 
@@ -65,6 +370,54 @@ kmem_cache_zalloc(struct kmem_cache *cache, gfp_t flags)
 	return ptr;
 }
 
+void
+kmem_cache_free(struct kmem_cache *cache, void *ptr)
+{
+	struct kmem_magazine	*mag;
+
+	if (cache->use_malloc) {
+		__atomic_fetch_sub(&cache->allocated, 1, __ATOMIC_RELAXED);
+		free(ptr);
+		return;
+	}
+
+	mag = kmem_mag_get(cache);
+	if (mag->rounds == KMEM_MAG_SIZE)
+		kmem_mag_drain(cache, mag, KMEM_MAG_SIZE / 2);
+	mag->objs[mag->rounds++] = ptr;
+	kmem_mag_count(mag, -1);
+}
+
+/* Print usage statistics for every object cache. */
+void
+kmem_report(FILE *fp)
+{
+	struct kmem_cache	*cache;
+	unsigned long long	slab_bytes;
+	long long		in_use;
+
+	pthread_mutex_lock(&kmem_caches_lock);
+	if (kmem_caches)
+		fprintf(fp, "%-20s %8s %10s %8s %12s %6s %10s %10s\n",
+			"kmem cache", "objsize", "in use", "slabs",
+			"slab bytes", "used", "refills", "drains");
+	for (cache = kmem_caches; cache; cache = cache->next) {
+		pthread_mutex_lock(&cache->lock);
+		in_use = kmem_cache_in_use(cache);
+		slab_bytes = cache->nr_slabs * (KMEM_SLAB_HDR +
+				(unsigned long long)cache->slab_objs *
+				cache->objsize);
+		fprintf(fp, "%-20s %8u %10lld %8llu %12llu %5.1f%% %10llu %10llu\n",
+			cache->cache_name, cache->objsize, in_use,
+			cache->nr_slabs, slab_bytes,
+			slab_bytes ? 100.0 * in_use * cache->cache_unitsize /
+					slab_bytes : 0.0,
+			cache->refills, cache->drains);
+		pthread_mutex_unlock(&cache->lock);
+	}
+	pthread_mutex_unlock(&kmem_caches_lock);
+}
+
 void *
 kmem_alloc(size_t size, int flags)
 {
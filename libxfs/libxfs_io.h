@@ -150,6 +150,18 @@ extern struct cache_operations	libxfs_bcache_operations;
 int libxfs_buf_read_map(struct xfs_buftarg *btp, struct xfs_buf_map *maps,
 			int nmaps, int flags, struct xfs_buf **bpp,
 			const struct xfs_buf_ops *ops);
+
+/* One buffer of a batched read. */
+struct xfs_buf_read_req {
+	struct xfs_buf_map	*maps;
+	int			nmaps;
+	const struct xfs_buf_ops *ops;
+	struct xfs_buf		*bp;		/* returned buffer, or NULL */
+	int			error;		/* returned error */
+};
+
+int libxfs_buf_read_batch(struct xfs_buftarg *btp,
+			struct xfs_buf_read_req *reqs, int nr, int flags);
 void libxfs_buf_mark_dirty(struct xfs_buf *bp);
 int libxfs_buf_get_map(struct xfs_buftarg *btp, struct xfs_buf_map *maps,
 			int nmaps, int flags, struct xfs_buf **bpp);
@@ -5,6 +5,7 @@
  */
 
 
+#include <sys/uio.h>
 #include "libxfs_priv.h"
 #include "init.h"
 #include "xfs_fs.h"
@@ -18,6 +19,7 @@
 #include "xfs_inode.h"
 #include "xfs_trans.h"
 #include "libfrog/platform.h"
+#include "libfrog/workqueue.h"
 
 #include "libxfs.h"
 
@@ -620,28 +622,165 @@ libxfs_readbuf_verify(
 	return bp->b_error;
 }
 
-int
-libxfs_readbufr_map(struct xfs_buftarg *btp, struct xfs_buf *bp, int flags)
+/*
+ * Vectored reads.  The segments of the buffers to read are sorted by disk
+ * address and merged with their neighbours into preadv calls.  Small gaps
+ * between segments are read into a scratch buffer rather than splitting the
+ * read, as one larger I/O is cheaper than two small ones.
+ */
+
+/* Most buffer segments, bytes and gap bytes in a single preadv. */
+#define BREAD_MAX_IOVECS	64
+#define BREAD_MAX_BYTES		(1U << 20)
+#define BREAD_MAX_GAP		(64U << 10)
+
+/* Segments of a buffer we will read into the on-stack array. */
+#define BREAD_STACK_SEGS	8
+
+/* A contiguous piece of a buffer; discontiguous buffers have several. */
+struct bread_seg {
+	struct xfs_buf		*bp;
+	void			*addr;
+	off64_t			offset;
+	size_t			len;
+};
+
+static unsigned int
+bread_add_segs(
+	struct xfs_buf		*bp,
+	struct bread_seg	*segs)
 {
-	int	fd;
-	int	error = 0;
-	void	*buf;
-	int	i;
+	char			*addr = bp->b_addr;
+	int			i;
 
-	fd = libxfs_device_to_fd(btp->bt_bdev);
-	buf = bp->b_addr;
 	for (i = 0; i < bp->b_nmaps; i++) {
-		off64_t	offset = LIBXFS_BBTOOFF64(bp->b_maps[i].bm_bn);
-		int len = BBTOB(bp->b_maps[i].bm_len);
+		segs[i].bp = bp;
+		segs[i].addr = addr;
+		segs[i].offset = LIBXFS_BBTOOFF64(bp->b_maps[i].bm_bn);
+		segs[i].len = BBTOB(bp->b_maps[i].bm_len);
+		addr += segs[i].len;
+	}
+	return bp->b_nmaps;
+}
 
-		error = __read_buf(fd, buf, len, offset, flags);
-		if (error) {
-			bp->b_error = error;
-			break;
+static int
+bread_seg_cmp(
+	const void		*a,
+	const void		*b)
+{
+	const struct bread_seg	*sa = a;
+	const struct bread_seg	*sb = b;
+
+	if (sa->offset != sb->offset)
+		return sa->offset < sb->offset ? -1 : 1;
+	if (sa->len != sb->len)
+		return sa->len < sb->len ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Read a run of sorted, non-overlapping segments with one preadv.  If that
+ * fails, go back and read the segments one at a time so that the errors end
+ * up on the buffers they belong to.
+ */
+static void
+bread_run(
+	int			fd,
+	struct bread_seg	*segs,
+	unsigned int		nr,
+	void			*gapbuf)
+{
+	struct iovec		iov[2 * BREAD_MAX_IOVECS];
+	off64_t			end = segs[0].offset;
+	ssize_t			len = 0;
+	unsigned int		i, n = 0;
+	int			error;
+
+	if (nr > 1) {
+		for (i = 0; i < nr; i++) {
+			if (segs[i].offset > end) {
+				iov[n].iov_base = gapbuf;
+				iov[n++].iov_len = segs[i].offset - end;
+				len += segs[i].offset - end;
+			}
+			iov[n].iov_base = segs[i].addr;
+			iov[n++].iov_len = segs[i].len;
+			len += segs[i].len;
+			end = segs[i].offset + segs[i].len;
+		}
+		if (preadv(fd, iov, n, segs[0].offset) == len)
+			return;
+	}
+
+	for (i = 0; i < nr; i++) {
+		error = __read_buf(fd, segs[i].addr, segs[i].len,
+				segs[i].offset, 0);
+		if (error && !segs[i].bp->b_error)
+			segs[i].bp->b_error = error;
+	}
+}
+
+/* Read all the segments, recording errors in the buffers' b_error. */
+static void
+bread_segs(
+	int			fd,
+	struct bread_seg	*segs,
+	unsigned int		nr)
+{
+	void			*gapbuf = NULL;
+	unsigned int		first, i;
+	off64_t			end;
+	size_t			bytes, gap;
+
+	qsort(segs, nr, sizeof(struct bread_seg), bread_seg_cmp);
+
+	for (first = 0; first < nr; first = i) {
+		end = segs[first].offset + segs[first].len;
+		bytes = segs[first].len;
+		for (i = first + 1; i < nr; i++) {
+			if (segs[i].offset < end ||
+			    i - first >= BREAD_MAX_IOVECS)
+				break;
+			gap = segs[i].offset - end;
+			if (gap > BREAD_MAX_GAP ||
+			    bytes + gap + segs[i].len > BREAD_MAX_BYTES)
+				break;
+			if (gap && !gapbuf) {
+				gapbuf = memalign(libxfs_device_alignment(),
+						BREAD_MAX_GAP);
+				if (!gapbuf)
+					break;
+			}
+			end = segs[i].offset + segs[i].len;
+			bytes += gap + segs[i].len;
+		}
+		bread_run(fd, &segs[first], i - first, gapbuf);
+	}
+	free(gapbuf);
+}
+
+int
+libxfs_readbufr_map(struct xfs_buftarg *btp, struct xfs_buf *bp, int flags)
+{
+	struct bread_seg	stack_segs[BREAD_STACK_SEGS];
+	struct bread_seg	*segs = stack_segs;
+	int			error;
+
+	if (bp->b_nmaps > BREAD_STACK_SEGS) {
+		segs = malloc(bp->b_nmaps * sizeof(struct bread_seg));
+		if (!segs) {
+			bp->b_error = -ENOMEM;
+			return -ENOMEM;
 		}
-		buf += len;
 	}
 
+	bp->b_error = 0;
+	bread_segs(libxfs_device_to_fd(btp->bt_bdev), segs,
+			bread_add_segs(bp, segs));
+	if (segs != stack_segs)
+		free(segs);
+
+	error = bp->b_error;
 	if (!error)
 		bp->b_flags |= LIBXFS_B_UPTODATE;
 	return error;
@@ -720,6 +859,175 @@ err:
 	return error;
 }
 
+static int
+bread_req_cmp(
+	const void		*a,
+	const void		*b)
+{
+	const struct xfs_buf_read_req *ra = *(struct xfs_buf_read_req **)a;
+	const struct xfs_buf_read_req *rb = *(struct xfs_buf_read_req **)b;
+	int			i;
+
+	if (ra->maps[0].bm_bn != rb->maps[0].bm_bn)
+		return ra->maps[0].bm_bn < rb->maps[0].bm_bn ? -1 : 1;
+
+	/* identical requests must end up next to each other */
+	if (ra->nmaps != rb->nmaps)
+		return ra->nmaps < rb->nmaps ? -1 : 1;
+	for (i = 0; i < ra->nmaps; i++) {
+		if (ra->maps[i].bm_bn != rb->maps[i].bm_bn)
+			return ra->maps[i].bm_bn < rb->maps[i].bm_bn ? -1 : 1;
+		if (ra->maps[i].bm_len != rb->maps[i].bm_len)
+			return ra->maps[i].bm_len < rb->maps[i].bm_len ? -1 : 1;
+	}
+	return 0;
+}
+
+/* Do two requests ask for exactly the same buffer? */
+static bool
+bread_req_same(
+	const struct xfs_buf_read_req	*a,
+	const struct xfs_buf_read_req	*b)
+{
+	int				i;
+
+	if (a->nmaps != b->nmaps)
+		return false;
+	for (i = 0; i < a->nmaps; i++) {
+		if (a->maps[i].bm_bn != b->maps[i].bm_bn ||
+		    a->maps[i].bm_len != b->maps[i].bm_len)
+			return false;
+	}
+	return true;
+}
+
+/*
+ * Read a batch of buffers.  This behaves like calling libxfs_buf_read_map on
+ * each request, except that the buffers that are not already cached are read
+ * together with as few I/Os as possible.
+ *
+ * The buffers are looked up (and locked) in disk order, so concurrent batch
+ * readers cannot deadlock against each other.  Each request returns its own
+ * buffer and error; the return value is the first error of the batch, if any.
+ */
+int
+libxfs_buf_read_batch(
+	struct xfs_buftarg	*btp,
+	struct xfs_buf_read_req	*reqs,
+	int			nr,
+	int			flags)
+{
+	struct xfs_buf_read_req	**order;
+	struct xfs_buf_read_req	*req;
+	struct bread_seg	*segs;
+	struct xfs_buf		*bp;
+	bool			salvage = flags & LIBXFS_READBUF_SALVAGE;
+	unsigned int		nr_segs = 0;
+	int			i, error = 0;
+
+	order = malloc(nr * sizeof(struct xfs_buf_read_req *));
+	if (!order)
+		return -ENOMEM;
+	for (i = 0; i < nr; i++)
+		order[i] = &reqs[i];
+	qsort(order, nr, sizeof(struct xfs_buf_read_req *), bread_req_cmp);
+
+	/*
+	 * Look up all the buffers.  A cached buffer might not have been read
+	 * yet, and need not have been set up with the same maps as the
+	 * request, so count the segments to read from the buffers themselves.
+	 * The same buffer asked for twice sorts next to itself.
+	 */
+	for (i = 0; i < nr; i++) {
+		req = order[i];
+		req->bp = NULL;
+
+		/*
+		 * Take another reference and lock recursion on a buffer we
+		 * already hold directly; looking it up again would work, but
+		 * complain about recursive locking.
+		 */
+		if (i > 0 && order[i - 1]->bp &&
+		    bread_req_same(order[i - 1], req)) {
+			bp = order[i - 1]->bp;
+			cache_node_hold(libxfs_bcache, &bp->b_node);
+			if (use_xfs_buf_lock)
+				bp->b_recur++;
+			req->bp = bp;
+			req->error = 0;
+			continue;
+		}
+
+		req->error = __libxfs_buf_get_map(btp, req->maps, req->nmaps,
+				0, &req->bp);
+		if (req->error)
+			continue;
+
+		bp = req->bp;
+		bp->b_error = 0;
+		if (!(bp->b_flags & (LIBXFS_B_UPTODATE | LIBXFS_B_DIRTY)) &&
+		    !(i > 0 && order[i - 1]->bp == bp))
+			nr_segs += bp->b_nmaps;
+	}
+
+	segs = malloc(nr_segs * sizeof(struct bread_seg));
+	nr_segs = 0;
+	for (i = 0; i < nr; i++) {
+		bp = order[i]->bp;
+		if (!bp || (bp->b_flags & (LIBXFS_B_UPTODATE | LIBXFS_B_DIRTY)))
+			continue;
+		if (!segs)
+			bp->b_error = -ENOMEM;
+		else if (!(i > 0 && order[i - 1]->bp == bp))
+			nr_segs += bread_add_segs(bp, &segs[nr_segs]);
+	}
+
+	bread_segs(libxfs_device_to_fd(btp->bt_bdev), segs, nr_segs);
+
+	/* Now verify them as libxfs_buf_read_map would. */
+	for (i = 0; i < nr; i++) {
+		req = order[i];
+		bp = req->bp;
+		if (!bp)
+			continue;
+
+		if (i > 0 && order[i - 1]->bp == bp) {
+			req->error = order[i - 1]->error;
+			continue;
+		}
+
+		if (bp->b_flags & (LIBXFS_B_UPTODATE | LIBXFS_B_DIRTY)) {
+			if (bp->b_flags & LIBXFS_B_UNCHECKED)
+				req->error = libxfs_readbuf_verify(bp,
+						req->ops);
+			if (salvage)
+				req->error = 0;
+		} else if (bp->b_error) {
+			req->error = bp->b_error;
+		} else {
+			bp->b_flags |= LIBXFS_B_UPTODATE;
+			req->error = libxfs_readbuf_verify(bp, req->ops);
+			if (salvage)
+				req->error = 0;
+		}
+	}
+
+	/* Only drop the failed buffers once all duplicates have been seen. */
+	for (i = 0; i < nr; i++) {
+		req = &reqs[i];
+		if (req->error && req->bp) {
+			libxfs_buf_relse(req->bp);
+			req->bp = NULL;
+		}
+		if (req->error && !error)
+			error = req->error;
+	}
+
+	free(segs);
+	free(order);
+	return error;
+}
+
 /* Allocate a raw uncached buffer. */
 static inline struct xfs_buf *
 libxfs_getbufr_uncached(
@@ -808,12 +1116,14 @@ __write_buf(int fd, void *buf, int len, off64_t offset, int flags)
 	return 0;
 }
 
-int
-libxfs_bwrite(
+/*
+ * Get a buffer ready to be written: run the writeback hook and the write
+ * verifier.  Returns nonzero if the buffer must not be written.
+ */
+static int
+libxfs_bwrite_prepare(
 	struct xfs_buf	*bp)
 {
-	int		fd = libxfs_device_to_fd(bp->b_target->bt_bdev);
-
 	/*
 	 * we never write buffers that are marked stale. This indicates they
 	 * contain data that has been invalidated, and even if the buffer is
@@ -840,12 +1150,40 @@ libxfs_bwrite(
 		if (bp->b_error) {
 			fprintf(stderr,
 	_("%s: write verifier failed on %s bno 0x%llx/0x%x\n"),
-				__func__, bp->b_ops->name,
+				"libxfs_bwrite", bp->b_ops->name,
 				(unsigned long long)xfs_buf_daddr(bp),
 				bp->b_length);
 			return bp->b_error;
 		}
 	}
+	return 0;
+}
+
+/* Report a write error or mark the buffer clean once it has been written. */
+static void
+libxfs_bwrite_done(
+	struct xfs_buf	*bp)
+{
+	if (bp->b_error) {
+		fprintf(stderr,
+	_("%s: write failed on %s bno 0x%llx/0x%x, err=%d\n"),
+			"libxfs_bwrite",
+			bp->b_ops ? bp->b_ops->name : "(unknown)",
+			(unsigned long long)xfs_buf_daddr(bp),
+			bp->b_length, -bp->b_error);
+	} else {
+		bp->b_flags |= LIBXFS_B_UPTODATE;
+		bp->b_flags &= ~(LIBXFS_B_DIRTY | LIBXFS_B_UNCHECKED);
+		xfs_buftarg_trip_write(bp->b_target);
+	}
+}
+
+/* Write a prepared buffer to disk, leaving any error in b_error. */
+static void
+libxfs_bwrite_io(
+	struct xfs_buf	*bp)
+{
+	int		fd = libxfs_device_to_fd(bp->b_target->bt_bdev);
 
 	if (!(bp->b_flags & LIBXFS_B_DISCONTIG)) {
 		bp->b_error = __write_buf(fd, bp->b_addr, BBTOB(bp->b_length),
@@ -866,18 +1204,17 @@ libxfs_bwrite(
 			buf += len;
 		}
 	}
+}
 
-	if (bp->b_error) {
-		fprintf(stderr,
-	_("%s: write failed on %s bno 0x%llx/0x%x, err=%d\n"),
-			__func__, bp->b_ops ? bp->b_ops->name : "(unknown)",
-			(unsigned long long)xfs_buf_daddr(bp),
-			bp->b_length, -bp->b_error);
-	} else {
-		bp->b_flags |= LIBXFS_B_UPTODATE;
-		bp->b_flags &= ~(LIBXFS_B_DIRTY | LIBXFS_B_UNCHECKED);
-		xfs_buftarg_trip_write(bp->b_target);
-	}
+int
+libxfs_bwrite(
+	struct xfs_buf	*bp)
+{
+	if (libxfs_bwrite_prepare(bp))
+		return bp->b_error;
+
+	libxfs_bwrite_io(bp);
+	libxfs_bwrite_done(bp);
 	return bp->b_error;
 }
 
@@ -995,6 +1332,349 @@ libxfs_bflush(
 	return bp->b_error;
 }
 
+/*
+ * Bulk writeback for cache flushes.  Dirty buffers are prepared (writeback
+ * hook and write verifier) in parallel, sorted by disk address, merged with
+ * their neighbours into vectored writes, and written by several threads, each
+ * working its way up through its own part of the disk.
+ */
+
+/* Most buffer segments and bytes merged into a single pwritev. */
+#define BFLUSH_MAX_IOVECS	64
+#define BFLUSH_MAX_BYTES	(1U << 20)
+
+/* Most writer threads, and the fewest buffers worth a thread. */
+#define BFLUSH_MAX_THREADS	8
+#define BFLUSH_MIN_PER_THREAD	256
+
+/* A contiguous piece of a buffer; discontiguous buffers have several. */
+struct bflush_seg {
+	struct xfs_buf		*bp;
+	void			*addr;
+	off64_t			offset;
+	size_t			len;
+	int			fd;
+};
+
+/* A run of adjacent segments written with one pwritev. */
+struct bflush_run {
+	unsigned int		first;
+	unsigned int		nr;
+};
+
+struct bflush {
+	struct xfs_buf		**bufs;
+	unsigned int		nr_bufs;
+	struct bflush_seg	*segs;
+	unsigned int		nr_segs;
+	struct bflush_run	*runs;
+	unsigned int		nr_runs;
+
+	/* runs[split[i]] up to runs[split[i + 1]] belong to thread i */
+	unsigned int		*split;
+	unsigned int		nr_threads;
+
+	pthread_mutex_t		lock;
+	unsigned long long	bytes;
+};
+
+static void
+bflush_prepare_worker(
+	struct workqueue	*wq,
+	uint32_t		index,
+	void			*arg)
+{
+	struct bflush		*bf = wq->wq_ctx;
+	unsigned int		first = (uint64_t)bf->nr_bufs * index /
+					bf->nr_threads;
+	unsigned int		last = (uint64_t)bf->nr_bufs * (index + 1) /
+					bf->nr_threads;
+	unsigned int		i;
+
+	for (i = first; i < last; i++)
+		libxfs_bwrite_prepare(bf->bufs[i]);
+}
+
+static int
+bflush_seg_cmp(
+	const void		*a,
+	const void		*b)
+{
+	const struct bflush_seg	*sa = a;
+	const struct bflush_seg	*sb = b;
+
+	if (sa->fd != sb->fd)
+		return sa->fd < sb->fd ? -1 : 1;
+	if (sa->offset != sb->offset)
+		return sa->offset < sb->offset ? -1 : 1;
+	if (sa->len != sb->len)
+		return sa->len < sb->len ? -1 : 1;
+	return 0;
+}
+
+static void
+bflush_write_run(
+	struct bflush		*bf,
+	struct bflush_run	*run,
+	unsigned long long	*bytes)
+{
+	struct bflush_seg	*seg = &bf->segs[run->first];
+	struct iovec		iov[BFLUSH_MAX_IOVECS];
+	ssize_t			len = 0, sts;
+	int			error = 0;
+	unsigned int		i;
+
+	for (i = 0; i < run->nr; i++) {
+		iov[i].iov_base = seg[i].addr;
+		iov[i].iov_len = seg[i].len;
+		len += seg[i].len;
+	}
+
+	sts = pwritev(seg->fd, iov, run->nr, seg->offset);
+	if (sts < 0) {
+		error = errno;
+		fprintf(stderr, _("%s: pwrite failed: %s\n"),
+			progname, strerror(error));
+		error = -error;
+	} else if (sts != len) {
+		fprintf(stderr, _("%s: error - pwrite only %d of %d bytes\n"),
+			progname, (int)sts, (int)len);
+		error = -EIO;
+	} else {
+		*bytes += len;
+	}
+
+	/* Segments of one buffer can land in different runs. */
+	if (error) {
+		for (i = 0; i < run->nr; i++)
+			seg[i].bp->b_error = error;
+	}
+}
+
+static void
+bflush_write_worker(
+	struct workqueue	*wq,
+	uint32_t		index,
+	void			*arg)
+{
+	struct bflush		*bf = wq->wq_ctx;
+	unsigned long long	bytes = 0;
+	unsigned int		i;
+
+	for (i = bf->split[index]; i < bf->split[index + 1]; i++)
+		bflush_write_run(bf, &bf->runs[i], &bytes);
+
+	pthread_mutex_lock(&bf->lock);
+	bf->bytes += bytes;
+	pthread_mutex_unlock(&bf->lock);
+}
+
+/* Run a worker over nr pieces, in this thread if there is only one. */
+static void
+bflush_run_workers(
+	struct bflush		*bf,
+	void			(*fn)(struct workqueue *, uint32_t, void *),
+	unsigned int		nr)
+{
+	struct workqueue	wq;
+	unsigned int		i;
+
+	if (nr > 1 && !workqueue_create(&wq, bf, nr)) {
+		for (i = 0; i < nr; i++) {
+			if (workqueue_add(&wq, fn, i, NULL))
+				break;
+		}
+		if (!workqueue_terminate(&wq) && i == nr) {
+			workqueue_destroy(&wq);
+			return;
+		}
+		workqueue_destroy(&wq);
+		/* Fall back to doing whatever was not queued ourselves. */
+		for (; i < nr; i++) {
+			wq.wq_ctx = bf;
+			fn(&wq, i, NULL);
+		}
+		return;
+	}
+
+	wq.wq_ctx = bf;
+	for (i = 0; i < nr; i++)
+		fn(&wq, i, NULL);
+}
+
+/* Merge sorted segments into runs and split the runs between threads. */
+static void
+bflush_build_runs(
+	struct bflush		*bf)
+{
+	struct bflush_seg	*seg, *prev = NULL;
+	struct bflush_run	*run = NULL;
+	off64_t			end = 0;
+	size_t			run_len = 0;
+	unsigned int		i, t = 1;
+
+	bf->nr_runs = 0;
+	for (i = 0; i < bf->nr_segs; i++) {
+		seg = &bf->segs[i];
+		if (run && seg->fd == prev->fd &&
+		    seg->offset == prev->offset + prev->len &&
+		    run->nr < BFLUSH_MAX_IOVECS &&
+		    run_len + seg->len <= BFLUSH_MAX_BYTES) {
+			run->nr++;
+			run_len += seg->len;
+		} else {
+			/*
+			 * Overlapping buffers must be written in order by the
+			 * same thread, so only split between threads where
+			 * this run starts beyond everything before it.
+			 */
+			if (run && t < bf->nr_threads &&
+			    i >= (uint64_t)bf->nr_segs * t / bf->nr_threads &&
+			    (seg->fd != prev->fd || seg->offset >= end))
+				bf->split[t++] = bf->nr_runs;
+
+			run = &bf->runs[bf->nr_runs++];
+			run->first = i;
+			run->nr = 1;
+			run_len = seg->len;
+		}
+		if (!prev || seg->fd != prev->fd)
+			end = 0;
+		end = max(end, seg->offset + (off64_t)seg->len);
+		prev = seg;
+	}
+	bf->nr_threads = t;
+	bf->split[t] = bf->nr_runs;
+}
+
+static unsigned long long
+libxfs_bulkflush(
+	struct cache		*cache,
+	struct cache_node	**nodes,
+	unsigned int		nr)
+{
+	struct bflush		bf = { .nr_threads = 1 };
+	struct xfs_buf		*bp;
+	unsigned int		i, j, n;
+	bool			hooked = false;
+
+	bf.bufs = malloc(nr * sizeof(struct xfs_buf *));
+	if (!bf.bufs)
+		goto fallback;
+
+	/* Pick out the buffers that libxfs_bflush would write. */
+	for (i = 0, n = 0; i < nr; i++) {
+		bp = container_of(nodes[i], struct xfs_buf, b_node);
+		if (bp->b_error || !(bp->b_flags & LIBXFS_B_DIRTY))
+			continue;
+		if (bp->b_mount->m_buf_writeback_fn)
+			hooked = true;
+		bf.bufs[n++] = bp;
+	}
+	bf.nr_bufs = n;
+	if (!n) {
+		free(bf.bufs);
+		return 0;
+	}
+
+	/*
+	 * Verifiers can be expensive, so run them in parallel, unless there
+	 * is a writeback hook that might write other buffers behind our back.
+	 */
+	if (!hooked && n >= 2 * BFLUSH_MIN_PER_THREAD)
+		bf.nr_threads = min(platform_nproc(), min(BFLUSH_MAX_THREADS,
+					n / BFLUSH_MIN_PER_THREAD));
+	bflush_run_workers(&bf, bflush_prepare_worker, bf.nr_threads);
+
+	/*
+	 * Drop the buffers that failed; libxfs_bwrite_prepare has already
+	 * complained about them.  Count the segments of the rest.
+	 */
+	for (i = 0, j = 0, n = 0; i < bf.nr_bufs; i++) {
+		bp = bf.bufs[i];
+		if (bp->b_error)
+			continue;
+		bf.bufs[j++] = bp;
+		n += (bp->b_flags & LIBXFS_B_DISCONTIG) ? bp->b_nmaps : 1;
+	}
+	bf.nr_bufs = j;
+
+	bf.segs = malloc(max(n, 1) * sizeof(struct bflush_seg));
+	bf.runs = malloc(max(n, 1) * sizeof(struct bflush_run));
+	bf.split = malloc((BFLUSH_MAX_THREADS + 1) * sizeof(unsigned int));
+	if (!bf.segs || !bf.runs || !bf.split) {
+		/* Already prepared, so only the I/O is left to do. */
+		for (i = 0; i < bf.nr_bufs; i++) {
+			bp = bf.bufs[i];
+			libxfs_bwrite_io(bp);
+			if (!bp->b_error)
+				bf.bytes += BBTOB(bp->b_length);
+			libxfs_bwrite_done(bp);
+		}
+		goto out;
+	}
+
+	/* Cut the buffers into contiguous segments and sort them. */
+	for (i = 0, n = 0; i < bf.nr_bufs; i++) {
+		void		*addr;
+
+		bp = bf.bufs[i];
+		if (!(bp->b_flags & LIBXFS_B_DISCONTIG)) {
+			bf.segs[n].bp = bp;
+			bf.segs[n].addr = bp->b_addr;
+			bf.segs[n].offset = LIBXFS_BBTOOFF64(xfs_buf_daddr(bp));
+			bf.segs[n].len = BBTOB(bp->b_length);
+			bf.segs[n].fd = libxfs_device_to_fd(
+						bp->b_target->bt_bdev);
+			n++;
+			continue;
+		}
+		addr = bp->b_addr;
+		for (j = 0; j < bp->b_nmaps; j++) {
+			bf.segs[n].bp = bp;
+			bf.segs[n].addr = addr;
+			bf.segs[n].offset =
+				LIBXFS_BBTOOFF64(bp->b_maps[j].bm_bn);
+			bf.segs[n].len = BBTOB(bp->b_maps[j].bm_len);
+			bf.segs[n].fd = libxfs_device_to_fd(
+						bp->b_target->bt_bdev);
+			addr += bf.segs[n].len;
+			n++;
+		}
+	}
+	bf.nr_segs = n;
+	qsort(bf.segs, bf.nr_segs, sizeof(struct bflush_seg), bflush_seg_cmp);
+
+	bf.nr_threads = 1;
+	if (bf.nr_segs >= 2 * BFLUSH_MIN_PER_THREAD)
+		bf.nr_threads = min(platform_nproc(), min(BFLUSH_MAX_THREADS,
+					bf.nr_segs / BFLUSH_MIN_PER_THREAD));
+	bf.split[0] = 0;
+	bflush_build_runs(&bf);
+
+	pthread_mutex_init(&bf.lock, NULL);
+	bflush_run_workers(&bf, bflush_write_worker, bf.nr_threads);
+	pthread_mutex_destroy(&bf.lock);
+
+	for (i = 0; i < bf.nr_bufs; i++)
+		libxfs_bwrite_done(bf.bufs[i]);
+out:
+	free(bf.split);
+	free(bf.runs);
+	free(bf.segs);
+	free(bf.bufs);
+	return bf.bytes;
+
+fallback:
+	for (i = 0; i < nr; i++) {
+		bp = container_of(nodes[i], struct xfs_buf, b_node);
+		if (!bp->b_error && (bp->b_flags & LIBXFS_B_DIRTY) &&
+		    !libxfs_bwrite(bp))
+			bf.bytes += BBTOB(bp->b_length);
+	}
+	return bf.bytes;
+}
+
 void
 libxfs_bcache_purge(void)
 {
@@ -1019,7 +1699,8 @@ struct cache_operations libxfs_bcache_operations = {
 	.flush		= libxfs_bflush,
 	.relse		= libxfs_brelse,
 	.compare	= libxfs_bcompare,
-	.bulkrelse	= libxfs_bulkrelse
+	.bulkrelse	= libxfs_bulkrelse,
+	.bulkflush	= libxfs_bulkflush,
 };
 
 /*
@@ -1067,6 +1748,201 @@ xfs_verify_magic16(
 struct kmem_cache		*xfs_inode_cache;
 extern struct kmem_cache	*xfs_ili_cache;
 
+/*
+ * Inode cache.  Inodes released by libxfs_irele stay on the cache LRU, so
+ * that tools which keep looking up the same directories and parents do not
+ * have to read and decode them every time.  A cached inode is only handed out
+ * again if nobody else is using it, no transaction has changed it without
+ * writing it back to its buffer, and the inode on disk is still exactly what
+ * it was read from or written back as.  Anything else gets a freshly decoded
+ * inode, and the cached one is thrown away.
+ */
+struct cache			*libxfs_icache;	/* global inode cache */
+int				libxfs_ihash_size;	/* #buckets in icache */
+
+struct xfs_ikey {
+	struct xfs_mount	*mp;
+	xfs_ino_t		ino;
+};
+
+static unsigned int
+libxfs_ihash(cache_key_t key, unsigned int hashsize, unsigned int hashshift)
+{
+	struct xfs_ikey	*ikey = (struct xfs_ikey *)key;
+	uint64_t	hashval = ikey->ino ^ ((uintptr_t)ikey->mp >> 6);
+	uint64_t	tmp;
+
+	tmp = hashval ^ (GOLDEN_RATIO_PRIME + hashval) / CACHE_LINE_SIZE;
+	tmp = tmp ^ ((tmp ^ GOLDEN_RATIO_PRIME) >> hashshift);
+	return tmp % hashsize;
+}
+
+static int
+libxfs_icompare(struct cache_node *node, cache_key_t key)
+{
+	struct xfs_inode	*ip = container_of(node, struct xfs_inode,
+						   i_node);
+	struct xfs_ikey		*ikey = (struct xfs_ikey *)key;
+
+	if (ip->i_mount == ikey->mp && ip->i_ino == ikey->ino)
+		return CACHE_HIT;
+	return CACHE_MISS;
+}
+
+static struct cache_node *
+libxfs_ialloc(cache_key_t key)
+{
+	struct xfs_ikey		*ikey = (struct xfs_ikey *)key;
+	struct xfs_inode	*ip;
+
+	ip = kmem_cache_zalloc(xfs_inode_cache, 0);
+	ip->i_mount = ikey->mp;
+	ip->i_ino = ikey->ino;
+
+	/* The caller of cache_node_get owns a new inode. */
+	VFS_I(ip)->i_count = 1;
+	return &ip->i_node;
+}
+
+/* Cached inodes are never dirty; changes go to disk through transactions. */
+static int
+libxfs_iflush(struct cache_node *node)
+{
+	return 0;
+}
+
+static void libxfs_idestroy(struct xfs_inode *ip);
+
+static void
+libxfs_irelse(struct cache_node *node)
+{
+	struct xfs_inode	*ip = container_of(node, struct xfs_inode,
+						   i_node);
+
+	libxfs_idestroy(ip);
+	free(ip->i_dcopy);
+	kmem_cache_free(xfs_inode_cache, ip);
+}
+
+struct cache_operations libxfs_icache_operations = {
+	.hash		= libxfs_ihash,
+	.alloc		= libxfs_ialloc,
+	.flush		= libxfs_iflush,
+	.relse		= libxfs_irelse,
+	.compare	= libxfs_icompare,
+};
+
+void
+libxfs_icache_purge(void)
+{
+	if (libxfs_icache)
+		cache_purge(libxfs_icache);
+}
+
+/* Read the inode from disk into @ip, and keep a copy of it if @dcopy. */
+static int
+libxfs_iread(
+	struct xfs_mount	*mp,
+	struct xfs_trans	*tp,
+	struct xfs_inode	*ip,
+	bool			dcopy)
+{
+	struct xfs_buf		*bp;
+	struct xfs_dinode	*dip;
+	int			error;
+
+	ip->i_af.if_format = XFS_DINODE_FMT_EXTENTS;
+	spin_lock_init(&VFS_I(ip)->i_lock);
+
+	error = xfs_imap(mp, tp, ip->i_ino, &ip->i_imap, 0);
+	if (error)
+		return error;
+
+	error = xfs_imap_to_bp(mp, tp, &ip->i_imap, &bp);
+	if (error)
+		return error;
+
+	dip = xfs_buf_offset(bp, ip->i_imap.im_boffset);
+	error = xfs_inode_from_disk(ip, dip);
+	if (!error) {
+		xfs_buf_set_ref(bp, XFS_INO_REF);
+		if (dcopy) {
+			ip->i_dcopy = malloc(mp->m_sb.sb_inodesize);
+			if (ip->i_dcopy)
+				memcpy(ip->i_dcopy, dip, mp->m_sb.sb_inodesize);
+		}
+	}
+	xfs_trans_brelse(tp, bp);
+	return error;
+}
+
+/*
+ * Can we hand out this cached inode again?  The caller has claimed it, so
+ * nobody else is looking at it.
+ */
+static bool
+libxfs_icache_valid(
+	struct xfs_mount	*mp,
+	struct xfs_trans	*tp,
+	struct xfs_inode	*ip)
+{
+	struct xfs_buf		*bp;
+	bool			valid;
+
+	if (!ip->i_dcopy || ip->i_logged)
+		return false;
+	if (xfs_imap_to_bp(mp, tp, &ip->i_imap, &bp))
+		return false;
+
+	valid = !memcmp(xfs_buf_offset(bp, ip->i_imap.im_boffset),
+			ip->i_dcopy, mp->m_sb.sb_inodesize);
+	if (valid)
+		xfs_buf_set_ref(bp, XFS_INO_REF);
+	xfs_trans_brelse(tp, bp);
+	return valid;
+}
+
+/*
+ * Does the in-core inode still match the disk copy it was read from?  Changes
+ * made outside of a transaction must not leak to the next user.
+ */
+static bool
+libxfs_iclean(
+	struct xfs_inode	*ip)
+{
+	struct xfs_mount	*mp = ip->i_mount;
+	struct xfs_dinode	*dip;
+	bool			clean;
+
+	if (!ip->i_dcopy || ip->i_logged)
+		return false;
+
+	dip = malloc(mp->m_sb.sb_inodesize);
+	if (!dip)
+		return false;
+	memcpy(dip, ip->i_dcopy, mp->m_sb.sb_inodesize);
+	xfs_inode_to_disk(ip, dip, be64_to_cpu(ip->i_dcopy->di_lsn));
+	clean = !memcmp(dip, ip->i_dcopy, mp->m_sb.sb_inodesize);
+	free(dip);
+	return clean;
+}
+
+/* Drop our hold on a cached inode, and throw it away if it is no good. */
+static void
+libxfs_icache_release(
+	struct xfs_inode	*ip,
+	bool			keep)
+{
+	struct xfs_ikey		key = { .mp = ip->i_mount, .ino = ip->i_ino };
+
+	if (!keep)
+		ip->i_logged = true;
+	__atomic_store_n(&VFS_I(ip)->i_count, 0, __ATOMIC_RELEASE);
+	cache_node_put(libxfs_icache, &ip->i_node);
+	if (!keep)
+		cache_node_purge(libxfs_icache, &key, &ip->i_node);
+}
+
 int
 libxfs_iget(
 	struct xfs_mount	*mp,
@@ -1075,34 +1951,53 @@ libxfs_iget(
 	uint			lock_flags,
 	struct xfs_inode	**ipp)
 {
+	struct xfs_ikey		key = { .mp = mp, .ino = ino };
+	struct cache_node	*cn = NULL;
 	struct xfs_inode	*ip;
-	struct xfs_buf		*bp;
+	unsigned int		unused = 0;
 	int			error = 0;
 
+	*ipp = NULL;
+	if (!libxfs_icache)
+		goto uncached;
+
+	if (cache_node_get(libxfs_icache, &key, &cn)) {
+		/* Cache miss, we own the new inode. */
+		ip = container_of(cn, struct xfs_inode, i_node);
+		error = libxfs_iread(mp, tp, ip, true);
+		if (error) {
+			libxfs_icache_release(ip, false);
+			return error;
+		}
+		*ipp = ip;
+		return 0;
+	}
+
+	ip = container_of(cn, struct xfs_inode, i_node);
+	if (!__atomic_compare_exchange_n(&VFS_I(ip)->i_count, &unused, 1,
+			false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+		/* Somebody else is using it; they get to keep it. */
+		cache_node_put(libxfs_icache, cn);
+		goto uncached;
+	}
+	if (!libxfs_icache_valid(mp, tp, ip)) {
+		libxfs_icache_release(ip, false);
+		goto uncached;
+	}
+	*ipp = ip;
+	return 0;
+
+uncached:
 	ip = kmem_cache_zalloc(xfs_inode_cache, 0);
 	if (!ip)
 		return -ENOMEM;
 
+	INIT_LIST_HEAD(&ip->i_node.cn_hash);
 	VFS_I(ip)->i_count = 1;
 	ip->i_ino = ino;
 	ip->i_mount = mp;
-	ip->i_af.if_format = XFS_DINODE_FMT_EXTENTS;
-	spin_lock_init(&VFS_I(ip)->i_lock);
-
-	error = xfs_imap(mp, tp, ip->i_ino, &ip->i_imap, 0);
-	if (error)
-		goto out_destroy;
-
-	error = xfs_imap_to_bp(mp, tp, &ip->i_imap, &bp);
-	if (error)
-		goto out_destroy;
-
-	error = xfs_inode_from_disk(ip,
-			xfs_buf_offset(bp, ip->i_imap.im_boffset));
-	if (!error)
-		xfs_buf_set_ref(bp, XFS_INO_REF);
-	xfs_trans_brelse(tp, bp);
 
+	error = libxfs_iread(mp, tp, ip, false);
 	if (error)
 		goto out_destroy;
 
@@ -1115,6 +2010,60 @@ out_destroy:
 	return error;
 }
 
+/*
+ * Look up a batch of inodes without a transaction.  The cluster buffers of all
+ * the inodes are read first, together and in disk order, so each inode is then
+ * decoded from a cached buffer.  ipp[i] is set to the inode for inos[i], or to
+ * NULL if that could not be read; the return value is the first error.
+ */
+int
+libxfs_iget_batch(
+	struct xfs_mount	*mp,
+	xfs_ino_t		*inos,
+	unsigned int		nr,
+	struct xfs_inode	**ipp)
+{
+	struct xfs_buf_read_req	*reqs;
+	struct xfs_buf_map	*maps;
+	struct xfs_imap		imap;
+	unsigned int		i, n = 0;
+	int			error, ret = 0;
+
+	reqs = calloc(nr, sizeof(struct xfs_buf_read_req));
+	maps = calloc(nr, sizeof(struct xfs_buf_map));
+	if (reqs && maps) {
+		for (i = 0; i < nr; i++) {
+			if (xfs_imap(mp, NULL, inos[i], &imap, 0))
+				continue;
+			maps[n].bm_bn = imap.im_blkno;
+			maps[n].bm_len = imap.im_len;
+			reqs[n].maps = &maps[n];
+			reqs[n].nmaps = 1;
+			reqs[n].ops = &xfs_inode_buf_ops;
+			n++;
+		}
+
+		/*
+		 * Errors are reported by libxfs_iget below.  Let go of the
+		 * buffers first, or it would find them locked by us.
+		 */
+		libxfs_buf_read_batch(mp->m_ddev_targp, reqs, n, 0);
+		for (i = 0; i < n; i++) {
+			if (reqs[i].bp)
+				libxfs_buf_relse(reqs[i].bp);
+		}
+	}
+	free(maps);
+	free(reqs);
+
+	for (i = 0; i < nr; i++) {
+		error = libxfs_iget(mp, NULL, inos[i], 0, &ipp[i]);
+		if (error && !ret)
+			ret = error;
+	}
+	return ret;
+}
+
 static void
 libxfs_idestroy(xfs_inode_t *ip)
 {
@@ -1138,13 +2087,20 @@ void
 libxfs_irele(
 	struct xfs_inode	*ip)
 {
-	VFS_I(ip)->i_count--;
+	if (VFS_I(ip)->i_count > 1) {
+		VFS_I(ip)->i_count--;
+		return;
+	}
 
-	if (VFS_I(ip)->i_count == 0) {
-		ASSERT(ip->i_itemp == NULL);
-		libxfs_idestroy(ip);
-		kmem_cache_free(xfs_inode_cache, ip);
+	ASSERT(ip->i_itemp == NULL);
+	if (!list_empty(&ip->i_node.cn_hash)) {
+		libxfs_icache_release(ip, libxfs_iclean(ip));
+		return;
 	}
+
+	VFS_I(ip)->i_count = 0;
+	libxfs_idestroy(ip);
+	kmem_cache_free(xfs_inode_cache, ip);
 }
 
 /*
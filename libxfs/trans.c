@@ -830,10 +830,11 @@ static void
 inode_item_done(
 	struct xfs_inode_log_item	*iip)
 {
+	struct xfs_inode		*ip = iip->ili_inode;
 	struct xfs_buf			*bp;
 	int				error;
 
-	ASSERT(iip->ili_inode != NULL);
+	ASSERT(ip != NULL);
 
 	if (!(iip->ili_fields & XFS_ILOG_ALL))
 		goto free_item;
@@ -852,9 +853,20 @@ inode_item_done(
 	if (error) {
 		fprintf(stderr, _("%s: warning - iflush_int failed (%d)\n"),
 			progname, error);
+		ip->i_logged = true;
 		goto free;
 	}
 
+	/*
+	 * The buffer now holds everything there is to know about the inode, so
+	 * the inode cache may hand it out again.
+	 */
+	if (ip->i_dcopy) {
+		memcpy(ip->i_dcopy, xfs_buf_offset(bp, ip->i_imap.im_boffset),
+				ip->i_mount->m_sb.sb_inodesize);
+		ip->i_logged = false;
+	}
+
 	libxfs_buf_mark_dirty(bp);
 free:
 	libxfs_buf_relse(bp);
@@ -927,6 +939,9 @@ static void
 inode_item_unlock(
 	struct xfs_inode_log_item	*iip)
 {
+	/* Logged changes that never made it to the buffer. */
+	if (iip->ili_fields & XFS_ILOG_ALL)
+		iip->ili_inode->i_logged = true;
 	xfs_inode_item_put(iip);
 }
 
@@ -992,7 +1007,10 @@ __xfs_trans_commit(
 			sbp->sb_fdblocks += tp->t_fdblocks_delta;
 		if (tp->t_frextents_delta)
 			sbp->sb_frextents += tp->t_frextents_delta;
-		xfs_log_sb(tp);
+		if (tp->t_mountp->m_trans_batch)
+			tp->t_mountp->m_trans_batch_sb = true;
+		else
+			xfs_log_sb(tp);
 	}
 
 	trans_committed(tp);
@@ -1014,6 +1032,41 @@ libxfs_trans_commit(
 	return __xfs_trans_commit(tp, false);
 }
 
+/*
+ * Batched commits.  Offline tools that make long runs of small changes (mkfs
+ * populating a protofile, repair rebuilding directories) dirty the superblock
+ * counters in nearly every transaction, and logging the superblock each time
+ * means a buffer lookup, join and full xfs_sb_to_disk per commit.  Inside a
+ * batch, commits only update the incore superblock; the ondisk copy is logged
+ * once when the outermost batch ends.  Nothing inside a batch may read the
+ * counters back from the superblock buffer.
+ */
+void
+libxfs_trans_batch_start(
+	struct xfs_mount	*mp)
+{
+	mp->m_trans_batch++;
+}
+
+int
+libxfs_trans_batch_end(
+	struct xfs_mount	*mp)
+{
+	struct xfs_trans	*tp;
+	int			error;
+
+	ASSERT(mp->m_trans_batch > 0);
+	if (--mp->m_trans_batch > 0 || !mp->m_trans_batch_sb)
+		return 0;
+
+	mp->m_trans_batch_sb = false;
+	error = libxfs_trans_alloc(mp, &M_RES(mp)->tr_sb, 0, 0, 0, &tp);
+	if (error)
+		return error;
+	xfs_log_sb(tp);
+	return libxfs_trans_commit(tp);
+}
+
 /*
  * Allocate an transaction, lock and join the inode to it, and reserve quota.
  *
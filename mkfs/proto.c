@@ -608,7 +608,14 @@ parse_proto(
 	struct fsxattr	*fsx,
 	char		**pp)
 {
+	int		error;
+
+	/* Log the superblock counters once, not for every file created. */
+	libxfs_trans_batch_start(mp);
 	parseproto(mp, NULL, fsx, pp, NULL);
+	error = -libxfs_trans_batch_end(mp);
+	if (error)
+		fail(_("Error logging superblock counters"), error);
 }
 
 /*
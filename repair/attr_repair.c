@@ -378,10 +378,11 @@ process_shortform_attr(
 	return(*repair);
 }
 
-/* This routine brings in blocks from disk one by one and assembles them
- * in the value buffer. If get_bmapi gets smarter later to return an extent
- * or list of extents, that would be great. For now, we don't expect too
- * many blocks per remote value, so one by one is sufficient.
+/*
+ * Bring in the blocks of a remote value and assemble them in the value
+ * buffer.  All the mapped blocks of the value are read with one batch so
+ * that contiguous ones come in with a single I/O; problems are still
+ * reported in block order.
  */
 static int
 rmtval_get(xfs_mount_t *mp, xfs_ino_t ino, blkmap_t *blkmap,
@@ -389,27 +390,59 @@ rmtval_get(xfs_mount_t *mp, xfs_ino_t ino, blkmap_t *blkmap,
 {
 	xfs_fsblock_t	bno;
 	struct xfs_buf	*bp;
+	struct xfs_buf_read_req	*reqs;
+	struct xfs_buf_map	*maps;
 	int		clearit = 0, i = 0, length = 0, amountdone = 0;
 	int		hdrsize = 0;
-	int		error;
+	int		nblks, nmapped;
 
 	if (xfs_has_crc(mp))
 		hdrsize = sizeof(struct xfs_attr3_rmt_hdr);
 
-	/* ASSUMPTION: valuelen is a valid number, so use it for looping */
+	if (valuelen <= 0)
+		return 0;
+	if (valuelen > XFS_XATTR_SIZE_MAX) {
+		do_warn(
+	_("remote value of %d bytes for attributes of inode %" PRIu64 " is too large\n"),
+			valuelen, ino);
+		return 1;
+	}
+
 	/* Note that valuelen is not a multiple of blocksize */
+	nblks = howmany(valuelen, mp->m_sb.sb_blocksize - hdrsize);
+	reqs = calloc(nblks, sizeof(struct xfs_buf_read_req));
+	maps = calloc(nblks, sizeof(struct xfs_buf_map));
+	if (!reqs || !maps) {
+		do_warn(
+	_("cannot allocate remote block list for attributes of inode %" PRIu64 "\n"), ino);
+		free(reqs);
+		free(maps);
+		return 1;
+	}
+
+	/* map the value up to the first hole */
+	for (nmapped = 0; nmapped < nblks; nmapped++) {
+		bno = blkmap_get(blkmap, blocknum + nmapped);
+		if (bno == NULLFSBLOCK)
+			break;
+		maps[nmapped].bm_bn = XFS_FSB_TO_DADDR(mp, bno);
+		maps[nmapped].bm_len = XFS_FSB_TO_BB(mp, 1);
+		reqs[nmapped].maps = &maps[nmapped];
+		reqs[nmapped].nmaps = 1;
+		reqs[nmapped].ops = &xfs_attr3_rmt_buf_ops;
+	}
+	libxfs_buf_read_batch(mp->m_dev, reqs, nmapped,
+			LIBXFS_READBUF_SALVAGE);
+
 	while (amountdone < valuelen) {
-		bno = blkmap_get(blkmap, blocknum + i);
-		if (bno == NULLFSBLOCK) {
+		if (i == nmapped) {
 			do_warn(
 	_("remote block for attributes of inode %" PRIu64 " is missing\n"), ino);
 			clearit = 1;
 			break;
 		}
-		error = -libxfs_buf_read(mp->m_dev, XFS_FSB_TO_DADDR(mp, bno),
-				XFS_FSB_TO_BB(mp, 1), LIBXFS_READBUF_SALVAGE,
-				&bp, &xfs_attr3_rmt_buf_ops);
-		if (error) {
+		bp = reqs[i].bp;
+		if (reqs[i].error) {
 			do_warn(
 	_("can't read remote block for attributes of inode %" PRIu64 "\n"), ino);
 			clearit = 1;
@@ -419,7 +452,6 @@ rmtval_get(xfs_mount_t *mp, xfs_ino_t ino, blkmap_t *blkmap,
 		if (bp->b_error == -EFSBADCRC || bp->b_error == -EFSCORRUPTED) {
 			do_warn(
 	_("Corrupt remote block for attributes of inode %" PRIu64 "\n"), ino);
-			libxfs_buf_relse(bp);
 			clearit = 1;
 			break;
 		}
@@ -431,8 +463,14 @@ rmtval_get(xfs_mount_t *mp, xfs_ino_t ino, blkmap_t *blkmap,
 		amountdone += length;
 		value += length;
 		i++;
-		libxfs_buf_relse(bp);
 	}
+
+	for (i = 0; i < nmapped; i++) {
+		if (reqs[i].bp)
+			libxfs_buf_relse(reqs[i].bp);
+	}
+	free(reqs);
+	free(maps);
 	return (clearit);
 }
 
@@ -265,11 +265,15 @@ blkmap_grow(
 	blkmap_t	*new_blkmap;
 	int		new_naexts;
 
-	/* reduce the number of reallocations for large files */
+	/*
+	 * Grow small maps a little at a time, and large ones by a quarter so
+	 * that a badly underestimated extent count costs a logarithmic rather
+	 * than linear number of reallocations and copies.
+	 */
 	if (blkmap->naexts < 1000)
 		new_naexts = blkmap->naexts + 4;
-	else if (blkmap->naexts < 10000)
-		new_naexts = blkmap->naexts + 100;
+	else if (blkmap->naexts <= BLKMAP_NEXTS_MAX - blkmap->naexts / 4)
+		new_naexts = blkmap->naexts + blkmap->naexts / 4;
 	else
 		new_naexts = blkmap->naexts + 1000;
 
@@ -597,6 +597,11 @@ process_inode_chunk(
 	xfs_ino_t		parent;
 	ino_tree_node_t		*ino_rec;
 	struct xfs_buf		**bplist;
+	struct xfs_buf_read_req	*reqs;
+	struct xfs_buf_map	*maps;
+	uint8_t			*clean;
+	int			nr_reqs = 0;
+	int			i;
 	struct xfs_dinode	*dino;
 	int			icnt;
 	int			status;
@@ -647,6 +652,12 @@ process_inode_chunk(
 	if (bplist == NULL)
 		do_error(_("failed to allocate %zd bytes of memory\n"),
 			cluster_count * sizeof(struct xfs_buf *));
+	reqs = calloc(cluster_count, sizeof(struct xfs_buf_read_req));
+	maps = calloc(cluster_count, sizeof(struct xfs_buf_map));
+	if (reqs == NULL || maps == NULL)
+		do_error(_("failed to allocate %zd bytes of memory\n"),
+			cluster_count * (sizeof(struct xfs_buf_read_req) +
+					 sizeof(struct xfs_buf_map)));
 
 	for (bp_index = 0; bp_index < cluster_count; bp_index++) {
 		/*
@@ -657,44 +668,87 @@ process_inode_chunk(
 		if (is_inode_sparse(ino_rec, irec_offset)) {
 			pftrace("skip sparse inode, startnum 0x%x idx %d",
 				ino_rec->ino_startnum, irec_offset);
-			bplist[bp_index] = NULL;
 			goto next_readbuf;
 		}
 
 		pftrace("about to read off %llu in AG %d",
 			XFS_AGB_TO_DADDR(mp, agno, agbno), agno);
 
-		error = -libxfs_buf_read(mp->m_dev,
-				XFS_AGB_TO_DADDR(mp, agno, agbno),
-				XFS_FSB_TO_BB(mp,
-					M_IGEO(mp)->blocks_per_cluster),
-				LIBXFS_READBUF_SALVAGE, &bplist[bp_index],
-				&xfs_inode_buf_ops);
-		if (error) {
-			do_warn(_("cannot read inode %" PRIu64 ", disk block %" PRId64 ", cnt %d\n"),
-				XFS_AGINO_TO_INO(mp, agno, first_irec->ino_startnum),
-				XFS_AGB_TO_DADDR(mp, agno, agbno),
-				XFS_FSB_TO_BB(mp,
-					M_IGEO(mp)->blocks_per_cluster));
-			while (bp_index > 0) {
-				bp_index--;
-				libxfs_buf_relse(bplist[bp_index]);
-			}
-			free(bplist);
-			return(1);
-		}
-
-		pftrace("readbuf %p (%llu, %d) in AG %d", bplist[bp_index],
-			(long long)xfs_buf_daddr(bplist[bp_index]),
-			bplist[bp_index]->b_length, agno);
-
-		bplist[bp_index]->b_ops = &xfs_inode_buf_ops;
+		maps[nr_reqs].bm_bn = XFS_AGB_TO_DADDR(mp, agno, agbno);
+		maps[nr_reqs].bm_len = XFS_FSB_TO_BB(mp,
+				M_IGEO(mp)->blocks_per_cluster);
+		reqs[nr_reqs].maps = &maps[nr_reqs];
+		reqs[nr_reqs].nmaps = 1;
+		reqs[nr_reqs].ops = &xfs_inode_buf_ops;
+		nr_reqs++;
 
 next_readbuf:
 		irec_offset += mp->m_sb.sb_inopblock *
 				M_IGEO(mp)->blocks_per_cluster;
 		agbno += M_IGEO(mp)->blocks_per_cluster;
 	}
+
+	/* Read all the cluster buffers of the chunk in as few I/Os as we can. */
+	error = -libxfs_buf_read_batch(mp->m_dev, reqs, nr_reqs,
+			LIBXFS_READBUF_SALVAGE);
+	if (error) {
+		for (i = 0; i < nr_reqs; i++) {
+			if (reqs[i].error) {
+				do_warn(_("cannot read inode %" PRIu64 ", disk block %" PRId64 ", cnt %d\n"),
+					XFS_AGINO_TO_INO(mp, agno,
+						first_irec->ino_startnum),
+					maps[i].bm_bn, maps[i].bm_len);
+				break;
+			}
+		}
+		for (i = 0; i < nr_reqs; i++) {
+			if (reqs[i].bp)
+				libxfs_buf_relse(reqs[i].bp);
+		}
+		free(maps);
+		free(reqs);
+		free(bplist);
+		return(1);
+	}
+
+	irec_offset = 0;
+	for (bp_index = 0, i = 0; bp_index < cluster_count; bp_index++) {
+		if (is_inode_sparse(ino_rec, irec_offset)) {
+			bplist[bp_index] = NULL;
+		} else {
+			bplist[bp_index] = reqs[i++].bp;
+			pftrace("readbuf %p (%llu, %d) in AG %d",
+				bplist[bp_index],
+				(long long)xfs_buf_daddr(bplist[bp_index]),
+				bplist[bp_index]->b_length, agno);
+
+			bplist[bp_index]->b_ops = &xfs_inode_buf_ops;
+		}
+		irec_offset += mp->m_sb.sb_inopblock *
+				M_IGEO(mp)->blocks_per_cluster;
+	}
+	free(maps);
+	free(reqs);
+
+	/*
+	 * Check the CRC and header fields of every inode in the chunk up
+	 * front, so the per-inode passes below only look closely at the
+	 * inodes that failed.
+	 */
+	clean = calloc(cluster_count, igeo->inodes_per_cluster);
+	if (clean == NULL)
+		do_error(_("failed to allocate %zd bytes of memory\n"),
+			(size_t)cluster_count * igeo->inodes_per_cluster);
+	for (bp_index = 0; bp_index < cluster_count; bp_index++) {
+		if (!bplist[bp_index])
+			continue;
+		precheck_dinode_cluster(mp, bplist[bp_index], agno,
+				first_irec->ino_startnum +
+					bp_index * igeo->inodes_per_cluster,
+				igeo->inodes_per_cluster,
+				&clean[bp_index * igeo->inodes_per_cluster]);
+	}
+
 	agbno = XFS_AGINO_TO_AGBNO(mp, first_irec->ino_startnum);
 
 	/*
@@ -727,7 +781,10 @@ next_readbuf:
 				 * to reset them later to keep from losing the
 				 * chunk that they're in
 				 */
-				if (verify_dinode(mp, dino, agno, agino) == 0 ||
+				if (verify_dinode(mp, dino, agno, agino,
+						clean[bp_index *
+						      igeo->inodes_per_cluster +
+						      cluster_offset]) == 0 ||
 						(agno == 0 &&
 						(mp->m_sb.sb_rootino == agino ||
 						 mp->m_sb.sb_rsumino == agino ||
@@ -795,6 +852,7 @@ next_readbuf:
 			for (bp_index = 0; bp_index < cluster_count; bp_index++)
 				if (bplist[bp_index])
 					libxfs_buf_relse(bplist[bp_index]);
+			free(clean);
 			free(bplist);
 			return(0);
 		}
@@ -854,7 +912,10 @@ next_readbuf:
 		status = process_dinode(mp, dino, agno, agino,
 				is_inode_free(ino_rec, irec_offset),
 				&ino_dirty, &is_used,ino_discovery, check_dups,
-				extra_attr_check, &isa_dir, &parent);
+				extra_attr_check,
+				clean[bp_index * igeo->inodes_per_cluster +
+				      cluster_offset],
+				&isa_dir, &parent);
 
 		ASSERT(is_used != 3);
 		if (ino_dirty) {
@@ -993,6 +1054,7 @@ process_next:
 				else
 					libxfs_buf_relse(bplist[bp_index]);
 			}
+			free(clean);
 			free(bplist);
 			break;
 		} else if (ibuf_offset == mp->m_sb.sb_inopblock)  {
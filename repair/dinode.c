@@ -1884,6 +1884,28 @@ _("nblocks (%" PRIu64 ") smaller than nextents for inode %" PRIu64 "\n"), nblock
 	return 0;
 }
 
+/*
+ * Only directories, symlinks and quota inodes have their data fork mapping
+ * looked up again after the fork has been scanned.  Regular files can have
+ * millions of extents, so don't build a block map for them that nothing will
+ * ever read.
+ */
+static inline bool
+data_fork_needs_blkmap(
+	int			type)
+{
+	switch (type) {
+	case XR_INO_DIR:
+	case XR_INO_SYMLINK:
+	case XR_INO_UQUOTA:
+	case XR_INO_GQUOTA:
+	case XR_INO_PQUOTA:
+		return true;
+	default:
+		return false;
+	}
+}
+
 /*
  * check data fork -- if it's bad, clear the inode
  */
@@ -1922,7 +1944,8 @@ process_inode_data_fork(
 		*nextents = 1;
 
 
-	if (dino->di_format != XFS_DINODE_FMT_LOCAL && type != XR_INO_RTDATA)
+	if (dino->di_format != XFS_DINODE_FMT_LOCAL &&
+	    data_fork_needs_blkmap(type))
 		*dblkmap = blkmap_alloc(*nextents, XFS_DATA_FORK);
 	*nextents = 0;
 
@@ -2262,6 +2285,54 @@ _("Bad extent size hint %u on inode %" PRIu64 ", "),
 	}
 }
 
+/*
+ * The identity checks process_dinode_int starts with: CRC, magic, version,
+ * and on v5 filesystems the inode number and uuid.  Returns 1 if they all
+ * pass.  The cheap field compares go first so that only plausible inodes
+ * pay for the CRC.
+ */
+static inline int
+dinode_header_ok(
+	struct xfs_mount	*mp,
+	struct xfs_dinode	*dino,
+	xfs_ino_t		lino)
+{
+	if (dino->di_magic != cpu_to_be16(XFS_DINODE_MAGIC) ||
+	    !libxfs_dinode_good_version(mp, dino->di_version))
+		return 0;
+	if (!xfs_has_crc(mp))
+		return 1;
+	if (dino->di_ino != cpu_to_be64(lino) ||
+	    platform_uuid_compare(&dino->di_uuid, &mp->m_sb.sb_meta_uuid))
+		return 0;
+	return libxfs_verify_cksum((char *)dino, mp->m_sb.sb_inodesize,
+			XFS_DINODE_CRC_OFF);
+}
+
+/*
+ * Batched first pass over an inode cluster buffer.  Most inodes are clean,
+ * so run the header checks over the whole cluster in one tight loop and flag
+ * the inodes that pass in @clean.  verify_dinode and process_dinode skip
+ * those checks for flagged inodes, so each CRC is computed once per chunk
+ * pass instead of once per call; inodes that fail take the detailed path
+ * and get the usual diagnostics there.
+ */
+void
+precheck_dinode_cluster(
+	struct xfs_mount	*mp,
+	struct xfs_buf		*bp,
+	xfs_agnumber_t		agno,
+	xfs_agino_t		agino,
+	int			nr_inodes,
+	uint8_t			*clean)
+{
+	int			i;
+
+	for (i = 0; i < nr_inodes; i++)
+		clean[i] = dinode_header_ok(mp, xfs_make_iptr(mp, bp, i),
+				XFS_AGINO_TO_INO(mp, agno, agino + i));
+}
+
 /*
  * returns 0 if the inode is ok, 1 if the inode is corrupt
  * check_dups can be set to 1 *only* when called by the
@@ -2285,6 +2356,7 @@ process_dinode_int(xfs_mount_t *mp,
 		int check_dups,		/* 1 == check if inode claims
 					 * duplicate blocks		*/
 		int extra_attr_check, /* 1 == do attribute format and value checks */
+		int prechecked,		/* 1 == inode passed dinode_header_ok */
 		int *isa_dir,		/* out == 1 if inode is a directory */
 		xfs_ino_t *parent)	/* out -- parent if ino is a dir */
 {
@@ -2330,7 +2402,13 @@ process_dinode_int(xfs_mount_t *mp,
 	 *
 	 * Of course if we make any modifications after this, the inode gets
 	 * rewritten, and the CRC is updated automagically.
+	 *
+	 * An inode that passed the batched cluster precheck has a good CRC,
+	 * magic and version number, so skip straight past those checks.
 	 */
+	if (prechecked)
+		goto check_unlinked;
+
 	if (xfs_has_crc(mp) &&
 	    !libxfs_verify_cksum((char *)dino, mp->m_sb.sb_inodesize,
 				XFS_DINODE_CRC_OFF)) {
@@ -2380,6 +2458,7 @@ process_dinode_int(xfs_mount_t *mp,
 		}
 	}
 
+check_unlinked:
 	unlinked_ino = be32_to_cpu(dino->di_next_unlinked);
 	pag = libxfs_perag_get(mp, agno);
 	if (!xfs_verify_agino_or_null(pag, unlinked_ino)) {
@@ -2404,7 +2483,7 @@ process_dinode_int(xfs_mount_t *mp,
 	 * we are called here that the inode has not already been modified in
 	 * memory and hence invalidated the CRC.
 	 */
-	if (xfs_has_crc(mp)) {
+	if (xfs_has_crc(mp) && !prechecked) {
 		if (be64_to_cpu(dino->di_ino) != lino) {
 			if (!uncertain)
 				do_warn(
@@ -3000,6 +3079,7 @@ process_dinode(
 	int			ino_discovery,
 	int			check_dups,
 	int			extra_attr_check,
+	int			prechecked,
 	int			*isa_dir,
 	xfs_ino_t		*parent)
 {
@@ -3011,7 +3091,8 @@ process_dinode(
 #endif
 	return process_dinode_int(mp, dino, agno, ino, was_free, dirty, used,
 				verify_mode, uncertain, ino_discovery,
-				check_dups, extra_attr_check, isa_dir, parent);
+				check_dups, extra_attr_check, prechecked,
+				isa_dir, parent);
 }
 
 /*
@@ -3025,7 +3106,8 @@ verify_dinode(
 	xfs_mount_t		*mp,
 	struct xfs_dinode	*dino,
 	xfs_agnumber_t		agno,
-	xfs_agino_t		ino)
+	xfs_agino_t		ino,
+	int			prechecked)
 {
 	xfs_ino_t		parent;
 	int			used = 0;
@@ -3038,7 +3120,7 @@ verify_dinode(
 
 	return process_dinode_int(mp, dino, agno, ino, 0, &dirty, &used,
 				verify_mode, uncertain, ino_discovery,
-				check_dups, 0, &isa_dir, &parent);
+				check_dups, 0, prechecked, &isa_dir, &parent);
 }
 
 /*
@@ -3064,5 +3146,5 @@ verify_uncertain_dinode(
 
 	return process_dinode_int(mp, dino, agno, ino, 0, &dirty, &used,
 				verify_mode, uncertain, ino_discovery,
-				check_dups, 0, &isa_dir, &parent);
+				check_dups, 0, 0, &isa_dir, &parent);
 }
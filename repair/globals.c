@@ -120,6 +120,7 @@ int		report_interval;
 uint64_t	*prog_rpt_done;
 
 int		ag_stride;
+int		bmap_chunks;
 int		thread_count;
 
 /* If nonzero, simulate failure after this phase. */
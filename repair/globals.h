@@ -164,6 +164,7 @@ extern int		report_interval;
 extern uint64_t		*prog_rpt_done;
 
 extern int		ag_stride;
+extern int		bmap_chunks;
 extern int		thread_count;
 
 /* If nonzero, simulate failure after this phase. */
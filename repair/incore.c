@@ -26,6 +26,207 @@ static int states[16] =
 
 static struct btree_root	**ag_bmap;
 
+/* block records fit into uint64_t's units */
+#define XR_BB_UNIT	64			/* number of bits/unit */
+#define XR_BB		4			/* bits per block record */
+#define XR_BB_NUM	(XR_BB_UNIT/XR_BB)	/* number of records per unit */
+#define XR_BB_MASK	0xF			/* block record mask */
+
+/*
+ * With -o bmap_chunks, each AG map is instead an array of fixed size chunks.
+ * A chunk whose blocks all have the same state stores only that state.  The
+ * first update that splits it allocates a dense array of XR_BB bit records,
+ * and an update covering the whole chunk collapses it again.  Lookups and
+ * updates cost the same however fragmented the AG is, and the map never
+ * needs more than half a byte per block.
+ */
+#define XR_BCHUNK_LOG		12
+#define XR_BCHUNK_BLOCKS	(1U << XR_BCHUNK_LOG)
+#define XR_BCHUNK_MASK		(XR_BCHUNK_BLOCKS - 1)
+#define XR_BCHUNK_UNITS		(XR_BCHUNK_BLOCKS / XR_BB_NUM)
+
+struct bchunk {
+	uint64_t		*recs;	/* block records, NULL if uniform */
+	int			state;	/* state of every block if uniform */
+};
+
+struct bchunk_map {
+	struct bchunk		*chunks;
+	unsigned int		nr_chunks;
+};
+
+static struct bchunk_map	*ag_bchunks;
+
+/* a unit with every record set to @state */
+static inline uint64_t
+bchunk_fill(
+	int			state)
+{
+	return (uint64_t)state * 0x1111111111111111ULL;
+}
+
+static void
+bchunk_set(
+	struct bchunk		*bc,
+	unsigned int		off,
+	unsigned int		len,
+	int			state)
+{
+	uint64_t		fill = bchunk_fill(state);
+	unsigned int		end = off + len;
+	unsigned int		i;
+
+	if (len == XR_BCHUNK_BLOCKS) {
+		free(bc->recs);
+		bc->recs = NULL;
+		bc->state = state;
+		return;
+	}
+
+	if (!bc->recs) {
+		if (bc->state == state)
+			return;
+		bc->recs = malloc(XR_BCHUNK_UNITS * sizeof(uint64_t));
+		if (!bc->recs)
+			do_error(_("couldn't allocate block map chunk\n"));
+		for (i = 0; i < XR_BCHUNK_UNITS; i++)
+			bc->recs[i] = bchunk_fill(bc->state);
+	}
+
+	while (off < end) {
+		unsigned int	first = off % XR_BB_NUM;
+		unsigned int	n = min(end - off, XR_BB_NUM - first);
+		uint64_t	mask = ~0ULL;
+
+		if (n < XR_BB_NUM)
+			mask = (((uint64_t)1 << (n * XR_BB)) - 1) << (first * XR_BB);
+		bc->recs[off / XR_BB_NUM] =
+			(bc->recs[off / XR_BB_NUM] & ~mask) | (fill & mask);
+		off += n;
+	}
+}
+
+/*
+ * Return the state of block @off in the chunk and, if @len is not NULL, the
+ * number of blocks from @off to the end of the chunk that share it.
+ */
+static int
+bchunk_get(
+	struct bchunk		*bc,
+	unsigned int		off,
+	unsigned int		*len)
+{
+	unsigned int		unit = off / XR_BB_NUM;
+	unsigned int		n;
+	uint64_t		fill;
+	uint64_t		diff;
+	int			state;
+
+	if (!bc->recs) {
+		if (len)
+			*len = XR_BCHUNK_BLOCKS - off;
+		return bc->state;
+	}
+
+	state = (bc->recs[unit] >> ((off % XR_BB_NUM) * XR_BB)) & XR_BB_MASK;
+	if (!len)
+		return state;
+
+	/* compare a unit at a time against a unit full of this state */
+	fill = bchunk_fill(state);
+	diff = (bc->recs[unit] ^ fill) >> ((off % XR_BB_NUM) * XR_BB);
+	n = off;
+	while (!diff) {
+		n = ++unit * XR_BB_NUM;
+		if (unit == XR_BCHUNK_UNITS) {
+			*len = XR_BCHUNK_BLOCKS - off;
+			return state;
+		}
+		diff = bc->recs[unit] ^ fill;
+	}
+	for (; !(diff & XR_BB_MASK); diff >>= XR_BB)
+		n++;
+	*len = n - off;
+	return state;
+}
+
+static void
+bchunk_set_ext(
+	struct bchunk_map	*map,
+	xfs_agblock_t		agbno,
+	xfs_extlen_t		blen,
+	int			state)
+{
+	while (blen > 0) {
+		unsigned int	c = agbno >> XR_BCHUNK_LOG;
+		unsigned int	off = agbno & XR_BCHUNK_MASK;
+		unsigned int	n = min(blen, XR_BCHUNK_BLOCKS - off);
+
+		if (c >= map->nr_chunks)
+			return;
+		bchunk_set(&map->chunks[c], off, n, state);
+		agbno += n;
+		blen -= n;
+	}
+}
+
+static int
+bchunk_get_ext(
+	struct bchunk_map	*map,
+	xfs_agblock_t		agbno,
+	xfs_agblock_t		maxbno,
+	xfs_extlen_t		*blen)
+{
+	unsigned int		c = agbno >> XR_BCHUNK_LOG;
+	unsigned int		off = agbno & XR_BCHUNK_MASK;
+	unsigned int		len;
+	xfs_agblock_t		end;
+	int			state;
+
+	/* everything past the end of the AG is bad, as in the btree map */
+	if (c >= map->nr_chunks) {
+		if (blen)
+			*blen = maxbno - agbno;
+		return XR_E_BAD_STATE;
+	}
+
+	if (!blen)
+		return bchunk_get(&map->chunks[c], off, NULL);
+
+	/* a run reaching the end of its chunk may continue into the next */
+	state = bchunk_get(&map->chunks[c], off, &len);
+	end = agbno + len;
+	while (end < maxbno && off + len == XR_BCHUNK_BLOCKS) {
+		off = 0;
+		if (++c >= map->nr_chunks) {
+			if (state == XR_E_BAD_STATE)
+				end = maxbno;
+			break;
+		}
+		if (bchunk_get(&map->chunks[c], 0, &len) != state)
+			break;
+		end += len;
+	}
+	*blen = min(maxbno, end) - agbno;
+	return state;
+}
+
+static void
+bchunk_reset(
+	struct bchunk_map	*map,
+	xfs_agblock_t		ag_size,
+	int			ag_hdr_block)
+{
+	unsigned int		c;
+
+	for (c = 0; c < map->nr_chunks; c++)
+		bchunk_set(&map->chunks[c], 0, XR_BCHUNK_BLOCKS, XR_E_UNKNOWN);
+	bchunk_set_ext(map, 0, ag_hdr_block, XR_E_INUSE_FS);
+	bchunk_set_ext(map, ag_size,
+			map->nr_chunks * XR_BCHUNK_BLOCKS - ag_size,
+			XR_E_BAD_STATE);
+}
+
 static void
 update_bmap(
 	struct btree_root	*bmap,
@@ -129,7 +330,10 @@ set_bmap_ext(
 	xfs_extlen_t		blen,
 	int			state)
 {
-	update_bmap(ag_bmap[agno], agbno, blen, &states[state]);
+	if (ag_bchunks)
+		bchunk_set_ext(&ag_bchunks[agno], agbno, blen, state);
+	else
+		update_bmap(ag_bmap[agno], agbno, blen, &states[state]);
 }
 
 int
@@ -142,6 +346,9 @@ get_bmap_ext(
 	int			*statep;
 	unsigned long		key;
 
+	if (ag_bchunks)
+		return bchunk_get_ext(&ag_bchunks[agno], agbno, maxbno, blen);
+
 	statep = btree_find(ag_bmap[agno], agbno, &key);
 	if (!statep)
 		return -1;
@@ -167,12 +374,6 @@ get_bmap_ext(
 static uint64_t		*rt_bmap;
 static size_t		rt_bmap_size;
 
-/* block records fit into uint64_t's units */
-#define XR_BB_UNIT	64			/* number of bits/unit */
-#define XR_BB		4			/* bits per block record */
-#define XR_BB_NUM	(XR_BB_UNIT/XR_BB)	/* number of records per unit */
-#define XR_BB_MASK	0xF			/* block record mask */
-
 /*
  * these work in real-time extents (e.g. fsbno == rt extent number)
  */
@@ -195,6 +396,43 @@ set_rtbmap(
 	 (((uint64_t) state) << ((bno % XR_BB_NUM) * XR_BB)));
 }
 
+/*
+ * Return the free mask of the sixteen records in a block map unit: bit n is
+ * set if record n is XR_E_FREE.  Records equal to XR_E_FREE become zero
+ * nibbles after the xor, each nibble is folded down to its low bit, and the
+ * low bits are then packed together.
+ */
+static inline uint32_t
+bmap_unit_freemask(
+	uint64_t	unit)
+{
+	uint64_t	x = unit ^ bchunk_fill(XR_E_FREE);
+
+	x = ~(x | x >> 1 | x >> 2 | x >> 3) & 0x1111111111111111ULL;
+	x = (x | x >> 3) & 0x0303030303030303ULL;
+	x = (x | x >> 6) & 0x000F000F000F000FULL;
+	x = (x | x >> 12) & 0x000000FF000000FFULL;
+	x = (x | x >> 24) & 0xFFFF;
+	return x;
+}
+
+/*
+ * Return the realtime bitmap word for the XFS_NBWORD extents starting at
+ * @bno, which must be word aligned.  The in-core map always covers whole
+ * words, but records past sb_rextents read as free and must be masked off
+ * by the caller.
+ */
+xfs_rtword_t
+get_rtbmap_word(
+	xfs_rtblock_t	bno)
+{
+	uint64_t	*unit = rt_bmap + bno / XR_BB_NUM;
+
+	ASSERT(bno % XFS_NBWORD == 0);
+	return bmap_unit_freemask(unit[0]) |
+	       (bmap_unit_freemask(unit[1]) << XR_BB_NUM);
+}
+
 static void
 reset_rt_bmap(void)
 {
@@ -209,8 +447,9 @@ init_rt_bmap(
 	if (mp->m_sb.sb_rextents == 0)
 		return;
 
+	/* round up to whole bitmap words for get_rtbmap_word */
 	rt_bmap_size = roundup(howmany(mp->m_sb.sb_rextents, (NBBY / XR_BB)),
-			       sizeof(uint64_t));
+			       XFS_NBWORD * XR_BB / NBBY);
 
 	rt_bmap = memalign(sizeof(uint64_t), rt_bmap_size);
 	if (!rt_bmap) {
@@ -243,6 +482,10 @@ reset_bmaps(xfs_mount_t *mp)
 		if (agno == mp->m_sb.sb_agcount - 1)
 			ag_size = (xfs_extlen_t)(mp->m_sb.sb_dblocks -
 				   (xfs_rfsblock_t)mp->m_sb.sb_agblocks * agno);
+		if (ag_bchunks) {
+			bchunk_reset(&ag_bchunks[agno], ag_size, ag_hdr_block);
+			continue;
+		}
 #ifdef BTREE_STATS
 		if (btree_find(ag_bmap[agno], 0, NULL)) {
 			printf("ag_bmap[%d] btree stats:\n", i);
@@ -273,6 +516,46 @@ reset_bmaps(xfs_mount_t *mp)
 	reset_rt_bmap();
 }
 
+static void
+init_bchunks(
+	struct xfs_mount	*mp)
+{
+	xfs_agnumber_t		agno;
+	xfs_agblock_t		ag_size = mp->m_sb.sb_agblocks;
+	struct bchunk_map	*map;
+
+	ag_bchunks = calloc(mp->m_sb.sb_agcount, sizeof(struct bchunk_map));
+	if (!ag_bchunks)
+		do_error(_("couldn't allocate block map chunk arrays\n"));
+
+	for (agno = 0; agno < mp->m_sb.sb_agcount; agno++) {
+		if (agno == mp->m_sb.sb_agcount - 1)
+			ag_size = (xfs_extlen_t)(mp->m_sb.sb_dblocks -
+				   (xfs_rfsblock_t)mp->m_sb.sb_agblocks * agno);
+		map = &ag_bchunks[agno];
+		map->nr_chunks = howmany(ag_size, XR_BCHUNK_BLOCKS);
+		map->chunks = calloc(map->nr_chunks, sizeof(struct bchunk));
+		if (!map->chunks)
+			do_error(_("couldn't allocate block map chunk arrays\n"));
+	}
+}
+
+static void
+free_bchunks(
+	struct xfs_mount	*mp)
+{
+	xfs_agnumber_t		agno;
+	unsigned int		c;
+
+	for (agno = 0; agno < mp->m_sb.sb_agcount; agno++) {
+		for (c = 0; c < ag_bchunks[agno].nr_chunks; c++)
+			free(ag_bchunks[agno].chunks[c].recs);
+		free(ag_bchunks[agno].chunks);
+	}
+	free(ag_bchunks);
+	ag_bchunks = NULL;
+}
+
 void
 init_bmaps(xfs_mount_t *mp)
 {
@@ -292,6 +575,9 @@ init_bmaps(xfs_mount_t *mp)
 	}
 	pthread_mutex_init(&rt_lock.lock, NULL);
 
+	if (bmap_chunks)
+		init_bchunks(mp);
+
 	init_rt_bmap(mp);
 	reset_bmaps(mp);
 }
@@ -306,5 +592,8 @@ free_bmaps(xfs_mount_t *mp)
 	free(ag_bmap);
 	ag_bmap = NULL;
 
+	if (ag_bchunks)
+		free_bchunks(mp);
+
 	free_rt_bmap(mp);
 }
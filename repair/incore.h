@@ -30,6 +30,7 @@ int		get_bmap_ext(xfs_agnumber_t agno, xfs_agblock_t agbno,
 
 void		set_rtbmap(xfs_rtblock_t bno, int state);
 int		get_rtbmap(xfs_rtblock_t bno);
+xfs_rtword_t	get_rtbmap_word(xfs_rtblock_t bno);
 
 static inline void
 set_bmap(xfs_agnumber_t agno, xfs_agblock_t agbno, int state)
@@ -77,7 +77,10 @@ static void
 process_ags(
 	xfs_mount_t		*mp)
 {
+	/* attribute contents are only checked here, so read them ahead too */
+	do_attr_prefetch = 1;
 	do_inode_prefetch(mp, ag_stride, process_ag_func, false, false);
+	do_attr_prefetch = 0;
 }
 
 static void
@@ -3200,6 +3200,7 @@ phase6(xfs_mount_t *mp)
 {
 	ino_tree_node_t		*irec;
 	int			i;
+	int			error;
 
 	memset(&zerocr, 0, sizeof(struct cred));
 	memset(&zerofsx, 0, sizeof(struct fsxattr));
@@ -3266,6 +3267,13 @@ _("        - resetting contents of realtime bitmap and summary inodes\n"));
 
 	do_log(_("        - traversing filesystem ...\n"));
 
+	/*
+	 * Directory rebuilds and orphanage moves each adjust the superblock
+	 * counters; log the superblock once at the end instead of per commit.
+	 */
+	if (!no_modify)
+		libxfs_trans_batch_start(mp);
+
 	irec = find_inode_rec(mp, XFS_INO_TO_AGNO(mp, mp->m_sb.sb_rootino),
 				XFS_INO_TO_AGINO(mp, mp->m_sb.sb_rootino));
 
@@ -3301,4 +3309,11 @@ _("        - resetting contents of realtime bitmap and summary inodes\n"));
 			irec = next_ino_rec(irec);
 		}
 	}
+
+	if (!no_modify) {
+		error = -libxfs_trans_batch_end(mp);
+		if (error)
+			do_error(
+	_("could not log superblock counters, error %d\n"), error);
+	}
 }
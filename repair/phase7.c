@@ -17,73 +17,94 @@
 #include "threads.h"
 #include "quotacheck.h"
 
+/*
+ * Check and reset the link counts of a batch of inodes from one inode chunk.
+ * The inodes are read with a single batched cluster read, and all the resets
+ * go into one transaction, so each cluster buffer is read and written once
+ * no matter how many of its inodes need fixing.
+ */
 static void
 update_inode_nlinks(
-	xfs_mount_t 		*mp,
-	xfs_ino_t		ino,
-	uint32_t		nlinks)
+	struct xfs_mount	*mp,
+	xfs_ino_t		*inos,
+	uint32_t		*nlinks,
+	unsigned int		nr)
 {
-	xfs_trans_t		*tp;
-	xfs_inode_t		*ip;
+	struct xfs_inode	*ips[XFS_INODES_PER_CHUNK];
+	struct xfs_inode	*ip;
+	struct xfs_trans	*tp = NULL;
+	unsigned int		i;
 	int			error;
-	int			dirty;
-	int			nres;
 
-	nres = no_modify ? 0 : 10;
-	error = -libxfs_trans_alloc(mp, &M_RES(mp)->tr_remove, nres, 0, 0, &tp);
-	ASSERT(error == 0);
-
-	error = -libxfs_iget(mp, tp, ino, 0, &ip);
-	if (error)  {
-		if (!no_modify)
-			do_error(
+	ASSERT(nr <= XFS_INODES_PER_CHUNK);
+	libxfs_iget_batch(mp, inos, nr, ips);
+
+	for (i = 0; i < nr; i++) {
+		ip = ips[i];
+		if (!ip) {
+			/* retry on its own to find out what went wrong */
+			error = -libxfs_iget(mp, NULL, inos[i], 0, &ip);
+			if (error)  {
+				if (!no_modify)
+					do_error(
 	_("couldn't map inode %" PRIu64 ", err = %d\n"),
-				ino, error);
-		else  {
-			do_warn(
+						inos[i], error);
+				do_warn(
 	_("couldn't map inode %" PRIu64 ", err = %d, can't compare link counts\n"),
-				ino, error);
-			return;
+					inos[i], error);
+				continue;
+			}
+			ips[i] = ip;
 		}
-	}
 
-	dirty = 0;
+		/* compare and set links if they differ.  */
+		if (VFS_I(ip)->i_nlink == nlinks[i])
+			continue;
 
-	/* compare and set links if they differ.  */
-	if (VFS_I(ip)->i_nlink != nlinks) {
-		if (!no_modify) {
-			do_warn(
-	_("resetting inode %" PRIu64 " nlinks from %u to %u\n"),
-				ino, VFS_I(ip)->i_nlink, nlinks);
-			set_nlink(VFS_I(ip), nlinks);
-			dirty = 1;
-		} else {
+		if (no_modify) {
 			do_warn(
 	_("would have reset inode %" PRIu64 " nlinks from %u to %u\n"),
-				ino, VFS_I(ip)->i_nlink, nlinks);
+				inos[i], VFS_I(ip)->i_nlink, nlinks[i]);
+			continue;
 		}
-	}
 
-	if (!dirty)  {
-		libxfs_trans_cancel(tp);
-	} else  {
+		do_warn(
+	_("resetting inode %" PRIu64 " nlinks from %u to %u\n"),
+			inos[i], VFS_I(ip)->i_nlink, nlinks[i]);
+
+		if (!tp) {
+			error = -libxfs_trans_alloc(mp, &M_RES(mp)->tr_ichange,
+					0, 0, 0, &tp);
+			if (error)
+				do_error(
+	_("couldn't allocate link count transaction, err = %d\n"),
+					error);
+		}
+		set_nlink(VFS_I(ip), nlinks[i]);
 		libxfs_trans_ijoin(tp, ip, 0);
 		libxfs_trans_log_inode(tp, ip, XFS_ILOG_CORE);
-		/*
-		 * no need to do a bmap finish since
-		 * we're not allocating anything
-		 */
-		ASSERT(error == 0);
+	}
+
+	/*
+	 * no need to do a bmap finish since
+	 * we're not allocating anything
+	 */
+	if (tp) {
 		error = -libxfs_trans_commit(tp);
+		if (error)
+			do_error(
+	_("couldn't commit link count updates, err = %d\n"), error);
+	}
 
-		ASSERT(error == 0);
+	for (i = 0; i < nr; i++) {
+		if (ips[i])
+			libxfs_irele(ips[i]);
 	}
-	libxfs_irele(ip);
 }
 
 /*
- * for each ag, look at each inode 1 at a time. If the number of
- * links is bad, reset it, log the inode core, commit the transaction
+ * for each ag, look at each inode chunk in turn.  Gather the inodes whose
+ * link counts look bad, reset them together, then adjust the quota counts.
  */
 static void
 do_link_updates(
@@ -95,12 +116,16 @@ do_link_updates(
 	ino_tree_node_t		*irec;
 	int			j;
 	uint32_t		nrefs;
+	xfs_ino_t		inos[XFS_INODES_PER_CHUNK];
+	uint32_t		nlinks[XFS_INODES_PER_CHUNK];
+	unsigned int		nr;
 
 	for (irec = findfirst_inode_rec(agno); irec;
 	     irec = next_ino_rec(irec)) {
 		xfs_ino_t	ino;
 
 		ino = XFS_AGINO_TO_INO(mp, agno, irec->ino_startnum);
+		nr = 0;
 
 		for (j = 0; j < XFS_INODES_PER_CHUNK; j++)  {
 			ASSERT(is_inode_confirmed(irec, j));
@@ -113,9 +138,18 @@ do_link_updates(
 			nrefs = num_inode_references(irec, j);
 			ASSERT(no_modify || nrefs > 0);
 
-			if (get_inode_disk_nlinks(irec, j) != nrefs)
-				update_inode_nlinks(wq->wq_ctx, ino + j, nrefs);
-			quotacheck_adjust(mp, ino + j);
+			if (get_inode_disk_nlinks(irec, j) != nrefs) {
+				inos[nr] = ino + j;
+				nlinks[nr++] = nrefs;
+			}
+		}
+
+		if (nr)
+			update_inode_nlinks(mp, inos, nlinks, nr);
+
+		for (j = 0; j < XFS_INODES_PER_CHUNK; j++)  {
+			if (!is_inode_free(irec, j))
+				quotacheck_adjust(mp, ino + j);
 		}
 	}
 
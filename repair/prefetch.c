@@ -18,6 +18,7 @@
 #include "progress.h"
 
 int do_prefetch = 1;
+int do_attr_prefetch;
 
 /*
  * Performs prefetching by priming the libxfs cache by using a dedicate thread
@@ -396,6 +397,52 @@ pf_read_exinode(
 			xfs_dfork_data_extents(dino));
 }
 
+/*
+ * Queue the blocks of an extent format attribute fork.  Leaf, node and
+ * remote value blocks are all single filesystem blocks, so each one gets its
+ * own buffer and the I/O threads merge neighbouring ones into large reads,
+ * across all the inodes of the cluster.  Only phase 3 looks at attribute
+ * contents, so this is only done while do_attr_prefetch is set.
+ */
+static void
+pf_read_attr_exinode(
+	prefetch_args_t		*args,
+	struct xfs_dinode	*dino)
+{
+	xfs_bmbt_rec_t		*rp = (xfs_bmbt_rec_t *)XFS_DFORK_APTR(dino);
+	xfs_extnum_t		nex = xfs_dfork_attr_extents(dino);
+	xfs_extnum_t		i;
+	xfs_bmbt_irec_t		irec;
+	struct xfs_buf_map	map;
+	int			queued = 0;
+
+	if (nex > XFS_DFORK_ASIZE(dino, mp) / sizeof(xfs_bmbt_rec_t))
+		return;
+
+	for (i = 0; i < nex; i++) {
+		libxfs_bmbt_disk_get_all(rp + i, &irec);
+
+		if (irec.br_blockcount == 0 ||
+		    !libxfs_verify_fsbno(mp, irec.br_startblock) ||
+		    !libxfs_verify_fsbno(mp, irec.br_startblock +
+					     irec.br_blockcount - 1))
+			return;
+
+		while (irec.br_blockcount--) {
+			/* don't let one huge fork flood the queue */
+			if (queued++ >= pf_max_fsbs)
+				return;
+
+			pftrace("queuing attr block in AG %d", args->agno);
+
+			map.bm_bn = XFS_FSB_TO_DADDR(mp, irec.br_startblock);
+			map.bm_len = XFS_FSB_TO_BB(mp, 1);
+			pf_queue_io(args, &map, 1, B_BMAP);
+			irec.br_startblock++;
+		}
+	}
+}
+
 static void
 pf_read_inode_dirs(
 	prefetch_args_t		*args,
@@ -423,6 +470,13 @@ pf_read_inode_dirs(
 		isadir = (be16_to_cpu(dino->di_mode) & S_IFMT) == S_IFDIR;
 		hasdir |= isadir;
 
+		if (do_attr_prefetch && !args->dirs_only &&
+		    dino->di_mode != 0 && dino->di_forkoff != 0 &&
+		    dino->di_aformat == XFS_DINODE_FMT_EXTENTS &&
+		    be16_to_cpu(dino->di_magic) == XFS_DINODE_MAGIC &&
+		    libxfs_dinode_good_version(mp, dino->di_version))
+			pf_read_attr_exinode(args, dino);
+
 		if (dino->di_format <= XFS_DINODE_FMT_LOCAL)
 			continue;
 
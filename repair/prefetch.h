@@ -9,6 +9,7 @@
 struct workqueue;
 
 extern int 	do_prefetch;
+extern int	do_attr_prefetch;
 
 #define PF_THREAD_COUNT	4
 
@@ -13,6 +13,7 @@
 #include "protos.h"
 #include "err_protos.h"
 #include "rt.h"
+#include "threads.h"
 
 #define xfs_highbit64 libxfs_highbit64	/* for XFS_RTBLOCKLOG macro */
 
@@ -39,6 +40,105 @@ rtinit(xfs_mount_t *mp)
 	_("couldn't allocate memory for incore realtime summary info.\n"));
 }
 
+/*
+ * Each worker fills in the bitmap words and summary counts for a range of
+ * whole bitmap blocks, so no two workers ever touch the same word or summary
+ * entry.  A free run that reaches either end of a range can't be sized by
+ * one worker, so it is left out of the summary and described by @head and
+ * @tail instead.  generate_rtinfo stitches those runs together afterwards.
+ */
+struct rtinfo_range {
+	struct xfs_mount	*mp;
+	xfs_rtword_t		*words;
+	xfs_suminfo_t		*sumcompute;
+	xfs_rtblock_t		start;		/* first extent */
+	xfs_rtblock_t		end;		/* last extent + 1 */
+	xfs_rtblock_t		head;		/* length of free run at start */
+	xfs_rtblock_t		tail;		/* start of free run at end */
+	uint64_t		frextents;	/* free extents in the range */
+};
+
+static inline void
+rtinfo_add_run(
+	struct xfs_mount	*mp,
+	xfs_suminfo_t		*sumcompute,
+	xfs_rtblock_t		start,
+	xfs_rtblock_t		len)
+{
+	int			bitsperblock = mp->m_sb.sb_blocksize * NBBY;
+
+	sumcompute[XFS_SUMOFFS(mp, XFS_RTBLOCKLOG(len),
+			start / bitsperblock)]++;
+}
+
+static void
+generate_rtinfo_range(
+	struct workqueue	*wq,
+	xfs_agnumber_t		index,
+	void			*arg)
+{
+	struct rtinfo_range	*rr = (struct rtinfo_range *)arg + index;
+	struct xfs_mount	*mp = rr->mp;
+	xfs_rtword_t		*words = rr->words + rr->start / XFS_NBWORD;
+	xfs_rtblock_t		extno;
+	xfs_rtblock_t		start_ext = 0;
+	bool			in_extent = false;
+
+	rr->head = 0;
+	rr->tail = rr->end;
+	rr->frextents = 0;
+
+	/*
+	 * Convert a whole word of in-core state at a time, then find the
+	 * free runs by scanning for the next set or clear bit.
+	 */
+	for (extno = rr->start; extno < rr->end; extno += XFS_NBWORD) {
+		xfs_rtword_t	bits = get_rtbmap_word(extno);
+		xfs_rtword_t	valid = ~0U;
+		unsigned int	nbits = XFS_NBWORD;
+		unsigned int	pos = 0;
+
+		if (rr->end - extno < XFS_NBWORD) {
+			nbits = rr->end - extno;
+			valid = (1U << nbits) - 1;
+			bits &= valid;
+		}
+		*words++ = bits;
+
+		while (pos < nbits) {
+			xfs_rtword_t	x;
+			xfs_rtblock_t	len;
+
+			x = (in_extent ? ~bits & valid : bits) >> pos << pos;
+			if (!x)
+				break;
+			pos = lowbit32(x);
+			if (!in_extent) {
+				start_ext = extno + pos;
+				in_extent = true;
+				continue;
+			}
+
+			len = extno + pos - start_ext;
+			rr->frextents += len;
+			if (start_ext == rr->start)
+				rr->head = len;
+			else
+				rtinfo_add_run(mp, rr->sumcompute, start_ext,
+						len);
+			in_extent = false;
+		}
+	}
+
+	if (in_extent) {
+		rr->frextents += rr->end - start_ext;
+		if (start_ext == rr->start)
+			rr->head = rr->end - start_ext;
+		else
+			rr->tail = start_ext;
+	}
+}
+
 /*
  * generate the real-time bitmap and summary info based on the
  * incore realtime extent map.
@@ -48,69 +148,80 @@ generate_rtinfo(xfs_mount_t	*mp,
 		xfs_rtword_t	*words,
 		xfs_suminfo_t	*sumcompute)
 {
-	xfs_rtblock_t	extno;
-	xfs_rtblock_t	start_ext;
-	int		bitsperblock;
-	int		bmbno;
-	xfs_rtword_t	freebit;
-	xfs_rtword_t	bits;
-	int		start_bmbno;
-	int		i;
-	int		offs;
-	int		log;
-	int		len;
-	int		in_extent;
+	struct rtinfo_range	*ranges;
+	struct rtinfo_range	*rr;
+	struct workqueue	wq;
+	xfs_rtblock_t		bitsperblock;
+	xfs_rtblock_t		blocks_per_range;
+	xfs_rtblock_t		run_start = NULLRTBLOCK;
+	unsigned int		nr_ranges;
+	unsigned int		i;
 
 	ASSERT(mp->m_rbmip == NULL);
 
-	bitsperblock = mp->m_sb.sb_blocksize * NBBY;
-	extno = start_ext = 0;
-	bmbno = in_extent = start_bmbno = 0;
+	if (mp->m_sb.sb_rextents == 0)
+		goto out;
 
 	/*
-	 * slower but simple, don't play around with trying to set
-	 * things one word at a time, just set bit as required.
-	 * Have to * track start and end (size) of each range of
-	 * free extents to set the summary info properly.
+	 * Split the bitmap into one range of whole bitmap blocks per worker.
 	 */
-	while (extno < mp->m_sb.sb_rextents)  {
-		freebit = 1;
-		*words = 0;
-		bits = 0;
-		for (i = 0; i < sizeof(xfs_rtword_t) * NBBY &&
-				extno < mp->m_sb.sb_rextents; i++, extno++)  {
-			if (get_rtbmap(extno) == XR_E_FREE)  {
-				sb_frextents++;
-				bits |= freebit;
-
-				if (in_extent == 0) {
-					start_ext = extno;
-					start_bmbno = bmbno;
-					in_extent = 1;
-				}
-			} else if (in_extent == 1) {
-				len = (int) (extno - start_ext);
-				log = XFS_RTBLOCKLOG(len);
-				offs = XFS_SUMOFFS(mp, log, start_bmbno);
-				sumcompute[offs]++;
-				in_extent = 0;
-			}
+	bitsperblock = mp->m_sb.sb_blocksize * NBBY;
+	nr_ranges = min((xfs_rtblock_t)platform_nproc(),
+			howmany(mp->m_sb.sb_rextents, bitsperblock));
+	blocks_per_range = howmany(howmany(mp->m_sb.sb_rextents, bitsperblock),
+			nr_ranges);
+	nr_ranges = howmany(howmany(mp->m_sb.sb_rextents, bitsperblock),
+			blocks_per_range);
 
-			freebit <<= 1;
-		}
-		*words = bits;
-		words++;
+	ranges = calloc(nr_ranges, sizeof(struct rtinfo_range));
+	if (!ranges)
+		do_error(
+	_("couldn't allocate memory for realtime bitmap ranges.\n"));
 
-		if (extno % bitsperblock == 0)
-			bmbno++;
+	for (i = 0; i < nr_ranges; i++) {
+		rr = &ranges[i];
+		rr->mp = mp;
+		rr->words = words;
+		rr->sumcompute = sumcompute;
+		rr->start = i * blocks_per_range * bitsperblock;
+		rr->end = min(mp->m_sb.sb_rextents,
+				rr->start + blocks_per_range * bitsperblock);
 	}
-	if (in_extent == 1) {
-		len = (int) (extno - start_ext);
-		log = XFS_RTBLOCKLOG(len);
-		offs = XFS_SUMOFFS(mp, log, start_bmbno);
-		sumcompute[offs]++;
+
+	create_work_queue(&wq, mp, nr_ranges);
+	for (i = 0; i < nr_ranges; i++)
+		queue_work(&wq, generate_rtinfo_range, i, ranges);
+	destroy_work_queue(&wq);
+
+	/*
+	 * Account the free runs that cross range boundaries.  A run is
+	 * summarised in the bitmap block where it starts.
+	 */
+	for (i = 0; i < nr_ranges; i++) {
+		rr = &ranges[i];
+		sb_frextents += rr->frextents;
+
+		if (rr->head == rr->end - rr->start) {
+			if (run_start == NULLRTBLOCK)
+				run_start = rr->start;
+			continue;
+		}
+		if (run_start != NULLRTBLOCK) {
+			rtinfo_add_run(mp, sumcompute, run_start,
+					rr->start + rr->head - run_start);
+			run_start = NULLRTBLOCK;
+		} else if (rr->head) {
+			rtinfo_add_run(mp, sumcompute, rr->start, rr->head);
+		}
+		if (rr->tail != rr->end)
+			run_start = rr->tail;
 	}
+	if (run_start != NULLRTBLOCK)
+		rtinfo_add_run(mp, sumcompute, run_start,
+				mp->m_sb.sb_rextents - run_start);
 
+	free(ranges);
+out:
 	if (mp->m_sb.sb_frextents != sb_frextents) {
 		do_warn(_("sb_frextents %" PRIu64 ", counted %" PRIu64 "\n"),
 				mp->m_sb.sb_frextents, sb_frextents);
@@ -44,6 +44,7 @@ enum o_opt_nums {
 	BLOAD_LEAF_SLACK,
 	BLOAD_NODE_SLACK,
 	NOQUOTA,
+	BMAP_CHUNKS,
 	O_MAX_OPTS,
 };
 
@@ -57,6 +58,7 @@ static char *o_opts[] = {
 	[BLOAD_LEAF_SLACK]	= "debug_bload_leaf_slack",
 	[BLOAD_NODE_SLACK]	= "debug_bload_node_slack",
 	[NOQUOTA]		= "noquota",
+	[BMAP_CHUNKS]		= "bmap_chunks",
 	[O_MAX_OPTS]		= NULL,
 };
 
@@ -289,6 +291,13 @@ process_args(int argc, char **argv)
 				case NOQUOTA:
 					quotacheck_skip();
 					break;
+				case BMAP_CHUNKS:
+					if (val)
+						noval('o', o_opts, BMAP_CHUNKS);
+					if (bmap_chunks)
+						respec('o', o_opts, BMAP_CHUNKS);
+					bmap_chunks = 1;
+					break;
 				default:
 					unknown('o', val);
 					break;
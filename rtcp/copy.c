@@ -0,0 +1,208 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Asynchronous direct I/O copy engine for xfs_rtcp.
+ */
+#include <sys/syscall.h>
+#include <linux/aio_abi.h>
+#include "platform_defs.h"
+#include "xfs_rtcp.h"
+
+static inline int
+rtcp_io_setup(
+	unsigned int		nr,
+	aio_context_t		*ctx)
+{
+	return syscall(__NR_io_setup, nr, ctx);
+}
+
+static inline int
+rtcp_io_destroy(
+	aio_context_t		ctx)
+{
+	return syscall(__NR_io_destroy, ctx);
+}
+
+static inline int
+rtcp_io_submit(
+	aio_context_t		ctx,
+	long			nr,
+	struct iocb		**iocbs)
+{
+	return syscall(__NR_io_submit, ctx, nr, iocbs);
+}
+
+static inline int
+rtcp_io_getevents(
+	aio_context_t		ctx,
+	long			min_nr,
+	long			nr,
+	struct io_event		*events)
+{
+	return syscall(__NR_io_getevents, ctx, min_nr, nr, events, NULL);
+}
+
+/* One chunk of the file, read into buf and then written back out of it. */
+struct rtcp_slot {
+	struct iocb		iocb;
+	char			*buf;
+	size_t			len;	/* bytes of source data */
+};
+
+/*
+ * Copy @size bytes from @fromfd to @tofd in @iosz chunks, keeping up to
+ * @nr_ios chunks in flight.  Each chunk is read and then written from the
+ * same buffer; a short final chunk is zero padded to the minimum direct
+ * I/O size.
+ */
+int
+rtcp_copy(
+	char			*source,
+	char			*target,
+	int			fromfd,
+	int			tofd,
+	off_t			size,
+	size_t			iosz,
+	unsigned int		nr_ios,
+	size_t			alignment,
+	size_t			miniosz)
+{
+	struct rtcp_slot	*slots, **free_slots, *slot;
+	struct iocb		**iocbs;
+	struct io_event		*events;
+	aio_context_t		ctx = 0;
+	char			*bufs = NULL;
+	off_t			next = 0;
+	unsigned int		depth;
+	unsigned int		nr_free, inflight = 0, nsub = 0, done;
+	int			error = 0;
+	int			i, ret;
+
+	depth = min((off_t)nr_ios, (off_t)howmany(size, iosz));
+	if (depth == 0)
+		return 0;
+
+	slots = calloc(depth, sizeof(struct rtcp_slot));
+	free_slots = calloc(depth, sizeof(struct rtcp_slot *));
+	iocbs = calloc(depth, sizeof(struct iocb *));
+	events = calloc(depth, sizeof(struct io_event));
+	ret = posix_memalign((void **)&bufs, alignment, depth * iosz);
+	if (ret || !slots || !free_slots || !iocbs || !events) {
+		fprintf(stderr, _("%s: %s\n"), progname,
+			strerror(ret ? ret : ENOMEM));
+		error = -1;
+		goto out;
+	}
+
+	if (rtcp_io_setup(depth, &ctx) < 0) {
+		fprintf(stderr, _("%s: io_setup failed: %s\n"),
+			progname, strerror(errno));
+		error = -1;
+		goto out;
+	}
+
+	for (i = 0; i < depth; i++) {
+		slots[i].buf = bufs + (size_t)i * iosz;
+		free_slots[i] = &slots[i];
+	}
+	nr_free = depth;
+
+	while (inflight || nsub || (next < size && !error)) {
+		/*
+		 * Queue reads for the next chunks behind any writes that
+		 * completed reads left for us.
+		 */
+		while (!error && next < size && nr_free) {
+			slot = free_slots[--nr_free];
+			slot->len = min((off_t)iosz, size - next);
+
+			memset(&slot->iocb, 0, sizeof(slot->iocb));
+			slot->iocb.aio_data = (uintptr_t)slot;
+			slot->iocb.aio_lio_opcode = IOCB_CMD_PREAD;
+			slot->iocb.aio_fildes = fromfd;
+			slot->iocb.aio_buf = (uintptr_t)slot->buf;
+			slot->iocb.aio_nbytes = roundup(slot->len, miniosz);
+			slot->iocb.aio_offset = next;
+			iocbs[nsub++] = &slot->iocb;
+			next += slot->len;
+		}
+
+		/* The kernel may take fewer than we offered. */
+		done = 0;
+		while (done < nsub) {
+			ret = rtcp_io_submit(ctx, nsub - done, iocbs + done);
+			if (ret < 0) {
+				fprintf(stderr, _("%s: io_submit failed: %s\n"),
+					progname, strerror(errno));
+				error = -1;
+				break;
+			}
+			done += ret;
+		}
+		inflight += done;
+		while (done < nsub) {
+			free_slots[nr_free++] = (struct rtcp_slot *)
+				(uintptr_t)iocbs[done]->aio_data;
+			done++;
+		}
+		nsub = 0;
+		if (!inflight)
+			break;
+
+		ret = rtcp_io_getevents(ctx, 1, depth, events);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, _("%s: io_getevents failed: %s\n"),
+				progname, strerror(errno));
+			error = -1;
+			break;
+		}
+		for (i = 0; i < ret; i++) {
+			slot = (struct rtcp_slot *)(uintptr_t)events[i].data;
+			inflight--;
+
+			if (slot->iocb.aio_lio_opcode == IOCB_CMD_PWRITE) {
+				if (events[i].res != (__s64)slot->iocb.aio_nbytes) {
+					fprintf(stderr,
+						_("%s: write error on %s: %s\n"),
+						progname, target,
+						(long)events[i].res < 0 ?
+						strerror(-events[i].res) :
+						_("short write"));
+					error = -1;
+				}
+				free_slots[nr_free++] = slot;
+				continue;
+			}
+
+			if (events[i].res != (__s64)slot->len) {
+				fprintf(stderr, _("%s: read error on %s: %s\n"),
+					progname, source,
+					(long)events[i].res < 0 ?
+					strerror(-events[i].res) :
+					_("short read"));
+				error = -1;
+			}
+			if (error) {
+				free_slots[nr_free++] = slot;
+				continue;
+			}
+
+			/* pad a short read to a block boundary */
+			memset(slot->buf + slot->len, 0,
+				slot->iocb.aio_nbytes - slot->len);
+			slot->iocb.aio_lio_opcode = IOCB_CMD_PWRITE;
+			slot->iocb.aio_fildes = tofd;
+			iocbs[nsub++] = &slot->iocb;
+		}
+	}
+
+	rtcp_io_destroy(ctx);
+out:
+	free(bufs);
+	free(events);
+	free(iocbs);
+	free(free_slots);
+	free(slots);
+	return error;
+}
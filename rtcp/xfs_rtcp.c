@@ -5,41 +5,113 @@
  */
 
 #include "libxfs.h"
+#include <linux/falloc.h>
 #include "libfrog/fsgeom.h"
+#include "libfrog/convert.h"
+#include "libfrog/workqueue.h"
+#include "xfs_rtcp.h"
+
+/* Default size of each copy I/O and number of I/Os kept in flight. */
+#define RTCP_IOSIZE		(1LL << 20)
+#define RTCP_NR_IOS		4
+
+/* Preallocate the destination this many bytes at a time. */
+#define RTCP_PREALLOC_CHUNK	(1LL << 30)
 
 int rtcp(char *, char *, int);
 int xfsrtextsize(char *path);
 
 static int pflag;
+static int vflag;
+static long long iosize = RTCP_IOSIZE;
+static unsigned int nr_ios = RTCP_NR_IOS;
 char *progname;
 
+struct rtcp_args {
+	char		**sources;
+	char		*target;
+	int		extsize;
+	int		*results;
+};
+
 static void
 usage(void)
 {
-	fprintf(stderr, _("%s [-e extsize] [-p] [-V] source target\n"), progname);
+	fprintf(stderr,
+_("%s [-e extsize] [-b iosize] [-n nr_ios] [-j nr_files] [-p] [-v] [-V] source target\n"),
+		progname);
 	exit(2);
 }
 
+/*
+ * While path has trailing /, remove them unless only "/".
+ */
+static void
+strip_trailing_slashes(
+	char		*path)
+{
+	char		*sp = path + strlen(path);
+
+	while (sp > path + 1 && *(sp - 1) == '/')
+		*--sp = '\0';
+}
+
+static void
+rtcp_worker(
+	struct workqueue	*wq,
+	uint32_t		index,
+	void			*arg)
+{
+	struct rtcp_args	*ra = arg;
+
+	ra->results[index] = rtcp(ra->sources[index], ra->target,
+			ra->extsize);
+}
+
 int
 main(int argc, char **argv)
 {
 	int	c, i, r, errflg = 0;
 	struct stat	s2;
 	int		extsize = - 1;
+	unsigned int	nr_files = 1;
+	struct rtcp_args	ra;
+	struct workqueue	wq;
 
 	progname = basename(argv[0]);
 	setlocale(LC_ALL, "");
 	bindtextdomain(PACKAGE, LOCALEDIR);
 	textdomain(PACKAGE);
 
-	while ((c = getopt(argc, argv, "pe:V")) != EOF) {
+	while ((c = getopt(argc, argv, "b:e:j:n:pvV")) != EOF) {
 		switch (c) {
+		case 'b':
+			iosize = cvtnum(0, 0, optarg);
+			if (iosize <= 0 || iosize > INT_MAX) {
+				fprintf(stderr, _("%s: bad I/O size %s\n"),
+					progname, optarg);
+				errflg++;
+			}
+			break;
 		case 'e':
 			extsize = atoi(optarg);
 			break;
+		case 'j':
+			nr_files = atoi(optarg);
+			if (nr_files == 0)
+				errflg++;
+			break;
+		case 'n':
+			nr_ios = atoi(optarg);
+			if (nr_ios == 0)
+				errflg++;
+			break;
 		case 'p':
 			pflag = 1;
 			break;
+		case 'v':
+			vflag = 1;
+			break;
 		case 'V':
 			printf(_("%s version %s\n"), progname, VERSION);
 			exit(0);
@@ -85,11 +157,39 @@ main(int argc, char **argv)
 
 	/*
 	 * Perform a multiple argument rtcp by
-	 * multiple invocations of rtcp().
+	 * multiple invocations of rtcp(), up to
+	 * nr_files of them at a time.
 	 */
+	strip_trailing_slashes(argv[argc-1]);
+	ra.sources = argv;
+	ra.target = argv[argc-1];
+	ra.extsize = extsize;
+	ra.results = calloc(argc - 1, sizeof(int));
+	if (!ra.results) {
+		fprintf(stderr, _("%s: %s\n"), progname, strerror(errno));
+		exit(2);
+	}
+
+	if (nr_files > 1 && argc > 2) {
+		r = -workqueue_create(&wq, NULL, min(nr_files, argc - 1));
+		if (r) {
+			fprintf(stderr, _("%s: could not start threads: %s\n"),
+				progname, strerror(r));
+			exit(2);
+		}
+		for (i = 0; i < argc-1; i++)
+			workqueue_add(&wq, rtcp_worker, i, &ra);
+		workqueue_terminate(&wq);
+		workqueue_destroy(&wq);
+	} else {
+		for (i = 0; i < argc-1; i++)
+			rtcp_worker(NULL, i, &ra);
+	}
+
 	r = 0;
 	for (i = 0; i < argc-1; i++)
-		r += rtcp(argv[i], argv[argc-1], extsize);
+		r += ra.results[i];
+	free(ra.results);
 
 	/*
 	 * Show errors by nonzero exit code.
@@ -97,31 +197,59 @@ main(int argc, char **argv)
 	exit(r?2:0);
 }
 
+/*
+ * Preallocate the destination in chunks of whole realtime extents, so the
+ * allocator sees the full size of the file up front rather than one direct
+ * write at a time.
+ */
+static int
+rtcp_prealloc(
+	char			*target,
+	int			tofd,
+	off_t			size,
+	int			rtextsize)
+{
+	off_t			chunk;
+	off_t			off;
+
+	chunk = RTCP_PREALLOC_CHUNK - RTCP_PREALLOC_CHUNK % rtextsize;
+	if (chunk == 0)
+		chunk = rtextsize;
+	size = roundup(size, rtextsize);
+
+	for (off = 0; off < size; off += chunk) {
+		if (fallocate(tofd, FALLOC_FL_KEEP_SIZE, off,
+				min(chunk, size - off)) == 0)
+			continue;
+		if (errno == EOPNOTSUPP)
+			return 0;
+		fprintf(stderr, _("%s: preallocation of %s failed: %s\n"),
+			progname, target, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
 int
 rtcp( char *source, char *target, int fextsize)
 {
-	int		fromfd, tofd, readct, writect, iosz, reopen;
+	int		fromfd, tofd, reopen, error;
 	int		remove = 0, rtextsize;
-	char		*sp, *fbuf, *ptr;
+	char		*ptr;
 	char		tbuf[ PATH_MAX ];
 	struct stat	s1, s2;
 	struct fsxattr	fsxattr;
-	struct dioattr	dioattr;
+	struct dioattr	dioattr, sdioattr;
+	off_t		size;
+	size_t		iosz;
+	int		mem_align;
+	struct timespec	start, stop;
 
 	/*
-	 * While source or target have trailing /, remove them
-	 * unless only "/".
+	 * The target has already had its trailing / removed by main,
+	 * and may be shared with other copies running at the same time.
 	 */
-	sp = source + strlen(source);
-	if (sp) {
-		while (*--sp == '/' && sp > source)
-			*sp = '\0';
-	}
-	sp = target + strlen(target);
-	if (sp) {
-		while (*--sp == '/' && sp > target)
-			*sp = '\0';
-	}
+	strip_trailing_slashes(source);
 
 	if ( stat(source, &s1) ) {
 		fprintf(stderr, _("%s: failed stat on %s: %s\n"),
@@ -254,18 +382,6 @@ rtcp( char *source, char *target, int fextsize)
 		}
 	}
 
-	if (reopen) {
-		close( fromfd );
-		if ( (fromfd = open(source, O_RDONLY )) < 0 ) {
-			fprintf(stderr, _("%s: open of %s source failed: %s\n"),
-				progname, source, strerror(errno));
-			close( tofd );
-			if (remove)
-				unlink( tbuf );
-			return( -1 );
-		}
-	}
-
 	/*
 	 * get direct I/O parameters
 	 */
@@ -280,6 +396,32 @@ rtcp( char *source, char *target, int fextsize)
 		return( -1 );
 	}
 
+	/*
+	 * Reads only overlap if the source uses direct I/O too, so keep a
+	 * source that isn't a realtime file open O_DIRECT if its limits fit
+	 * the chunks we copy in, and only fall back to buffered reads
+	 * otherwise.
+	 */
+	mem_align = dioattr.d_mem;
+	if (reopen &&
+	    !xfsctl(source, fromfd, XFS_IOC_DIOINFO, &sdioattr) &&
+	    dioattr.d_miniosz % sdioattr.d_miniosz == 0) {
+		mem_align = max(dioattr.d_mem, sdioattr.d_mem);
+		reopen = 0;
+	}
+
+	if (reopen) {
+		close( fromfd );
+		if ( (fromfd = open(source, O_RDONLY )) < 0 ) {
+			fprintf(stderr, _("%s: open of %s source failed: %s\n"),
+				progname, source, strerror(errno));
+			close( tofd );
+			if (remove)
+				unlink( tbuf );
+			return( -1 );
+		}
+	}
+
 	if ( rtextsize % dioattr.d_miniosz ) {
 		fprintf(stderr, _("%s: extent size %d not a multiple of %d.\n"),
 			progname, rtextsize, dioattr.d_miniosz);
@@ -315,51 +457,44 @@ rtcp( char *source, char *target, int fextsize)
 		}
 	}
 
-	iosz =  dioattr.d_miniosz;
-	fbuf = memalign( dioattr.d_mem, iosz);
-	memset(fbuf, 0, iosz);
+	size = s1.st_size;
+	if (size % dioattr.d_miniosz)
+		size = roundup(size, dioattr.d_miniosz);
 
 	/*
-	 * read the entire source file
+	 * Copy in whole realtime extents where the direct I/O limits
+	 * allow it, and in whole blocks otherwise.
 	 */
-	while ( ( readct = read( fromfd, fbuf, iosz) ) != 0 ) {
-		/*
-		 * if there is a read error - break
-		 */
-		if (readct < 0 ) {
-			break;
-		}
-
-		/*
-		 * if there is a short read, pad to a block boundary
-		 */
-		if ( readct != iosz ) {
-			if ( (readct % dioattr.d_miniosz)  != 0 )  {
-				readct = ( (readct/dioattr.d_miniosz) + 1 ) *
-					 dioattr.d_miniosz;
-			}
-		}
-
-		/*
-		 * write to target file
-		 */
-		writect = write( tofd, fbuf, readct);
-
-		if ( writect != readct ) {
-			fprintf(stderr, _("%s: write error: %s\n"),
-				progname, strerror(errno));
-			close(fromfd);
-			close(tofd);
-			free( fbuf );
-			return( -1 );
-		}
-
-		memset( fbuf, 0, iosz);
+	iosz = roundup(iosize, rtextsize);
+	if (iosz > dioattr.d_maxiosz) {
+		iosz = dioattr.d_maxiosz - dioattr.d_maxiosz % rtextsize;
+		if (iosz == 0)
+			iosz = dioattr.d_maxiosz -
+				dioattr.d_maxiosz % dioattr.d_miniosz;
 	}
 
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	error = rtcp_prealloc(tbuf, tofd, size, rtextsize);
+	if (!error)
+		error = rtcp_copy(source, tbuf, fromfd, tofd, s1.st_size,
+				iosz, nr_ios, mem_align, dioattr.d_miniosz);
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+
 	close(fromfd);
 	close(tofd);
-	free( fbuf );
+	if (error)
+		return( -1 );
+
+	if (vflag) {
+		double	secs = (stop.tv_sec - start.tv_sec) +
+				(stop.tv_nsec - start.tv_nsec) / 1e9;
+		char	sizestr[32], ratestr[32];
+
+		cvtstr((double)size, sizestr, sizeof(sizestr));
+		cvtstr(secs > 0 ? size / secs : 0, ratestr, sizeof(ratestr));
+		printf(_("%s -> %s: %s in %.2f sec (%s/sec)\n"),
+			source, tbuf, sizestr, secs, ratestr);
+	}
 	return( 0 );
 }
 
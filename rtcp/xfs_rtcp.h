@@ -0,0 +1,11 @@
+// SPDX-License-Identifier: GPL-2.0
+#ifndef __XFS_RTCP_H__
+#define __XFS_RTCP_H__
+
+extern char	*progname;
+
+int rtcp_copy(char *source, char *target, int fromfd, int tofd, off_t size,
+		size_t iosz, unsigned int nr_ios, size_t alignment,
+		size_t miniosz);
+
+#endif	/* __XFS_RTCP_H__ */
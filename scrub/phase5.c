@@ -394,18 +394,30 @@ _("Filesystem has errors, skipping connectivity checks."));
 		return 0;
 	}
 
-	ret = check_fs_label(ctx);
+	/*
+	 * Every thread that checks names gets its own scratch space, and that
+	 * includes the main thread.
+	 */
+	ret = unicrash_init_phase(ctx, scrub_nproc(ctx) + 1);
 	if (ret)
 		return ret;
 
+	ret = check_fs_label(ctx);
+	if (ret)
+		goto out;
+
 	ret = scrub_scan_all_inodes(ctx, check_inode_names, &aborted);
 	if (ret)
-		return ret;
-	if (aborted)
-		return ECANCELED;
+		goto out;
+	if (aborted) {
+		ret = ECANCELED;
+		goto out;
+	}
 
 	scrub_report_preen_triggers(ctx);
-	return 0;
+out:
+	unicrash_end_phase();
+	return ret;
 }
 
 /* Estimate how much work we're going to do. */
@@ -6,6 +6,7 @@
 #include "xfs.h"
 #include <stdint.h>
 #include <stdlib.h>
+#include <assert.h>
 #include <dirent.h>
 #include <sys/types.h>
 #include <sys/statvfs.h>
@@ -14,6 +15,8 @@
 #include <unicode/unorm2.h>
 #include <unicode/uspoof.h>
 #include "libfrog/paths.h"
+#include "libfrog/ptvar.h"
+#include "libfrog/crc32c.h"
 #include "xfs_scrub.h"
 #include "common.h"
 #include "descr.h"
@@ -72,8 +75,52 @@ struct name_entry {
 	size_t			namelen;
 	char			name[0];
 };
-#define NAME_ENTRY_SZ(nl)	(sizeof(struct name_entry) + 1 + \
-				 (nl * sizeof(uint8_t)))
+
+/*
+ * The normalized name and the skeleton are stored after the raw name in the
+ * same allocation so that each name costs us exactly one malloc.
+ */
+#define NAME_ENTRY_NAMESZ(nl)	(((nl) + 1 + sizeof(UChar) - 1) & \
+				 ~(sizeof(UChar) - 1))
+#define NAME_ENTRY_SZ(nl, norml, skell) \
+				(sizeof(struct name_entry) + \
+				 NAME_ENTRY_NAMESZ(nl) + \
+				 ((norml) + 1 + (skell) + 1) * sizeof(UChar))
+
+/*
+ * Per-thread scratch buffers for converting, normalizing, and skeletonizing
+ * names.  The buffers grow to fit the longest name seen by each thread and
+ * are kept until the end of the phase, which means that the only allocation
+ * made for each name is the name entry itself.
+ */
+struct unicrash_scratch {
+	UChar			*unistr;
+	UChar			*normstr;
+	UChar			*skelstr;
+	int32_t			unistrsz;
+	int32_t			normstrsz;
+	int32_t			skelstrsz;
+};
+
+static struct ptvar *unicrash_ptvar;
+
+/* Scratch buffers for when we aren't running in threaded mode. */
+static struct unicrash_scratch global_scratch;
+
+/*
+ * Skeletons of the 7-bit ASCII characters.  NFKC and NFD leave ASCII text
+ * unchanged and confusable mappings are done one code point at a time, so
+ * the skeleton of a pure ASCII name is the concatenation of the skeletons of
+ * its characters.  A length of -1 means that the character maps to something
+ * outside of ASCII, in which case we have to ask libicu.
+ */
+#define ASCII_SKEL_MAX		4
+struct ascii_skel {
+	int8_t			len;
+	char			str[ASCII_SKEL_MAX];
+};
+static struct ascii_skel	ascii_skels[128];
+static bool			ascii_skels_ready;
 
 struct unicrash {
 	struct scrub_ctx	*ctx;
@@ -144,92 +191,276 @@ is_utf8_locale(void)
 	return answer;
 }
 
+/* Make sure that a scratch buffer can hold len characters and a null. */
+static bool
+scratch_grow(
+	UChar			**bufp,
+	int32_t			*szp,
+	int32_t			len)
+{
+	UChar			*p;
+	int32_t			newsz;
+
+	if (len < *szp)
+		return true;
+
+	newsz = max(len + 1, max(*szp * 2, 64));
+	p = realloc(*bufp, newsz * sizeof(UChar));
+	if (!p)
+		return false;
+	*bufp = p;
+	*szp = newsz;
+	return true;
+}
+
+/* Find this thread's scratch buffers. */
+static struct unicrash_scratch *
+unicrash_get_scratch(void)
+{
+	struct unicrash_scratch	*scr;
+	int			ret;
+
+	if (!unicrash_ptvar)
+		return &global_scratch;
+
+	scr = ptvar_get(unicrash_ptvar, &ret);
+	if (ret)
+		return NULL;
+	return scr;
+}
+
+/* Remove control/formatting characters from a skeleton. */
+static int32_t
+skeleton_strip_ignorable(
+	UChar			*skelstr,
+	int32_t			skelstrlen)
+{
+	UChar32			uchr;
+	int32_t			i, j;
+
+	for (i = 0, j = 0; i < skelstrlen; j = i) {
+		U16_NEXT_UNSAFE(skelstr, i, uchr);
+		if (!u_isIDIgnorable(uchr))
+			continue;
+		memmove(&skelstr[j], &skelstr[i],
+				(skelstrlen - i + 1) * sizeof(UChar));
+		skelstrlen -= (i - j);
+		i = j;
+	}
+
+	return skelstrlen;
+}
+
+/* Compute the skeleton of every ASCII character. */
+static void
+ascii_skels_init(void)
+{
+	UChar			in;
+	UChar			out[32];
+	USpoofChecker		*spoof;
+	struct ascii_skel	*as;
+	int32_t			len;
+	int32_t			i;
+	int			c;
+	UErrorCode		uerr = U_ZERO_ERROR;
+
+	if (ascii_skels_ready)
+		return;
+
+	spoof = uspoof_open(&uerr);
+	if (U_FAILURE(uerr))
+		return;
+
+	for (c = 0; c < 128; c++) {
+		as = &ascii_skels[c];
+		as->len = -1;
+
+		/* Null terminates the name, so it never gets here. */
+		if (c == 0)
+			continue;
+
+		in = c;
+		uerr = U_ZERO_ERROR;
+		len = uspoof_getSkeleton(spoof, 0, &in, 1, out,
+				(sizeof(out) / sizeof(out[0])) - 1, &uerr);
+		if (U_FAILURE(uerr))
+			continue;
+		out[len] = 0;
+		len = skeleton_strip_ignorable(out, len);
+		if (len > ASCII_SKEL_MAX)
+			continue;
+
+		for (i = 0; i < len; i++) {
+			if (out[i] >= 0x80)
+				break;
+			as->str[i] = out[i];
+		}
+		if (i == len)
+			as->len = len;
+	}
+
+	uspoof_close(spoof);
+	ascii_skels_ready = true;
+}
+
+/*
+ * Decide if a name is entirely 7-bit ASCII.  Names are checked a word at a
+ * time, which the compiler can turn into vector instructions.
+ */
+static inline bool
+is_ascii_name(
+	const char		*name,
+	size_t			namelen)
+{
+	const uint64_t		highbits = 0x8080808080808080ULL;
+	uint64_t		word;
+	uint64_t		acc = 0;
+	size_t			i;
+
+	for (i = 0; i + sizeof(word) <= namelen; i += sizeof(word)) {
+		memcpy(&word, name + i, sizeof(word));
+		acc |= word;
+	}
+	for (; i < namelen; i++)
+		acc |= (uint8_t)name[i];
+
+	return (acc & highbits) == 0;
+}
+
 /*
- * Generate normalized form and skeleton of the name.  If this fails, just
- * forget everything and return false; this is an advisory checker.
+ * Compute the skeleton of a pure ASCII name from the lookup table.  Returns
+ * the skeleton length, or -1 if libicu has to do it.
+ */
+static int32_t
+ascii_name_skeleton(
+	struct unicrash_scratch	*scr,
+	const char		*name,
+	size_t			namelen)
+{
+	const struct ascii_skel	*as;
+	UChar			*p;
+	size_t			i;
+	int8_t			j;
+
+	if (!ascii_skels_ready)
+		return -1;
+	if (!scratch_grow(&scr->skelstr, &scr->skelstrsz,
+				namelen * ASCII_SKEL_MAX))
+		return -1;
+
+	p = scr->skelstr;
+	for (i = 0; i < namelen; i++) {
+		as = &ascii_skels[(uint8_t)name[i]];
+		if (as->len < 0)
+			return -1;
+		for (j = 0; j < as->len; j++)
+			*p++ = as->str[j];
+	}
+	*p = 0;
+
+	return p - scr->skelstr;
+}
+
+/*
+ * Generate normalized form and skeleton of the name in the scratch buffers.
+ * If this fails, just forget everything and return false; this is an
+ * advisory checker.
  */
 static bool
 name_entry_compute_checknames(
 	struct unicrash		*uc,
-	struct name_entry	*entry)
+	struct unicrash_scratch	*scr,
+	const char		*name,
+	size_t			namelen,
+	UChar			**normstrp,
+	int32_t			*normstrlenp,
+	int32_t			*skelstrlenp)
 {
 	UChar			*normstr;
-	UChar			*unistr;
-	UChar			*skelstr;
 	int32_t			normstrlen;
 	int32_t			unistrlen;
 	int32_t			skelstrlen;
-	UChar32			uchr;
-	int32_t			i, j;
+	size_t			i;
+	bool			ascii;
 
 	UErrorCode		uerr = U_ZERO_ERROR;
 
-	/* Convert bytestr to unistr for normalization */
-	u_strFromUTF8(NULL, 0, &unistrlen, entry->name, entry->namelen, &uerr);
-	if (uerr != U_BUFFER_OVERFLOW_ERROR)
+	/* UTF-8 never needs more UTF-16 code units than it has bytes. */
+	if (!scratch_grow(&scr->unistr, &scr->unistrsz, namelen))
 		return false;
-	uerr = U_ZERO_ERROR;
-	unistr = calloc(unistrlen + 1, sizeof(UChar));
-	if (!unistr)
-		return false;
-	u_strFromUTF8(unistr, unistrlen, NULL, entry->name, entry->namelen,
+
+	/*
+	 * Pure ASCII names are already in NFKC form, so widen them straight
+	 * into the normalized string and skip libicu.
+	 */
+	ascii = is_ascii_name(name, namelen);
+	if (ascii) {
+		for (i = 0; i < namelen; i++)
+			scr->unistr[i] = (uint8_t)name[i];
+		scr->unistr[namelen] = 0;
+		unistrlen = namelen;
+		normstr = scr->unistr;
+		normstrlen = unistrlen;
+		goto skeleton;
+	}
+
+	/* Convert bytestr to unistr for normalization */
+	u_strFromUTF8(scr->unistr, scr->unistrsz, &unistrlen, name, namelen,
 			&uerr);
 	if (U_FAILURE(uerr))
-		goto out_unistr;
-
-	/* Normalize the string. */
-	normstrlen = unorm2_normalize(uc->normalizer, unistr, unistrlen, NULL,
-			0, &uerr);
-	if (uerr != U_BUFFER_OVERFLOW_ERROR)
-		goto out_unistr;
-	uerr = U_ZERO_ERROR;
-	normstr = calloc(normstrlen + 1, sizeof(UChar));
-	if (!normstr)
-		goto out_unistr;
-	unorm2_normalize(uc->normalizer, unistr, unistrlen, normstr, normstrlen,
-			&uerr);
+		return false;
+
+	/*
+	 * Normalize the string.  The capacities passed to libicu always leave
+	 * room for a null terminator.
+	 */
+	if (!scratch_grow(&scr->normstr, &scr->normstrsz, unistrlen))
+		return false;
+	normstrlen = unorm2_normalize(uc->normalizer, scr->unistr, unistrlen,
+			scr->normstr, scr->normstrsz - 1, &uerr);
+	if (uerr == U_BUFFER_OVERFLOW_ERROR) {
+		if (!scratch_grow(&scr->normstr, &scr->normstrsz, normstrlen))
+			return false;
+		uerr = U_ZERO_ERROR;
+		normstrlen = unorm2_normalize(uc->normalizer, scr->unistr,
+				unistrlen, scr->normstr, scr->normstrsz - 1,
+				&uerr);
+	}
 	if (U_FAILURE(uerr))
-		goto out_normstr;
+		return false;
+	scr->normstr[normstrlen] = 0;
+	normstr = scr->normstr;
 
+skeleton:
 	/* Compute skeleton. */
-	skelstrlen = uspoof_getSkeleton(uc->spoof, 0, unistr, unistrlen, NULL,
-			0, &uerr);
-	if (uerr != U_BUFFER_OVERFLOW_ERROR)
-		goto out_normstr;
-	uerr = U_ZERO_ERROR;
-	skelstr = calloc(skelstrlen + 1, sizeof(UChar));
-	if (!skelstr)
-		goto out_normstr;
-	uspoof_getSkeleton(uc->spoof, 0, unistr, unistrlen, skelstr, skelstrlen,
-			&uerr);
+	skelstrlen = ascii ? ascii_name_skeleton(scr, name, namelen) : -1;
+	if (skelstrlen >= 0)
+		goto out;
+
+	if (!scratch_grow(&scr->skelstr, &scr->skelstrsz, unistrlen))
+		return false;
+	skelstrlen = uspoof_getSkeleton(uc->spoof, 0, scr->unistr, unistrlen,
+			scr->skelstr, scr->skelstrsz - 1, &uerr);
+	if (uerr == U_BUFFER_OVERFLOW_ERROR) {
+		if (!scratch_grow(&scr->skelstr, &scr->skelstrsz, skelstrlen))
+			return false;
+		uerr = U_ZERO_ERROR;
+		skelstrlen = uspoof_getSkeleton(uc->spoof, 0, scr->unistr,
+				unistrlen, scr->skelstr, scr->skelstrsz - 1,
+				&uerr);
+	}
 	if (U_FAILURE(uerr))
-		goto out_skelstr;
+		return false;
+	scr->skelstr[skelstrlen] = 0;
 
 	/* Remove control/formatting characters from skeleton. */
-	for (i = 0, j = 0; i < skelstrlen; j = i) {
-		U16_NEXT_UNSAFE(skelstr, i, uchr);
-		if (!u_isIDIgnorable(uchr))
-			continue;
-		memmove(&skelstr[j], &skelstr[i],
-				(skelstrlen - i + 1) * sizeof(UChar));
-		skelstrlen -= (i - j);
-		i = j;
-	}
+	skelstrlen = skeleton_strip_ignorable(scr->skelstr, skelstrlen);
 
-	entry->skelstr = skelstr;
-	entry->skelstrlen = skelstrlen;
-	entry->normstr = normstr;
-	entry->normstrlen = normstrlen;
-	free(unistr);
+out:
+	*normstrp = normstr;
+	*normstrlenp = normstrlen;
+	*skelstrlenp = skelstrlen;
 	return true;
-
-out_skelstr:
-	free(skelstr);
-out_normstr:
-	free(normstr);
-out_unistr:
-	free(unistr);
-	return false;
 }
 
 /* Create a new name entry, returns false if we could not succeed. */
@@ -240,11 +471,24 @@ name_entry_create(
 	xfs_ino_t		ino,
 	struct name_entry	**entry)
 {
+	struct unicrash_scratch	*scr;
 	struct name_entry	*new_entry;
+	UChar			*normstr;
+	int32_t			normstrlen;
+	int32_t			skelstrlen;
 	size_t			namelen = strlen(name);
 
+	scr = unicrash_get_scratch();
+	if (!scr)
+		return false;
+
+	/* Normalize/skeletonize name to find collisions. */
+	if (!name_entry_compute_checknames(uc, scr, name, namelen, &normstr,
+				&normstrlen, &skelstrlen))
+		return false;
+
 	/* Create new entry */
-	new_entry = calloc(NAME_ENTRY_SZ(namelen), 1);
+	new_entry = malloc(NAME_ENTRY_SZ(namelen, normstrlen, skelstrlen));
 	if (!new_entry)
 		return false;
 	new_entry->next = NULL;
@@ -253,16 +497,19 @@ name_entry_create(
 	new_entry->name[namelen] = 0;
 	new_entry->namelen = namelen;
 
-	/* Normalize/skeletonize name to find collisions. */
-	if (!name_entry_compute_checknames(uc, new_entry))
-		goto out;
+	new_entry->normstr = (UChar *)(new_entry->name +
+			NAME_ENTRY_NAMESZ(namelen));
+	new_entry->normstrlen = normstrlen;
+	memcpy(new_entry->normstr, normstr, normstrlen * sizeof(UChar));
+	new_entry->normstr[normstrlen] = 0;
+
+	new_entry->skelstr = new_entry->normstr + normstrlen + 1;
+	new_entry->skelstrlen = skelstrlen;
+	memcpy(new_entry->skelstr, scr->skelstr, skelstrlen * sizeof(UChar));
+	new_entry->skelstr[skelstrlen] = 0;
 
 	*entry = new_entry;
 	return true;
-
-out:
-	free(new_entry);
-	return false;
 }
 
 /* Free a name entry */
@@ -270,52 +517,21 @@ static void
 name_entry_free(
 	struct name_entry	*entry)
 {
-	free(entry->normstr);
-	free(entry->skelstr);
 	free(entry);
 }
 
-/* Adapt the dirhash function from libxfs, avoid linking with libxfs. */
-
-#define rol32(x, y)		(((x) << (y)) | ((x) >> (32 - (y))))
-
 /*
- * Implement a simple hash on a character string.
- * Rotate the hash value by 7 bits, then XOR each character in.
- * This is implemented with some source-level loop unrolling.
+ * Hash the skeleton to pick a bucket.  The skeleton is stored as UTF-16, so
+ * half of the bytes of an ASCII name are zero; the dirhash that we used to
+ * use here dropped so many bits that large directories full of similar
+ * names piled up in a few hundred buckets.  crc32c mixes every bit in.
  */
 static xfs_dahash_t
 name_entry_hash(
 	struct name_entry	*entry)
 {
-	uint8_t			*name;
-	size_t			namelen;
-	xfs_dahash_t		hash;
-
-	name = (uint8_t *)entry->skelstr;
-	namelen = entry->skelstrlen * sizeof(UChar);
-
-	/*
-	 * Do four characters at a time as long as we can.
-	 */
-	for (hash = 0; namelen >= 4; namelen -= 4, name += 4)
-		hash = (name[0] << 21) ^ (name[1] << 14) ^ (name[2] << 7) ^
-		       (name[3] << 0) ^ rol32(hash, 7 * 4);
-
-	/*
-	 * Now do the rest of the characters.
-	 */
-	switch (namelen) {
-	case 3:
-		return (name[0] << 14) ^ (name[1] << 7) ^ (name[2] << 0) ^
-		       rol32(hash, 7 * 3);
-	case 2:
-		return (name[0] << 7) ^ (name[1] << 0) ^ rol32(hash, 7 * 2);
-	case 1:
-		return (name[0] << 0) ^ rol32(hash, 7 * 1);
-	default: /* case 0: */
-		return hash;
-	}
+	return crc32c_le(~0U, (unsigned char const *)entry->skelstr,
+			entry->skelstrlen * sizeof(UChar));
 }
 
 /*
@@ -333,6 +549,20 @@ name_entry_examine(
 	int32_t			i;
 	uint8_t			mask = 0;
 
+	/*
+	 * ASCII has no zero width characters, no right-to-left characters,
+	 * and no direction overrides, so only look for control characters.
+	 */
+	if (is_ascii_name(entry->name, entry->namelen)) {
+		for (i = 0; i < entry->namelen; i++) {
+			if (entry->name[i] < 0x20 || entry->name[i] == 0x7f) {
+				*badflags |= UNICRASH_CONTROL_CHAR;
+				break;
+			}
+		}
+		return;
+	}
+
 	for (i = 0; i < entry->normstrlen;) {
 		U16_NEXT_UNSAFE(entry->normstr, i, uchr);
 
@@ -737,6 +967,55 @@ unicrash_check_fs_label(
 			label, 0);
 }
 
+/* Free one thread's scratch buffers. */
+static int
+unicrash_free_scratch(
+	struct ptvar		*ptv,
+	void			*data,
+	void			*foreach_arg)
+{
+	struct unicrash_scratch	*scr = data;
+
+	free(scr->unistr);
+	free(scr->normstr);
+	free(scr->skelstr);
+	memset(scr, 0, sizeof(*scr));
+	return 0;
+}
+
+/* Allocate the per-thread name scratch buffers for a phase. */
+int
+unicrash_init_phase(
+	struct scrub_ctx	*ctx,
+	unsigned int		nr_threads)
+{
+	int			ret;
+
+	assert(unicrash_ptvar == NULL);
+	ret = -ptvar_alloc(nr_threads, sizeof(struct unicrash_scratch),
+			&unicrash_ptvar);
+	if (ret) {
+		str_liberror(ctx, ret, _("creating name scratch buffers"));
+		return ret;
+	}
+
+	if (is_utf8_locale())
+		ascii_skels_init();
+	return 0;
+}
+
+/* Free the per-thread name scratch buffers. */
+void
+unicrash_end_phase(void)
+{
+	if (unicrash_ptvar) {
+		ptvar_foreach(unicrash_ptvar, unicrash_free_scratch, NULL);
+		ptvar_free(unicrash_ptvar);
+	}
+	unicrash_ptvar = NULL;
+	unicrash_free_scratch(NULL, &global_scratch, NULL);
+}
+
 /* Load libicu and initialize it. */
 bool
 unicrash_load(void)
@@ -25,6 +25,8 @@ int unicrash_check_xattr_name(struct unicrash *uc, struct descr *dsc,
 		const char *attrname);
 int unicrash_check_fs_label(struct unicrash *uc, struct descr *dsc,
 		const char *label);
+int unicrash_init_phase(struct scrub_ctx *ctx, unsigned int nr_threads);
+void unicrash_end_phase(void);
 bool unicrash_load(void);
 void unicrash_unload(void);
 #else
@@ -35,6 +37,8 @@ void unicrash_unload(void);
 # define unicrash_check_dir_name(u, d, n)	(0)
 # define unicrash_check_xattr_name(u, d, n)	(0)
 # define unicrash_check_fs_label(u, d, n)	(0)
+# define unicrash_init_phase(c, n)		(0)
+# define unicrash_end_phase()			do { } while (0)
 # define unicrash_load()			(0)
 # define unicrash_unload()			do { } while (0)
 #endif /* HAVE_LIBICU */
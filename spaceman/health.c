@@ -12,12 +12,27 @@
 #include "libfrog/paths.h"
 #include "libfrog/fsgeom.h"
 #include "libfrog/bulkstat.h"
+#include "libfrog/workqueue.h"
 #include "space.h"
 
 static cmdinfo_t health_cmd;
 static unsigned long long reported;
 static bool comprehensive;
 static bool quiet;
+static bool summary;
+static bool json;
+static unsigned int json_objects;
+
+/* Tallies of metadata health for the summary report. */
+struct health_counts {
+	unsigned long long	sick;		/* unhealthy metadata */
+	unsigned long long	ok;		/* checked and healthy metadata */
+	unsigned long long	objects;	/* objects with unhealthy metadata */
+};
+
+static struct health_counts fs_counts;
+static struct health_counts ag_counts;
+static struct health_counts inode_counts;
 
 static bool has_realtime(const struct xfs_fsop_geom *g)
 {
@@ -158,6 +173,53 @@ static const struct flag_map inode_flags[] = {
 	{0},
 };
 
+static void
+json_print_string(
+	const char			*str)
+{
+	const char			*p;
+
+	putchar('"');
+	for (p = str; *p; p++) {
+		if (*p == '"' || *p == '\\')
+			printf("\\%c", *p);
+		else if ((unsigned char)*p < 0x20)
+			printf("\\u%04x", *p);
+		else
+			putchar(*p);
+	}
+	putchar('"');
+}
+
+/* Count the flags in @mask that apply to this filesystem. */
+static unsigned int
+count_flags(
+	const struct flag_map		*maps,
+	unsigned int			mask)
+{
+	const struct flag_map		*f;
+	unsigned int			nr = 0;
+
+	for (f = maps; f->mask != 0; f++) {
+		if (f->has_fn && !f->has_fn(&file->xfd.fsgeom))
+			continue;
+		if (mask & f->mask)
+			nr++;
+	}
+	return nr;
+}
+
+static struct health_counts *
+flag_map_counts(
+	const struct flag_map		*maps)
+{
+	if (maps == fs_flags)
+		return &fs_counts;
+	if (maps == ag_flags)
+		return &ag_counts;
+	return &inode_counts;
+}
+
 /* Convert a flag mask to a report. */
 static void
 report_sick(
@@ -167,8 +229,20 @@ report_sick(
 	unsigned int			checked)
 {
 	const struct flag_map		*f;
+	struct health_counts		*counts = flag_map_counts(maps);
+	unsigned int			nr = 0;
 	bool				bad;
 
+	if (summary) {
+		nr = count_flags(maps, sick);
+		counts->sick += nr;
+		counts->ok += count_flags(maps, checked & ~sick);
+		reported += nr + count_flags(maps, checked & ~sick);
+		if (nr)
+			counts->objects++;
+		return;
+	}
+
 	for (f = maps; f->mask != 0; f++) {
 		if (f->has_fn && !f->has_fn(&file->xfd.fsgeom))
 			continue;
@@ -178,9 +252,23 @@ report_sick(
 		reported++;
 		if (!bad && quiet)
 			continue;
-		printf("%s %s: %s\n", descr, _(f->descr),
-				bad ? _("unhealthy") : _("ok"));
+		if (!json) {
+			printf("%s %s: %s\n", descr, _(f->descr),
+					bad ? _("unhealthy") : _("ok"));
+			continue;
+		}
+		if (nr++ == 0) {
+			printf("%s\n    {\"object\": ", json_objects++ ? "," : "");
+			json_print_string(descr);
+			printf(", \"metadata\": [");
+		} else {
+			printf(", ");
+		}
+		printf("{\"name\": \"%s\", \"status\": \"%s\"}", f->descr,
+				bad ? "unhealthy" : "ok");
 	}
+	if (nr)
+		printf("]}");
 }
 
 /* Report on an AG's health. */
@@ -255,52 +343,178 @@ report_file_health(
 	return report_inode_health(statb.st_ino, path);
 }
 
-#define BULKSTAT_NR		(128)
+#define BULKSTAT_NR		(1024)
+
+/* Health of one inode that needs reporting. */
+struct inode_health {
+	uint64_t		ino;
+	uint32_t		sick;
+	uint32_t		checked;
+};
+
+/* Inodes from one AG that need reporting, in inode order. */
+struct ag_health {
+	struct inode_health	*inodes;
+	size_t			nr;
+	size_t			size;
+	unsigned long long	ok_flags;	/* checks passed, not kept */
+	int			error;
+};
 
 /*
- * Report on all files' health for a given @agno.  If @agno is NULLAGNUMBER,
- * report on all files in the filesystem.
+ * Bulkstat every inode in an AG and keep the ones that will produce output.
+ * Healthy inodes are only counted when ok metadata is not being printed, so
+ * the results of a scan are no bigger than the report.
  */
-static int
-report_bulkstat_health(
-	xfs_agnumber_t		agno)
+static void
+scan_ag_health(
+	struct workqueue	*wq,
+	uint32_t		agno,
+	void			*arg)
 {
+	struct ag_health	*ah = (struct ag_health *)arg + agno;
 	struct xfs_bulkstat_req	*breq;
-	char			descr[256];
+	struct xfs_bulkstat	*bs;
+	struct inode_health	*ih;
 	uint32_t		i;
 	int			error;
 
 	error = -xfrog_bulkstat_alloc_req(BULKSTAT_NR, 0, &breq);
 	if (error) {
-		xfrog_perror(error, "bulk alloc req");
-		exitcode = 1;
-		return 1;
+		ah->error = error;
+		return;
 	}
-
-	if (agno != NULLAGNUMBER)
-		xfrog_bulkstat_set_ag(breq, agno);
+	xfrog_bulkstat_set_ag(breq, agno);
 
 	do {
 		error = -xfrog_bulkstat(&file->xfd, breq);
 		if (error)
 			break;
 		for (i = 0; i < breq->hdr.ocount; i++) {
-			snprintf(descr, sizeof(descr) - 1, _("inode %"PRIu64),
-					breq->bulkstat[i].bs_ino);
-			report_sick(descr, inode_flags,
-					breq->bulkstat[i].bs_sick,
-					breq->bulkstat[i].bs_checked);
+			bs = &breq->bulkstat[i];
+			if (!bs->bs_sick && (quiet || summary)) {
+				ah->ok_flags += count_flags(inode_flags,
+						bs->bs_checked);
+				continue;
+			}
+			if (!bs->bs_sick && !bs->bs_checked)
+				continue;
+			if (ah->nr == ah->size) {
+				ih = realloc(ah->inodes, (ah->size + 64) * 2 *
+						sizeof(struct inode_health));
+				if (!ih) {
+					error = errno;
+					goto out;
+				}
+				ah->inodes = ih;
+				ah->size = (ah->size + 64) * 2;
+			}
+			ih = &ah->inodes[ah->nr++];
+			ih->ino = bs->bs_ino;
+			ih->sick = bs->bs_sick;
+			ih->checked = bs->bs_checked;
 		}
 	} while (breq->hdr.ocount > 0);
+out:
+	ah->error = error;
+	free(breq);
+}
 
-	if (error)
-		xfrog_perror(error, "bulkstat");
+/*
+ * Report on all files' health for a given @agno.  If @agno is NULLAGNUMBER,
+ * report on all files in the filesystem, scanning the AGs in parallel.
+ */
+static int
+report_bulkstat_health(
+	xfs_agnumber_t		agno)
+{
+	struct workqueue	wq;
+	struct ag_health	*ahs, *ah;
+	char			descr[256];
+	xfs_agnumber_t		first = agno, last = agno;
+	size_t			i;
+	int			error = 0;
 
-	free(breq);
+	if (agno == NULLAGNUMBER) {
+		first = 0;
+		last = file->xfd.fsgeom.agcount - 1;
+	}
+
+	ahs = calloc(last + 1, sizeof(struct ag_health));
+	if (!ahs) {
+		xfrog_perror(-errno, "bulk alloc req");
+		exitcode = 1;
+		return 1;
+	}
+
+	if (first == last) {
+		scan_ag_health(NULL, first, ahs);
+	} else {
+		error = -workqueue_create(&wq, NULL,
+				min(platform_nproc(), last - first + 1));
+		if (error) {
+			xfrog_perror(error, "creating bulkstat threads");
+			goto out;
+		}
+		for (agno = first; agno <= last; agno++)
+			workqueue_add(&wq, scan_ag_health, agno, ahs);
+		workqueue_terminate(&wq);
+		workqueue_destroy(&wq);
+	}
+
+	for (agno = first; agno <= last; agno++) {
+		ah = &ahs[agno];
+		for (i = 0; i < ah->nr; i++) {
+			snprintf(descr, sizeof(descr) - 1, _("inode %"PRIu64),
+					ah->inodes[i].ino);
+			report_sick(descr, inode_flags, ah->inodes[i].sick,
+					ah->inodes[i].checked);
+		}
+		reported += ah->ok_flags;
+		if (summary)
+			inode_counts.ok += ah->ok_flags;
+		if (ah->error) {
+			error = ah->error;
+			xfrog_perror(error, "bulkstat");
+			break;
+		}
+	}
+
+out:
+	for (agno = first; agno <= last; agno++)
+		free(ahs[agno].inodes);
+	free(ahs);
 	return error;
 }
 
-#define OPT_STRING ("a:cfi:q")
+/* Print the totals collected in summary mode. */
+static void
+report_summary(void)
+{
+	if (json) {
+		printf(
+"  \"summary\": {\n"
+"    \"filesystem\": {\"unhealthy\": %llu, \"ok\": %llu},\n"
+"    \"ags\": {\"unhealthy\": %llu, \"ok\": %llu, \"unhealthy_ags\": %llu},\n"
+"    \"inodes\": {\"unhealthy\": %llu, \"ok\": %llu, \"unhealthy_inodes\": %llu}\n"
+"  },\n",
+			fs_counts.sick, fs_counts.ok,
+			ag_counts.sick, ag_counts.ok, ag_counts.objects,
+			inode_counts.sick, inode_counts.ok,
+			inode_counts.objects);
+		return;
+	}
+
+	printf(_("filesystem: %llu unhealthy, %llu ok\n"),
+			fs_counts.sick, fs_counts.ok);
+	printf(_("AGs: %llu unhealthy in %llu AGs, %llu ok\n"),
+			ag_counts.sick, ag_counts.objects, ag_counts.ok);
+	printf(_("inodes: %llu unhealthy in %llu inodes, %llu ok\n"),
+			inode_counts.sick, inode_counts.objects,
+			inode_counts.ok);
+}
+
+#define OPT_STRING ("a:cfi:jqs")
 
 /* Report on health problems in XFS filesystem. */
 static int
@@ -312,9 +526,14 @@ health_f(
 	xfs_agnumber_t		agno;
 	bool			default_report = true;
 	int			c;
-	int			ret;
+	int			ret = 0;
 
 	reported = 0;
+	comprehensive = quiet = summary = json = false;
+	json_objects = 0;
+	memset(&fs_counts, 0, sizeof(fs_counts));
+	memset(&ag_counts, 0, sizeof(ag_counts));
+	memset(&inode_counts, 0, sizeof(inode_counts));
 
 	if (file->xfd.fsgeom.version != XFS_FSOP_GEOM_VERSION_V5) {
 		perror("health");
@@ -350,9 +569,15 @@ health_f(
 				return 1;
 			}
 			break;
+		case 'j':
+			json = true;
+			break;
 		case 'q':
 			quiet = true;
 			break;
+		case 's':
+			summary = true;
+			break;
 		default:
 			return command_usage(&health_cmd);
 		}
@@ -360,6 +585,9 @@ health_f(
 	if (optind < argc)
 		default_report = false;
 
+	if (json)
+		printf("{\n  \"objects\": [");
+
 	/* Reparse arguments, this time for reporting actions. */
 	optind = 1;
 	while ((c = getopt(argc, argv, OPT_STRING)) != EOF) {
@@ -370,7 +598,7 @@ health_f(
 			if (!ret && comprehensive)
 				ret = report_bulkstat_health(agno);
 			if (ret)
-				return 1;
+				goto out;
 			break;
 		case 'f':
 			report_sick(_("filesystem"), fs_flags,
@@ -379,14 +607,14 @@ health_f(
 			if (comprehensive) {
 				ret = report_bulkstat_health(NULLAGNUMBER);
 				if (ret)
-					return 1;
+					goto out;
 			}
 			break;
 		case 'i':
 			x = strtoll(optarg, NULL, 10);
 			ret = report_inode_health(x, NULL);
 			if (ret)
-				return 1;
+				goto out;
 			break;
 		default:
 			break;
@@ -396,7 +624,7 @@ health_f(
 	for (c = optind; c < argc; c++) {
 		ret = report_file_health(argv[c]);
 		if (ret)
-			return 1;
+			goto out;
 	}
 
 	/* No arguments gets us a summary of fs state. */
@@ -407,15 +635,30 @@ health_f(
 		for (agno = 0; agno < file->xfd.fsgeom.agcount; agno++) {
 			ret = report_ag_sick(agno);
 			if (ret)
-				return 1;
+				goto out;
 		}
 		if (comprehensive) {
 			ret = report_bulkstat_health(NULLAGNUMBER);
 			if (ret)
-				return 1;
+				goto out;
 		}
 	}
 
+out:
+	/* Always close the JSON document, even if we stopped early. */
+	if (json) {
+		printf("%s],\n", json_objects ? "\n  " : "");
+		if (summary && !ret)
+			report_summary();
+		if (ret)
+			printf("  \"error\": true,\n");
+		printf("  \"collected\": %s\n}\n", reported ? "true" : "false");
+	} else if (summary && !ret) {
+		report_summary();
+	}
+	if (ret)
+		return 1;
+
 	if (!reported) {
 		fprintf(stderr,
 _("Health status has not been collected for this filesystem.\n"));
@@ -437,7 +680,9 @@ health_help(void)
 " -c       -- Report on the health of all inodes.\n"
 " -f       -- Report health of the overall filesystem.\n"
 " -i inum  -- Report health of a given inode number.\n"
+" -j       -- Print the report as JSON.\n"
 " -q       -- Only report unhealthy metadata.\n"
+" -s       -- Only report counts of unhealthy and ok metadata.\n"
 " paths    -- Report health of the given file path.\n"
 "\n"));
 
@@ -448,7 +693,7 @@ static cmdinfo_t health_cmd = {
 	.cfunc = health_f,
 	.argmin = 0,
 	.argmax = -1,
-	.args = "[-a agno] [-c] [-f] [-i inum] [-q] [paths]",
+	.args = "[-a agno] [-c] [-f] [-i inum] [-j] [-q] [-s] [paths]",
 	.flags = CMD_FLAG_ONESHOT,
 	.help = health_help,
 };